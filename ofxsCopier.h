@@ -23,13 +23,468 @@
 #ifndef IO_ofxsCopier_h
 #define IO_ofxsCopier_h
 
+#include <cstddef>
 #include <cstring>
+#include <vector>
 #include <algorithm>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OFXS_COPIER_SSE2
+#include <emmintrin.h>
+#endif
+// F16C is available with AVX2 (MSVC does not define __F16C__)
+#if defined(OFXS_COPIER_SSE2) && ( defined(__F16C__) || defined(__AVX2__) )
+#define OFXS_COPIER_F16C
+#include <immintrin.h>
+#endif
+
 #include "ofxsPixelProcessor.h"
 #include "ofxsMaskMix.h"
+#include "ofxsMaskOccupancy.h"
+#include "ofxsLut.h"
+#include "ofxsMacros.h"
+
+// regions larger than this (about the size of a last-level cache) are written with streaming stores
+#define kOfxsCopierStreamingBytes (8 * 1024 * 1024)
+// regions larger than this are filled by several threads
+#define kOfxsCopierThreadedFillBytes (1024 * 1024)
 
 namespace OFX {
+// Should a region of that many bytes be written with streaming (non-temporal) stores?
+// Streaming stores write to memory without reading the destination lines into the cache first,
+// and do not evict the data of the other images, but the destination is not in the cache afterwards.
+inline bool
+ofxsUseStreamingStores(double bytes)
+{
+    return bytes >= kOfxsCopierStreamingBytes;
+}
+
+// the number of bytes in a window of an image
+inline double
+ofxsWindowBytes(const OfxRectI & window,
+                int pixelBytes)
+{
+    if ( (window.x2 <= window.x1) || (window.y2 <= window.y1) ) {
+        return 0.;
+    }
+
+    return (double)(window.x2 - window.x1) * (window.y2 - window.y1) * pixelBytes;
+}
+
+// set a row of bytes to zero, optionally with streaming stores
+inline void
+ofxsZeroRow(void *dst,
+            std::size_t bytes,
+            bool streaming)
+{
+#ifdef OFXS_COPIER_SSE2
+    if (streaming && (bytes >= 64) ) {
+        char *d = (char *)dst;
+        // streaming stores must be aligned
+        const std::size_t head = ( 16 - ( (std::size_t)d & 15 ) ) & 15;
+        std::memset(d, 0, head);
+        d += head;
+        bytes -= head;
+        const __m128i zero = _mm_setzero_si128();
+        for (; bytes >= 64; bytes -= 64, d += 64) {
+            _mm_stream_si128( (__m128i *)d, zero );
+            _mm_stream_si128( (__m128i *)(d + 16), zero );
+            _mm_stream_si128( (__m128i *)(d + 32), zero );
+            _mm_stream_si128( (__m128i *)(d + 48), zero );
+        }
+        for (; bytes >= 16; bytes -= 16, d += 16) {
+            _mm_stream_si128( (__m128i *)d, zero );
+        }
+        std::memset(d, 0, bytes);
+        // streaming stores are weakly ordered: make them visible before the image is used
+        _mm_sfence();
+
+        return;
+    }
+#else
+    (void)streaming;
+#endif
+    std::memset(dst, 0, bytes);
+}
+
+// copy a row of bytes, optionally with streaming stores. The rows must not overlap.
+inline void
+ofxsCopyRow(void *dst,
+            const void *src,
+            std::size_t bytes,
+            bool streaming)
+{
+#ifdef OFXS_COPIER_SSE2
+    if (streaming && (bytes >= 64) ) {
+        char *d = (char *)dst;
+        const char *s = (const char *)src;
+        // streaming stores must be aligned, the loads need not be
+        const std::size_t head = ( 16 - ( (std::size_t)d & 15 ) ) & 15;
+        std::memcpy(d, s, head);
+        d += head;
+        s += head;
+        bytes -= head;
+        for (; bytes >= 64; bytes -= 64, d += 64, s += 64) {
+            const __m128i a = _mm_loadu_si128( (const __m128i *)s );
+            const __m128i b = _mm_loadu_si128( (const __m128i *)(s + 16) );
+            const __m128i c = _mm_loadu_si128( (const __m128i *)(s + 32) );
+            const __m128i e = _mm_loadu_si128( (const __m128i *)(s + 48) );
+            _mm_stream_si128( (__m128i *)d, a );
+            _mm_stream_si128( (__m128i *)(d + 16), b );
+            _mm_stream_si128( (__m128i *)(d + 32), c );
+            _mm_stream_si128( (__m128i *)(d + 48), e );
+        }
+        for (; bytes >= 16; bytes -= 16, d += 16, s += 16) {
+            _mm_stream_si128( (__m128i *)d, _mm_loadu_si128( (const __m128i *)s ) );
+        }
+        std::memcpy(d, s, bytes);
+        // streaming stores are weakly ordered: make them visible before the image is used
+        _mm_sfence();
+
+        return;
+    }
+#else
+    (void)streaming;
+#endif
+    std::memcpy(dst, src, bytes);
+}
+
+// fill a row of bytes with copies of its first patternBytes bytes (eg. a pixel, or one period of a periodic row).
+// The copies are made from the start of the row, which is in the cache.
+inline void
+ofxsRepeatRow(void *dst,
+              std::size_t patternBytes,
+              std::size_t bytes)
+{
+    assert(patternBytes > 0);
+    char *d = (char *)dst;
+    std::size_t filled = std::min(patternBytes, bytes);
+
+#ifdef OFXS_COPIER_SSE2
+    if ( (16 % patternBytes == 0) && (bytes >= 32) ) {
+        // broadcast the pattern to a vector (eg. a ubyte, ushort or float RGBA pixel)
+        char pattern[16];
+        for (int i = 0; i < 16; ++i) {
+            pattern[i] = d[i % patternBytes];
+        }
+        const __m128i v = _mm_loadu_si128( (const __m128i *)pattern );
+        for (; filled + 16 <= bytes; filled += 16) {
+            _mm_storeu_si128( (__m128i *)(d + filled), v );
+        }
+    }
+#endif
+    // filled is a multiple of patternBytes, so that the start of the row can be copied there
+    while (filled < bytes) {
+        const std::size_t n = std::min(filled, bytes - filled);
+        std::memcpy(d + filled, d, n);
+        filled += n;
+    }
+}
+
+// Bit depth conversions.
+// Integer components are mapped to [0,1] as in Color::intToFloat, float components are mapped back with
+// the clamping and rounding of Color::floatToInt (NaN gives 0), and half-floats are rounded to nearest even.
+// ubyte <-> ushort conversions are done directly, as Color::charToUint16 and Color::uint16ToChar, which give
+// the same result as a conversion through float.
+
+// number of components converted at once through a float buffer
+#define kOfxsConvertChunkSize 256
+
+inline void
+ofxsConvertUByteToFloat(const unsigned char *src,
+                        float *dst,
+                        std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(255.f);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128( (const __m128i *)(src + i) );
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+        // a division, to get the same result as Color::intToFloat
+        _mm_storeu_ps( dst + i,      _mm_div_ps(_mm_cvtepi32_ps( _mm_unpacklo_epi16(lo, zero) ), scale) );
+        _mm_storeu_ps( dst + i + 4,  _mm_div_ps(_mm_cvtepi32_ps( _mm_unpackhi_epi16(lo, zero) ), scale) );
+        _mm_storeu_ps( dst + i + 8,  _mm_div_ps(_mm_cvtepi32_ps( _mm_unpacklo_epi16(hi, zero) ), scale) );
+        _mm_storeu_ps( dst + i + 12, _mm_div_ps(_mm_cvtepi32_ps( _mm_unpackhi_epi16(hi, zero) ), scale) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = src[i] / 255.f;
+    }
+}
+
+inline void
+ofxsConvertUShortToFloat(const unsigned short *src,
+                         float *dst,
+                         std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(65535.f);
+    for (; i + 8 <= n; i += 8) {
+        const __m128i v = _mm_loadu_si128( (const __m128i *)(src + i) );
+        _mm_storeu_ps( dst + i,     _mm_div_ps(_mm_cvtepi32_ps( _mm_unpacklo_epi16(v, zero) ), scale) );
+        _mm_storeu_ps( dst + i + 4, _mm_div_ps(_mm_cvtepi32_ps( _mm_unpackhi_epi16(v, zero) ), scale) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = src[i] / 65535.f;
+    }
+}
+
+inline void
+ofxsConvertHalfToFloat(const unsigned short *src,
+                       float *dst,
+                       std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_F16C
+    for (; i + 8 <= n; i += 8) {
+        const __m128i v = _mm_loadu_si128( (const __m128i *)(src + i) );
+        _mm_storeu_ps( dst + i,     _mm_cvtph_ps(v) );
+        _mm_storeu_ps( dst + i + 4, _mm_cvtph_ps( _mm_unpackhi_epi64(v, v) ) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = Color::halfToFloat(src[i]);
+    }
+}
+
+#ifdef OFXS_COPIER_SSE2
+// clamp 4 floats to [0,1] (NaN gives 0), and scale and round them as Color::floatToInt
+inline __m128i
+ofxsConvertFloatToIntSSE2(__m128 v,
+                          __m128 scale)
+{
+    // _mm_max_ps returns its second operand if the first is NaN
+    v = _mm_min_ps( _mm_max_ps( v, _mm_setzero_ps() ), _mm_set1_ps(1.f) );
+
+    return _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps(v, scale), _mm_set1_ps(0.5f) ) );
+}
+
+#endif
+
+// same as Color::floatToInt, but NaN gives 0
+template<int numvals>
+int
+ofxsConvertFloatToInt(float value)
+{
+    if ( !(value > 0) ) {
+        return 0;
+    } else if (value >= 1.) {
+        return numvals - 1;
+    }
+
+    return int(value * (numvals - 1) + 0.5f);
+}
+
+inline void
+ofxsConvertFloatToUByte(const float *src,
+                        unsigned char *dst,
+                        std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_SSE2
+    const __m128 scale = _mm_set1_ps(255.f);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i a = ofxsConvertFloatToIntSSE2(_mm_loadu_ps(src + i), scale);
+        const __m128i b = ofxsConvertFloatToIntSSE2(_mm_loadu_ps(src + i + 4), scale);
+        const __m128i c = ofxsConvertFloatToIntSSE2(_mm_loadu_ps(src + i + 8), scale);
+        const __m128i d = ofxsConvertFloatToIntSSE2(_mm_loadu_ps(src + i + 12), scale);
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_packus_epi16( _mm_packs_epi32(a, b), _mm_packs_epi32(c, d) ) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = (unsigned char)ofxsConvertFloatToInt<256>(src[i]);
+    }
+}
+
+inline void
+ofxsConvertFloatToUShort(const float *src,
+                         unsigned short *dst,
+                         std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_SSE2
+    const __m128 scale = _mm_set1_ps(65535.f);
+    // SSE2 has no unsigned 32 to 16 bits pack: pack signed values around 0 and flip the sign bit
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16(-32768);
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = _mm_sub_epi32(ofxsConvertFloatToIntSSE2(_mm_loadu_ps(src + i), scale), bias32);
+        const __m128i b = _mm_sub_epi32(ofxsConvertFloatToIntSSE2(_mm_loadu_ps(src + i + 4), scale), bias32);
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_xor_si128(_mm_packs_epi32(a, b), bias16) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = (unsigned short)ofxsConvertFloatToInt<65536>(src[i]);
+    }
+}
+
+inline void
+ofxsConvertFloatToHalf(const float *src,
+                       unsigned short *dst,
+                       std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_F16C
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        const __m128i b = _mm_cvtps_ph(_mm_loadu_ps(src + i + 4), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_unpacklo_epi64(a, b) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = Color::floatToHalf(src[i]);
+    }
+}
+
+inline void
+ofxsConvertUByteToUShort(const unsigned char *src,
+                         unsigned short *dst,
+                         std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_SSE2
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128( (const __m128i *)(src + i) );
+        // (q << 8) | q
+        _mm_storeu_si128( (__m128i *)(dst + i),     _mm_unpacklo_epi8(v, v) );
+        _mm_storeu_si128( (__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, v) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = Color::charToUint16(src[i]);
+    }
+}
+
+inline void
+ofxsConvertUShortToUByte(const unsigned short *src,
+                         unsigned char *dst,
+                         std::size_t n)
+{
+    std::size_t i = 0;
+
+#ifdef OFXS_COPIER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(128);
+    for (; i + 16 <= n; i += 16) {
+        __m128i q[4];
+        const __m128i a = _mm_loadu_si128( (const __m128i *)(src + i) );
+        const __m128i b = _mm_loadu_si128( (const __m128i *)(src + i + 8) );
+        q[0] = _mm_unpacklo_epi16(a, zero);
+        q[1] = _mm_unpackhi_epi16(a, zero);
+        q[2] = _mm_unpacklo_epi16(b, zero);
+        q[3] = _mm_unpackhi_epi16(b, zero);
+        for (int k = 0; k < 4; ++k) {
+            // ((q + 128) - ((q + 128) >> 8)) >> 8, computed on 32 bits
+            const __m128i t = _mm_add_epi32(q[k], round);
+            q[k] = _mm_srli_epi32(_mm_sub_epi32( t, _mm_srli_epi32(t, 8) ), 8);
+        }
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_packus_epi16( _mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]) ) );
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = Color::uint16ToChar(src[i]);
+    }
+}
+
+inline void
+ofxsConvertToFloat(const void *src,
+                   OFX::BitDepthEnum srcBitDepth,
+                   float *dst,
+                   std::size_t n)
+{
+    switch (srcBitDepth) {
+    case OFX::eBitDepthUByte:
+        ofxsConvertUByteToFloat( (const unsigned char *)src, dst, n );
+        break;
+    case OFX::eBitDepthUShort:
+        ofxsConvertUShortToFloat( (const unsigned short *)src, dst, n );
+        break;
+    case OFX::eBitDepthHalf:
+        ofxsConvertHalfToFloat( (const unsigned short *)src, dst, n );
+        break;
+    case OFX::eBitDepthFloat:
+        std::memcpy( dst, src, n * sizeof(float) );
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+inline void
+ofxsConvertFromFloat(const float *src,
+                     void *dst,
+                     OFX::BitDepthEnum dstBitDepth,
+                     std::size_t n)
+{
+    switch (dstBitDepth) {
+    case OFX::eBitDepthUByte:
+        ofxsConvertFloatToUByte( src, (unsigned char *)dst, n );
+        break;
+    case OFX::eBitDepthUShort:
+        ofxsConvertFloatToUShort( src, (unsigned short *)dst, n );
+        break;
+    case OFX::eBitDepthHalf:
+        ofxsConvertFloatToHalf( src, (unsigned short *)dst, n );
+        break;
+    case OFX::eBitDepthFloat:
+        std::memcpy( dst, src, n * sizeof(float) );
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+// convert n components from one bit depth to another. The buffers must not overlap.
+inline void
+ofxsConvertRow(const void *src,
+               OFX::BitDepthEnum srcBitDepth,
+               void *dst,
+               OFX::BitDepthEnum dstBitDepth,
+               std::size_t n)
+{
+    if (srcBitDepth == dstBitDepth) {
+        std::memcpy( dst, src, n * getComponentBytes(srcBitDepth) );
+    } else if ( (srcBitDepth == OFX::eBitDepthUByte) && (dstBitDepth == OFX::eBitDepthUShort) ) {
+        ofxsConvertUByteToUShort( (const unsigned char *)src, (unsigned short *)dst, n );
+    } else if ( (srcBitDepth == OFX::eBitDepthUShort) && (dstBitDepth == OFX::eBitDepthUByte) ) {
+        ofxsConvertUShortToUByte( (const unsigned short *)src, (unsigned char *)dst, n );
+    } else if (srcBitDepth == OFX::eBitDepthFloat) {
+        ofxsConvertFromFloat( (const float *)src, dst, dstBitDepth, n );
+    } else if (dstBitDepth == OFX::eBitDepthFloat) {
+        ofxsConvertToFloat( src, srcBitDepth, (float *)dst, n );
+    } else {
+        // go through a float buffer that stays in the L1 cache
+        float tmp[kOfxsConvertChunkSize];
+        const int srcBytes = getComponentBytes(srcBitDepth);
+        const int dstBytes = getComponentBytes(dstBitDepth);
+        const char *s = (const char *)src;
+        char *d = (char *)dst;
+        while (n > 0) {
+            const std::size_t count = std::min(n, (std::size_t)kOfxsConvertChunkSize);
+            ofxsConvertToFloat(s, srcBitDepth, tmp, count);
+            ofxsConvertFromFloat(tmp, d, dstBitDepth, count);
+            s += count * srcBytes;
+            d += count * dstBytes;
+            n -= count;
+        }
+    }
+}
+
 // Base class for the RGBA and the Alpha processor
 
 template <class PIX, int nComponents>
@@ -43,6 +498,12 @@ public:
     {
     }
 
+    // a copy is limited by the memory bandwidth
+    double getPixelCostHint() const
+    {
+        return 1.;
+    }
+
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
@@ -61,7 +522,26 @@ public:
             procWindow.y2 = _dstBounds.y2;
         }
 
-        int rowBytes = sizeof(PIX) * nComponents * (procWindow.x2 - procWindow.x1);
+        if ( (procWindow.x2 <= procWindow.x1) || (procWindow.y2 <= procWindow.y1) ) {
+            return;
+        }
+
+        const int pixelBytes = sizeof(PIX) * nComponents;
+        const int rowBytes = pixelBytes * (procWindow.x2 - procWindow.x1);
+        // a large image would not stay in the cache anyway: write it with streaming stores
+        const bool streaming = ofxsUseStreamingStores( ofxsWindowBytes(_renderWindow, pixelBytes) );
+
+        // The horizontal layout is the same for all rows, compute it once:
+        // [procWindow.x1,x1) is left of the source, [x1,x2) is copied, [x2,procWindow.x2) is right of the source.
+        const int srcWidth = _srcBounds.x2 - _srcBounds.x1;
+        int x1 = std::max(_srcBounds.x1, procWindow.x1);
+        int x2 = std::min(_srcBounds.x2, procWindow.x2);
+        if (x2 < x1) {
+            // no overlap with the source: all pixels are either left or right of it
+            x1 = x2 = (procWindow.x2 <= _srcBounds.x1) ? procWindow.x2 : procWindow.x1;
+        }
+        // with the periodic condition, the source pixel of procWindow.x1
+        const int srcPhase = (_srcBoundary == 2 && srcWidth > 0) ? positive_modulo(procWindow.x1 - _srcBounds.x1, srcWidth) : 0;
 
         for (int dsty = procWindow.y1; dsty < procWindow.y2; ++dsty) {
             if ( _effect.abort() ) {
@@ -90,123 +570,53 @@ public:
                 }
             }
 
-            if ( (srcy < _srcBounds.y1) || (_srcBounds.y2 <= srcy) || (_srcBounds.y2 <= _srcBounds.y1) ) {
-                assert(_srcBoundary == 0);
-                std::memset(dstPix, 0, rowBytes);
+            const PIX *srcRow = 0;
+            if ( (_srcBounds.y1 <= srcy) && (srcy < _srcBounds.y2) && (srcWidth > 0) ) {
+                srcRow = (const PIX *) getSrcPixelAddress(_srcBounds.x1, srcy);
+                assert(srcRow);
             } else {
-                int x1 = std::max(_srcBounds.x1, procWindow.x1);
-                int x2 = std::min(_srcBounds.x2, procWindow.x2);
-                // start of line may be black
-                if (procWindow.x1 < x1) {
-                    if ( (_srcBoundary != 1) && (_srcBoundary != 2) ) {
-                        std::memset( dstPix, 0, sizeof(PIX) * nComponents * (x1 - procWindow.x1) );
-                        dstPix += nComponents * (x1 - procWindow.x1);
-                    } else if (_srcBoundary == 1) {
-                        const PIX *srcPix = (const PIX *) getSrcPixelAddress(x1, srcy);
-                        assert(srcPix);
-                        if (!srcPix) {
-                            std::memset( dstPix, 0, sizeof(PIX) * nComponents * (x1 - procWindow.x1) );
-                            dstPix += nComponents * (x1 - procWindow.x1);
-                        } else {
-#                        ifdef DEBUG
-                            for (int c = 0; c < nComponents; ++c) {
-                                assert( !OFX::IsNaN(srcPix[c]) ); // check for NaN
-                            }
-#                        endif
-                            for (int x = procWindow.x1; x < x1; ++x) {
-                                std::copy(srcPix, srcPix + nComponents, dstPix);
-                                dstPix += nComponents;
-                            }
-                        }
-                    } else if (_srcBoundary == 2) {
-                        int srcx = procWindow.x1;
-                        if ( (srcx < _srcBounds.x1) || (_srcBounds.x2 <= srcx) ) {
-                            srcx = _srcBounds.x1 + positive_modulo(srcx - _srcBounds.x1, _srcBounds.x2 - _srcBounds.x1);
-                        }
-
-                        const PIX *srcPix = (const PIX *) getSrcPixelAddress(srcx, srcy);
-                        assert(srcPix);
-                        if (!srcPix) {
-                            std::memset( dstPix, 0, sizeof(PIX) * nComponents * (x1 - procWindow.x1) );
-                            dstPix += nComponents * (x1 - procWindow.x1);
-                        } else {
-                            for (int x = procWindow.x1; x < x1; ++x) {
-#                             ifdef DEBUG
-                                for (int c = 0; c < nComponents; ++c) {
-                                    assert( !OFX::IsNaN(srcPix[c]) ); // check for NaN
-                                }
-#                             endif
-                                std::copy(srcPix, srcPix + nComponents, dstPix);
-                                dstPix += nComponents;
-                                ++srcx;
-                                if (_srcBounds.x2 <= srcx) {
-                                    srcx -= (_srcBounds.x2 - _srcBounds.x1);
-                                    srcPix -= (_srcBounds.x2 - _srcBounds.x1) * nComponents;
-                                }
-                            }
-                        }
-                    }
-                }
-                // then, copy the relevant fraction of src
-                if ( (x1 < x2) && (procWindow.x1 <= x1) && (x2 <= procWindow.x2) ) {
-                    const PIX *srcPix = (const PIX *) getSrcPixelAddress(x1, srcy);
-                    assert(srcPix);
-                    if (!srcPix) {
-                        std::memset( dstPix, 0, sizeof(PIX) * nComponents * (x2 - x1) );
-                    } else {
-#                     ifdef DEBUG
-                        for (int c = 0; c < nComponents * (x2 - x1); ++c) {
-                            assert( !OFX::IsNaN(srcPix[c]) ); // check for NaN
-                        }
-#                     endif
-                        std::memcpy( dstPix, srcPix, sizeof(PIX) * nComponents * (x2 - x1) );
-                    }
-                    dstPix += nComponents * (x2 - x1);
+                assert(_srcBoundary == 0);
+            }
+            if (!srcRow) {
+                ofxsZeroRow(dstPix, rowBytes, streaming);
+                continue;
+            }
+#         ifdef DEBUG
+            for (int c = 0; c < nComponents * srcWidth; ++c) {
+                assert( !OFX::IsNaN(srcRow[c]) ); // check for NaN
+            }
+#         endif
+
+            if (_srcBoundary == 2) {
+                // the row is periodic: copy one period of the source, starting at srcPhase, and replicate it
+                const int head = std::min(srcWidth - srcPhase, procWindow.x2 - procWindow.x1);
+                std::memcpy(dstPix, srcRow + nComponents * srcPhase, pixelBytes * head);
+                std::memcpy( dstPix + nComponents * head, srcRow, pixelBytes * std::min(srcPhase, procWindow.x2 - procWindow.x1 - head) );
+                ofxsRepeatRow(dstPix, pixelBytes * srcWidth, rowBytes);
+                continue;
+            }
+            // start of line may be black, or the first source pixel
+            if (procWindow.x1 < x1) {
+                if (_srcBoundary == 1) {
+                    std::memcpy(dstPix, srcRow, pixelBytes);
+                    ofxsRepeatRow(dstPix, pixelBytes, pixelBytes * (x1 - procWindow.x1) );
+                } else {
+                    std::memset( dstPix, 0, pixelBytes * (x1 - procWindow.x1) );
                 }
-                // end of line may be black
-                if (x2 < procWindow.x2) {
-                    if ( (_srcBoundary != 1) && (_srcBoundary != 2) ) {
-                        std::memset( dstPix, 0, sizeof(PIX) * nComponents * (procWindow.x2 - x2) );
-                        dstPix += nComponents * (procWindow.x2 - x2);
-                    } else if (_srcBoundary == 1) {
-                        const PIX *srcPix = (const PIX *) getSrcPixelAddress(x2 - 1, srcy);
-                        assert(srcPix);
-                        if (!srcPix) {
-                            std::memset( dstPix, 0, sizeof(PIX) * nComponents * (procWindow.x2 - x2) );
-                        } else {
-                            for (int x = x2; x < procWindow.x2; ++x) {
-                                std::memcpy( dstPix, srcPix, sizeof(PIX) * nComponents );
-                                dstPix += nComponents;
-                            }
-                        }
-                    } else if (_srcBoundary == 2) {
-                        int srcx = x2;
-                        while (_srcBounds.x2 <= srcx) {
-                            srcx -= (_srcBounds.x2 - _srcBounds.x1);
-                        }
-
-                        const PIX *srcPix = (const PIX *) getSrcPixelAddress(srcx, srcy);
-                        assert(srcPix);
-                        if (!srcPix) {
-                            std::memset( dstPix, 0, sizeof(PIX) * nComponents * (procWindow.x2 - x2) );
-                            dstPix += nComponents * (procWindow.x2 - x2);
-                        } else {
-                            for (int x = x2; x < procWindow.x2; ++x) {
-#                             ifdef DEBUG
-                                for (int c = 0; c < nComponents; ++c) {
-                                    assert( !OFX::IsNaN(srcPix[c]) ); // check for NaN
-                                }
-#                             endif
-                                std::copy(srcPix, srcPix + nComponents, dstPix);
-                                dstPix += nComponents;
-                                ++srcx;
-                                if (_srcBounds.x2 <= srcx) {
-                                    srcx -= (_srcBounds.x2 - _srcBounds.x1);
-                                    srcPix -= (_srcBounds.x2 - _srcBounds.x1) * nComponents;
-                                }
-                            }
-                        }
-                    }
+                dstPix += nComponents * (x1 - procWindow.x1);
+            }
+            // then, copy the relevant fraction of src
+            if (x1 < x2) {
+                ofxsCopyRow(dstPix, srcRow + nComponents * (x1 - _srcBounds.x1), pixelBytes * (x2 - x1), streaming);
+                dstPix += nComponents * (x2 - x1);
+            }
+            // end of line may be black, or the last source pixel
+            if (x2 < procWindow.x2) {
+                if (_srcBoundary == 1) {
+                    std::memcpy(dstPix, srcRow + nComponents * (srcWidth - 1), pixelBytes);
+                    ofxsRepeatRow(dstPix, pixelBytes, pixelBytes * (procWindow.x2 - x2) );
+                } else {
+                    std::memset( dstPix, 0, pixelBytes * (procWindow.x2 - x2) );
                 }
             }
         }
@@ -227,6 +637,12 @@ public:
     {
     }
 
+    // a copy is limited by the memory bandwidth
+    double getPixelCostHint() const
+    {
+        return 1.;
+    }
+
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
@@ -312,9 +728,26 @@ public:
     // ctor
     PixelCopierMaskMix(OFX::ImageEffect &instance)
         : OFX::PixelProcessorFilterBase(instance)
+        , _maskOccupancy()
     {
     }
 
+    // summarize the mask, to skip the regions where it is 0 or 1
+    virtual void preProcess() OVERRIDE
+    {
+        _maskOccupancy.build<PIX, maxValue>(_renderWindow, masked && _doMasking, _maskImg, (float)_mix, _maskInvert);
+    }
+
+#ifdef OFXS_INSTRUMENTATION
+    virtual void postProcess() OVERRIDE
+    {
+        if (_maskOccupancy.getTileCount() > 0) {
+            getInstrumentation().setMaskTilesSkipped( _maskOccupancy.getSkippedFraction() );
+        }
+    }
+
+#endif
+
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
@@ -332,7 +765,7 @@ public:
         if (_dstBounds.y2 < procWindow.y2) {
             procWindow.y2 = _dstBounds.y2;
         }
-        float tmpPix[nComponents];
+        float *tmpRow = getScratchArena().allocateArray<float>( (procWindow.x2 - procWindow.x1) * nComponents );
 
         for (int dsty = procWindow.y1; dsty < procWindow.y2; ++dsty) {
             if ( _effect.abort() ) {
@@ -361,37 +794,46 @@ public:
                 continue;
             }
 
-            for (int dstx = procWindow.x1; dstx < procWindow.x2; ++dstx) {
-                int srcx = dstx;
+            // the background is _origImg at dstx,dsty, which are also the mask image coordinates (no boundary conditions)
+            for (int rx1 = procWindow.x1, rx2; rx1 < procWindow.x2; rx1 = rx2) {
+                // the pixels [rx1, rx2) have the same mask state
+                const MaskOccupancy::TileStateEnum state = _maskOccupancy.getRun(rx1, procWindow.x2, dsty, &rx2);
+                if (state == MaskOccupancy::eTileStateZero) {
+                    // the output is the original image, there is nothing to copy
+                    ofxsBackgroundRow<PIX, nComponents, maxValue>(rx1, rx2, dsty, _origImg, dstPix + (rx1 - procWindow.x1) * nComponents);
+                    continue;
+                }
+                float *tmpPix = tmpRow + (rx1 - procWindow.x1) * nComponents;
+                for (int dstx = rx1; dstx < rx2; ++dstx, tmpPix += nComponents) {
+                    int srcx = dstx;
 
-                if (_srcBoundary == 1) {
-                    if (_srcBounds.x2 <= srcx) {
-                        srcx = _srcBounds.x2 - 1;
-                    }
-                    if (srcx < _srcBounds.x1) {
-                        srcx = _srcBounds.x1;
-                    }
-                } else if (_srcBoundary == 2) {
-                    if ( (srcx < _srcBounds.x1) || (_srcBounds.x2 <= srcx) ) {
-                        srcx = _srcBounds.x1 + positive_modulo(srcx - _srcBounds.x1, _srcBounds.x2 - _srcBounds.x1);
+                    if (_srcBoundary == 1) {
+                        if (_srcBounds.x2 <= srcx) {
+                            srcx = _srcBounds.x2 - 1;
+                        }
+                        if (srcx < _srcBounds.x1) {
+                            srcx = _srcBounds.x1;
+                        }
+                    } else if (_srcBoundary == 2) {
+                        if ( (srcx < _srcBounds.x1) || (_srcBounds.x2 <= srcx) ) {
+                            srcx = _srcBounds.x1 + positive_modulo(srcx - _srcBounds.x1, _srcBounds.x2 - _srcBounds.x1);
+                        }
                     }
-                }
 
-                // origPix is at dstx,dsty
-                const PIX *origPix = (const PIX *)  (_origImg ? _origImg->getPixelAddress(dstx, dsty) : 0);
-                const PIX *srcPix = (const PIX *) getSrcPixelAddress(srcx, srcy);
-                if (srcPix) {
-                    std::copy(srcPix, srcPix + nComponents, tmpPix);
-                } else {
-                    std::fill(tmpPix, tmpPix + nComponents, 0.); // no src pixel here, be black and transparent
+                    const PIX *srcPix = (const PIX *) getSrcPixelAddress(srcx, srcy);
+                    if (srcPix) {
+                        std::copy(srcPix, srcPix + nComponents, tmpPix);
+                    } else {
+                        std::fill(tmpPix, tmpPix + nComponents, 0.); // no src pixel here, be black and transparent
+                    }
                 }
-                // dstx,dsty are the mask image coordinates (no boundary conditions)
-                ofxsMaskMixPix<PIX, nComponents, maxValue, masked>(tmpPix, dstx, dsty, origPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
-                // increment the dst pixel
-                dstPix += nComponents;
+                ofxsMaskMixRun<PIX, nComponents, maxValue, masked>(state, tmpRow + (rx1 - procWindow.x1) * nComponents, rx1, rx2, dsty, _origImg, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix + (rx1 - procWindow.x1) * nComponents);
             }
         }
     } // multiThreadProcessImages
+
+private:
+    OFX::MaskOccupancy _maskOccupancy;
 };
 
 template <class SRCPIX, int srcNComponents, int srcMaxValue, class DSTPIX, int dstNComponents, int dstMaxValue>
@@ -452,7 +894,19 @@ public:
                 continue;
             }
             
+            // the source pixels of [spanx1, spanx2) are contiguous: they are processed by the row kernels
+            int spanx1, spanx2;
+            if ( !getSrcSpan(procWindow.x1, procWindow.x2, srcy, (int)(srcNComponents * sizeof(SRCPIX)), &spanx1, &spanx2) ) {
+                spanx1 = spanx2 = procWindow.x2;
+            }
             for (int dstx = procWindow.x1; dstx < procWindow.x2; ++dstx) {
+                if (dstx == spanx1) {
+                    processSpan( (const SRCPIX *)getSrcPixelAddress(spanx1, srcy), spanx2 - spanx1, dstPix );
+                    dstPix += (spanx2 - spanx1) * dstNComponents;
+                    dstx = spanx2 - 1;
+                    continue;
+                }
+
                 int srcx = dstx;
 
                 if (_srcBoundary == 1) {
@@ -479,6 +933,27 @@ public:
             }
         }
     } // multiThreadProcessImages
+
+private:
+    // process n pixels whose sources are contiguous
+    void processSpan(const SRCPIX *srcPix,
+                     int n,
+                     DSTPIX *dstPix)
+    {
+        float unpPix[kOfxsMaskMixRowPixels * 4];
+        float tmpPix[kOfxsMaskMixRowPixels * 4];
+
+        while (n > 0) {
+            const int count = std::min(n, kOfxsMaskMixRowPixels);
+            ofxsUnPremultRow<SRCPIX, srcNComponents, srcMaxValue>(srcPix, count, unpPix, _premult, _premultChannel);
+            // denormalize, without premultiplying
+            ofxsPremultRow<DSTPIX, dstNComponents, dstMaxValue>(unpPix, count, tmpPix, false, _premultChannel);
+            ofxsPixRow<DSTPIX, dstNComponents, dstMaxValue>(tmpPix, count, dstPix);
+            srcPix += count * srcNComponents;
+            dstPix += count * dstNComponents;
+            n -= count;
+        }
+    }
 };
 
 template <class SRCPIX, int srcNComponents, int srcMaxValue, class DSTPIX, int dstNComponents, int dstMaxValue>
@@ -538,7 +1013,19 @@ public:
                 continue;
             }
 
+            // the source pixels of [spanx1, spanx2) are contiguous: they are processed by the row kernels
+            int spanx1, spanx2;
+            if ( !getSrcSpan(procWindow.x1, procWindow.x2, srcy, (int)(srcNComponents * sizeof(SRCPIX)), &spanx1, &spanx2) ) {
+                spanx1 = spanx2 = procWindow.x2;
+            }
             for (int dstx = procWindow.x1; dstx < procWindow.x2; ++dstx) {
+                if (dstx == spanx1) {
+                    processSpan( (const SRCPIX *)getSrcPixelAddress(spanx1, srcy), spanx2 - spanx1, dstPix );
+                    dstPix += (spanx2 - spanx1) * dstNComponents;
+                    dstx = spanx2 - 1;
+                    continue;
+                }
+
                 int srcx = dstx;
 
                 if (_srcBoundary == 1) {
@@ -587,6 +1074,26 @@ public:
             }
         }
     } // multiThreadProcessImages
+
+private:
+    // process n pixels whose sources are contiguous
+    void processSpan(const SRCPIX *srcPix,
+                     int n,
+                     DSTPIX *dstPix)
+    {
+        float unpPix[kOfxsMaskMixRowPixels * 4];
+        float tmpPix[kOfxsMaskMixRowPixels * 4];
+
+        while (n > 0) {
+            const int count = std::min(n, kOfxsMaskMixRowPixels);
+            ofxsNormalizeRow<SRCPIX, srcNComponents, srcMaxValue>(srcPix, count, unpPix);
+            ofxsPremultRow<DSTPIX, dstNComponents, dstMaxValue>(unpPix, count, tmpPix, _premult, _premultChannel);
+            ofxsPixRow<DSTPIX, dstNComponents, dstMaxValue>(tmpPix, count, dstPix);
+            srcPix += count * srcNComponents;
+            dstPix += count * dstNComponents;
+            n -= count;
+        }
+    }
 };
 
 // _srcBoundarys The border condition type { 0=zero |  1=dirichlet | 2=periodic }.
@@ -620,6 +1127,7 @@ public:
         if (_dstBounds.y2 < procWindow.y2) {
             procWindow.y2 = _dstBounds.y2;
         }
+        float *tmpRow = getScratchArena().allocateArray<float>( (procWindow.x2 - procWindow.x1) * dstNComponents );
         float unpPix[4];
 
         if (srcNComponents == 3) {
@@ -652,7 +1160,20 @@ public:
                 continue;
             }
 
-            for (int dstx = procWindow.x1; dstx < procWindow.x2; ++dstx) {
+            // the source pixels of [spanx1, spanx2) are contiguous: they are processed by the row kernels
+            int spanx1, spanx2;
+            if ( !getSrcSpan(procWindow.x1, procWindow.x2, srcy, (int)(srcNComponents * sizeof(SRCPIX)), &spanx1, &spanx2) ) {
+                spanx1 = spanx2 = procWindow.x2;
+            }
+            float *tmpPix = tmpRow;
+            for (int dstx = procWindow.x1; dstx < procWindow.x2; ++dstx, tmpPix += dstNComponents) {
+                if (dstx == spanx1) {
+                    processSpan( (const SRCPIX *)getSrcPixelAddress(spanx1, srcy), spanx2 - spanx1, tmpPix );
+                    tmpPix += (spanx2 - spanx1 - 1) * dstNComponents;
+                    dstx = spanx2 - 1;
+                    continue;
+                }
+
                 int srcx = dstx;
 
                 if (_srcBoundary == 1) {
@@ -667,19 +1188,203 @@ public:
                         srcx = _srcBounds.x1 + positive_modulo(srcx - _srcBounds.x1, _srcBounds.x2 - _srcBounds.x1);
                     }
                 }
-                // origPix is at dstx,dsty
-                const DSTPIX *origPix = (const DSTPIX *)  (_origImg ? _origImg->getPixelAddress(dstx, dsty) : 0);
                 const SRCPIX *srcPix = (const SRCPIX *) getSrcPixelAddress(srcx, srcy);
                 for (int c = 0; c < srcNComponents; ++c) {
                     unpPix[c] = (srcPix ? (srcPix[c] * (1.f / srcMaxValue)) : 0.f);
                 }
-                // dstx,dsty are the mask image coordinates (no boundary conditions)
-                ofxsPremultMaskMixPix<DSTPIX, dstNComponents, dstMaxValue, true>(unpPix, _premult, _premultChannel, dstx, dsty, origPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
-                // increment the dst pixel
-                dstPix += dstNComponents;
+                ofxsPremult<DSTPIX, dstNComponents, dstMaxValue>(unpPix, tmpPix, _premult, _premultChannel);
             }
+            // the background is _origImg at dstx,dsty, which are also the mask image coordinates (no boundary conditions)
+            ofxsMaskMixRow<DSTPIX, dstNComponents, dstMaxValue, true>(tmpRow, procWindow.x1, procWindow.x2, dsty, _origImg, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
         }
     } // multiThreadProcessImages
+
+private:
+    // premultiply n pixels whose sources are contiguous into tmpPix
+    void processSpan(const SRCPIX *srcPix,
+                     int n,
+                     float *tmpPix)
+    {
+        float unpPix[kOfxsMaskMixRowPixels * 4];
+
+        while (n > 0) {
+            const int count = std::min(n, kOfxsMaskMixRowPixels);
+            ofxsNormalizeRow<SRCPIX, srcNComponents, srcMaxValue>(srcPix, count, unpPix);
+            ofxsPremultRow<DSTPIX, dstNComponents, dstMaxValue>(unpPix, count, tmpPix, _premult, _premultChannel);
+            srcPix += count * srcNComponents;
+            tmpPix += count * dstNComponents;
+            n -= count;
+        }
+    }
+};
+
+// Component remapping for PixelCopierConvert: a destination component is either read from a source
+// component (0 to 3), or set to one of these constants.
+enum ConvertComponentEnum
+{
+    eConvertComponentZero = -1,
+    eConvertComponentOne = -2
+};
+
+// The default component map: color components are copied from the source color components or set to 0,
+// and alpha is copied from the source alpha, or set to 1 if the source has no alpha (it is opaque).
+// eg. RGB to RGBA gives (0,1,2,one), RGBA to Alpha gives (3), Alpha to RGBA gives (zero,zero,zero,0).
+inline void
+getDefaultComponentMap(OFX::PixelComponentEnum srcPixelComponents,
+                       int srcPixelComponentCount,
+                       OFX::PixelComponentEnum dstPixelComponents,
+                       int dstPixelComponentCount,
+                       int componentMap[4])
+{
+    const bool srcHasAlpha = (srcPixelComponents == OFX::ePixelComponentRGBA) || (srcPixelComponents == OFX::ePixelComponentAlpha);
+    const bool dstHasAlpha = (dstPixelComponents == OFX::ePixelComponentRGBA) || (dstPixelComponents == OFX::ePixelComponentAlpha);
+    const int srcColorCount = srcPixelComponentCount - (srcHasAlpha ? 1 : 0);
+    const int dstColorCount = dstPixelComponentCount - (dstHasAlpha ? 1 : 0);
+
+    for (int c = 0; c < dstColorCount; ++c) {
+        componentMap[c] = (c < srcColorCount) ? c : (int)eConvertComponentZero;
+    }
+    if (dstHasAlpha) {
+        componentMap[dstColorCount] = srcHasAlpha ? (srcPixelComponentCount - 1) : (int)eConvertComponentOne;
+    }
+    for (int c = dstPixelComponentCount; c < 4; ++c) {
+        componentMap[c] = eConvertComponentZero;
+    }
+}
+
+// Copy an image to an image of another bit depth (ubyte, ushort, half or float) and/or with other components.
+// nComponents is the number of destination components. half images use unsigned short as PIX type,
+// the actual depths are those of the images.
+// Pixels outside of the source bounds are black and transparent.
+template <class SRCPIX, class DSTPIX, int nComponents>
+class PixelCopierConvert
+    : public OFX::PixelProcessorFilterBase
+{
+public:
+    // ctor
+    PixelCopierConvert(OFX::ImageEffect &instance)
+        : OFX::PixelProcessorFilterBase(instance)
+        , _hasComponentMap(false)
+        , _identity(false)
+        , _srcOne(0)
+    {
+        for (int c = 0; c < 4; ++c) {
+            _componentMap[c] = eConvertComponentZero;
+        }
+    }
+
+    // set the source component (or eConvertComponentZero or eConvertComponentOne) of each destination component.
+    // By default, the map is given by getDefaultComponentMap().
+    void setComponentMap(const int componentMap[nComponents])
+    {
+        for (int c = 0; c < nComponents; ++c) {
+            _componentMap[c] = componentMap[c];
+        }
+        _hasComponentMap = true;
+    }
+
+    // a conversion is limited by the memory bandwidth
+    double getPixelCostHint() const
+    {
+        return 1.;
+    }
+
+private:
+    virtual void preProcess() OVERRIDE
+    {
+        assert( sizeof(SRCPIX) == (std::size_t)getComponentBytes(_srcBitDepth) );
+        assert( sizeof(DSTPIX) == (std::size_t)getComponentBytes(_dstBitDepth) );
+        assert(_dstPixelComponentCount == nComponents);
+        if (!_hasComponentMap) {
+            getDefaultComponentMap(_srcPixelComponents, _srcPixelComponentCount, _dstPixelComponents, _dstPixelComponentCount, _componentMap);
+        }
+        _identity = (_srcPixelComponentCount == nComponents);
+        for (int c = 0; c < nComponents; ++c) {
+            assert(eConvertComponentOne <= _componentMap[c] && _componentMap[c] < _srcPixelComponentCount);
+            _identity = _identity && (_componentMap[c] == c);
+        }
+        // the value of 1 in the source depth
+        switch (_srcBitDepth) {
+        case OFX::eBitDepthUByte:
+            _srcOne = (SRCPIX)255;
+            break;
+        case OFX::eBitDepthUShort:
+            _srcOne = (SRCPIX)65535;
+            break;
+        case OFX::eBitDepthHalf:
+            _srcOne = (SRCPIX)Color::floatToHalf(1.f);
+            break;
+        default:
+            _srcOne = (SRCPIX)1;
+            break;
+        }
+    }
+
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(_dstBounds.x1 <= procWindow.x1 && procWindow.x2 <= _dstBounds.x2 && _dstBounds.y1 <= procWindow.y1 && procWindow.y2 <= _dstBounds.y2);
+        // for more safety, make sure procWindow is within dstBounds (as covered by the above assert)
+        procWindow.x1 = std::max(procWindow.x1, _dstBounds.x1);
+        procWindow.x2 = std::min(procWindow.x2, _dstBounds.x2);
+        procWindow.y1 = std::max(procWindow.y1, _dstBounds.y1);
+        procWindow.y2 = std::min(procWindow.y2, _dstBounds.y2);
+        if ( (procWindow.x2 <= procWindow.x1) || (procWindow.y2 <= procWindow.y1) ) {
+            return;
+        }
+
+        const int x1 = std::max(_srcBounds.x1, procWindow.x1);
+        const int x2 = std::min(_srcBounds.x2, procWindow.x2);
+        // pixels converted at once when remapping the components
+        const int chunkPixels = kOfxsConvertChunkSize / 4;
+        SRCPIX tmpPix[kOfxsConvertChunkSize];
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            DSTPIX *dstPix = (DSTPIX *) getDstPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            if (!dstPix) {
+                // coverity[dead_error_line]
+                continue;
+            }
+            const SRCPIX *srcPix = (x1 < x2) ? (const SRCPIX *) getSrcPixelAddress(x1, y) : 0;
+            if (!srcPix) {
+                // no src pixel here, be black and transparent
+                std::memset( dstPix, 0, sizeof(DSTPIX) * nComponents * (procWindow.x2 - procWindow.x1) );
+                continue;
+            }
+            // start and end of line may be black
+            std::memset( dstPix, 0, sizeof(DSTPIX) * nComponents * (x1 - procWindow.x1) );
+            dstPix += nComponents * (x1 - procWindow.x1);
+            std::memset( dstPix + nComponents * (x2 - x1), 0, sizeof(DSTPIX) * nComponents * (procWindow.x2 - x2) );
+
+            if (_identity) {
+                ofxsConvertRow(srcPix, _srcBitDepth, dstPix, _dstBitDepth, (std::size_t)nComponents * (x2 - x1) );
+                continue;
+            }
+            // remap the components in the source depth, then convert
+            for (int x = x1; x < x2; x += chunkPixels) {
+                const int count = std::min(chunkPixels, x2 - x);
+                SRCPIX *tmp = tmpPix;
+                for (int i = 0; i < count; ++i, srcPix += _srcPixelComponentCount, tmp += nComponents) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        const int m = _componentMap[c];
+                        tmp[c] = (m >= 0) ? srcPix[m] : (m == eConvertComponentOne ? _srcOne : SRCPIX(0));
+                    }
+                }
+                ofxsConvertRow(tmpPix, _srcBitDepth, dstPix, _dstBitDepth, (std::size_t)nComponents * count);
+                dstPix += nComponents * count;
+            }
+        }
+    }
+
+private:
+    int _componentMap[4];
+    bool _hasComponentMap;
+    bool _identity;
+    SRCPIX _srcOne;
 };
 
 template <class PIX>
@@ -695,6 +1400,12 @@ public:
     {
     }
 
+    // filling is limited by the memory bandwidth
+    double getPixelCostHint() const
+    {
+        return 1.;
+    }
+
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
@@ -712,7 +1423,9 @@ public:
         if (_dstBounds.y2 < procWindow.y2) {
             procWindow.y2 = _dstBounds.y2;
         }
-        int rowSize =  _nComponents * (procWindow.x2 - procWindow.x1);
+        const int rowBytes = sizeof(PIX) * _nComponents * (procWindow.x2 - procWindow.x1);
+        // a large image would not stay in the cache anyway: write it with streaming stores
+        const bool streaming = ofxsUseStreamingStores( ofxsWindowBytes(_renderWindow, sizeof(PIX) * _nComponents) );
 
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if ( _effect.abort() ) {
@@ -725,7 +1438,7 @@ public:
                 // coverity[dead_error_line]
                 continue;
             }
-            std::fill( dstPix, dstPix + rowSize, PIX() );
+            ofxsZeroRow(dstPix, rowBytes, streaming); // PIX() is all zero bits
         }
     }
 
@@ -749,11 +1462,15 @@ fillBlackNTForDepth(const OfxRectI & renderWindow,
     int x2 = std::min(renderWindow.x2, dstBounds.x2);
     int y1 = std::max(renderWindow.y1, dstBounds.y1);
     int y2 = std::min(renderWindow.y2, dstBounds.y2);
+    if ( (x2 <= x1) || (y2 <= y1) ) {
+        return;
+    }
     PIX* dstPixels = (PIX*)dstPixelData + (size_t)(y1 - dstBounds.y1) * dstRowElements + (x1 - dstBounds.x1) * dstPixelComponentCount;
-    int rowElements = dstPixelComponentCount * (x2 - renderWindow.x1);
+    const size_t rowBytes = sizeof(PIX) * dstPixelComponentCount * (x2 - x1);
+    const bool streaming = ofxsUseStreamingStores( (double)rowBytes * (y2 - y1) );
 
     for (int y = y1; y < y2; ++y, dstPixels += dstRowElements) {
-        std::fill( dstPixels, dstPixels + rowElements, PIX() ); // no src pixel here, be black and transparent
+        ofxsZeroRow(dstPixels, rowBytes, streaming); // no src pixel here, be black and transparent
     }
 }
 
@@ -809,8 +1526,6 @@ fillBlackNT(const OfxRectI & renderWindow,
     return fillBlackNT(renderWindow, dstPixelData, dstBounds, dstPixelComponentCount, dstBitDepth, dstRowBytes);
 }
 
-#if 0 // Don't use threaded version: very probably less efficient
-
 // black fillers, threaded versions
 template<class PIX, int nComponents>
 void
@@ -895,14 +1610,24 @@ fillBlack(OFX::ImageEffect &instance,
 
         return;
     }
+    // the processor only works within the destination bounds
+    OfxRectI window;
+    window.x1 = std::max(renderWindow.x1, dstBounds.x1);
+    window.x2 = std::min(renderWindow.x2, dstBounds.x2);
+    window.y1 = std::max(renderWindow.y1, dstBounds.y1);
+    window.y2 = std::min(renderWindow.y2, dstBounds.y2);
+    // starting threads is not worth it for a small region
+    if ( ofxsWindowBytes( window, dstPixelComponentCount * getComponentBytes(dstBitDepth) ) < kOfxsCopierThreadedFillBytes ) {
+        return fillBlackNT(renderWindow, dstPixelData, dstBounds, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    }
     if (dstBitDepth == OFX::eBitDepthUByte) {
-        fillBlackForDepth<unsigned char>(instance, renderWindow,
+        fillBlackForDepth<unsigned char>(instance, window,
                                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if ( (dstBitDepth == OFX::eBitDepthUShort) || (dstBitDepth == OFX::eBitDepthHalf) ) {
-        fillBlackForDepth<unsigned short>(instance, renderWindow,
+        fillBlackForDepth<unsigned short>(instance, window,
                                           dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (dstBitDepth == OFX::eBitDepthFloat) {
-        fillBlackForDepth<float>(instance, renderWindow,
+        fillBlackForDepth<float>(instance, window,
                                  dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } // switch
 }
@@ -929,37 +1654,55 @@ fillBlack(OFX::ImageEffect &instance,
     return fillBlack(instance, renderWindow, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
 }
 
-#else // if 0
-
-// Use non-threaded version: probably more efficient
 
+// Copy the pixels of renderWindow from src to dst, which share memory (see getImageAliasing()), without threads.
+// Rows are moved in an order which does not overwrite source rows before they are read, or through a
+// temporary copy of the source if the row bytes differ. Pixels outside of the source are black and transparent.
 inline void
-fillBlack(OFX::ImageEffect &instance,
-          const OfxRectI & renderWindow,
-          void *dstPixelData,
-          const OfxRectI & dstBounds,
-          OFX::PixelComponentEnum dstPixelComponents,
-          int dstPixelComponentCount,
-          OFX::BitDepthEnum dstBitDepth,
-          int dstRowBytes)
+copyPixelsOverlapping(const OfxRectI & renderWindow,
+                      const OFX::ImageView & src,
+                      const OFX::ImageView & dst)
 {
-    (void)instance;
-    (void)dstPixelComponents;
-
-    return fillBlackNT(renderWindow, dstPixelData, dstBounds, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-}
-
-inline void
-fillBlack(OFX::ImageEffect &instance,
-          const OfxRectI & renderWindow,
-          OFX::Image* dstImg)
-{
-    (void)instance;
-
-    return fillBlackNT(renderWindow, dstImg);
-}
-
-#endif // if 0
+    assert( src.getPixelBytes() == dst.getPixelBytes() );
+    const OFX::ImageView dstWindow = dst.getSubView(renderWindow);
+    if ( dstWindow.isEmpty() ) {
+        return;
+    }
+    const OfxRectI w = dstWindow.getBounds();
+    const OFX::ImageView srcWindow = src.getSubView(w);
+    const OfxRectI c = srcWindow.getBounds(); // the part of w which is copied, all zero if it is empty
+    const int pixelBytes = dst.getPixelBytes();
+
+    if ( !srcWindow.isEmpty() ) {
+        const std::size_t rowBytes = (std::size_t)pixelBytes * (c.x2 - c.x1);
+        if ( src.getRowBytes() == dst.getRowBytes() ) {
+            // if the destination is before the source in memory, move the rows in increasing memory order
+            const bool increasingY = ( dst.getPixelAddress(c.x1, c.y1) <= src.getPixelAddress(c.x1, c.y1) ) == (dst.getRowBytes() > 0);
+            for (int i = 0; i < c.y2 - c.y1; ++i) {
+                const int y = increasingY ? (c.y1 + i) : (c.y2 - 1 - i);
+                std::memmove(dst.getPixelAddress(c.x1, y), src.getPixelAddress(c.x1, y), rowBytes);
+            }
+        } else {
+            std::vector<char> tmp( rowBytes * (c.y2 - c.y1) );
+            for (int y = c.y1; y < c.y2; ++y) {
+                std::memcpy(&tmp[rowBytes * (y - c.y1)], src.getPixelAddress(c.x1, y), rowBytes);
+            }
+            for (int y = c.y1; y < c.y2; ++y) {
+                std::memcpy(dst.getPixelAddress(c.x1, y), &tmp[rowBytes * (y - c.y1)], rowBytes);
+            }
+        }
+    }
+    // no src pixel here, be black and transparent
+    for (int y = w.y1; y < w.y2; ++y) {
+        char *dstPix = (char *)dst.getPixelAddress(w.x1, y);
+        if ( srcWindow.isEmpty() || (y < c.y1) || (c.y2 <= y) ) {
+            std::memset( dstPix, 0, pixelBytes * (w.x2 - w.x1) );
+        } else {
+            std::memset( dstPix, 0, pixelBytes * (c.x1 - w.x1) );
+            std::memset( dstPix + pixelBytes * (c.x2 - w.x1), 0, pixelBytes * (w.x2 - c.x2) );
+        }
+    }
+} // copyPixelsOverlapping
 
 // pixel copiers, non-threaded versions
 template<class PIX, int nComponents>
@@ -1001,9 +1744,10 @@ copyPixelsNTForDepthAndComponents(OFX::ImageEffect &instance,
     int dstRowElements = dstRowBytes / sizeof(PIX);
     PIX* dstPixels = dstPixelData + (size_t)(y1 - dstBounds.y1) * dstRowElements + (x1 - dstBounds.x1) * nComponents;
     int rowBytes = sizeof(PIX) * nComponents * (x2 - x1);
+    const bool streaming = ofxsUseStreamingStores( (double)rowBytes * (y2 - y1) );
 
     for (int y = y1; y < y2; ++y, srcPixels += srcRowElements, dstPixels += dstRowElements) {
-        std::memcpy(dstPixels, srcPixels, rowBytes);
+        ofxsCopyRow(dstPixels, srcPixels, rowBytes, streaming);
     }
 }
 
@@ -1074,6 +1818,19 @@ copyPixelsNT(OFX::ImageEffect &instance,
 
         return;
     }
+    // skip the copy if the destination already holds the source pixels, and copy in order if they overlap
+    const OFX::ImageView srcView(srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes);
+    const OFX::ImageView dstView(dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    switch ( getImageAliasing(srcView, dstView, renderWindow) ) {
+    case OFX::eImageAliasingSame:
+
+        return;
+    case OFX::eImageAliasingOverlap:
+
+        return copyPixelsOverlapping(renderWindow, srcView, dstView);
+    case OFX::eImageAliasingNone:
+        break;
+    }
     if (dstBitDepth == OFX::eBitDepthUByte) {
         copyPixelsNTForDepth<unsigned char>(instance, renderWindow,
                                             srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
@@ -1203,6 +1960,19 @@ copyPixels(OFX::ImageEffect &instance,
 
         return;
     }
+    // skip the copy if the destination already holds the source pixels, and copy in order if they overlap
+    const OFX::ImageView srcView(srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes);
+    const OFX::ImageView dstView(dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    switch ( getImageAliasing(srcView, dstView, renderWindow) ) {
+    case OFX::eImageAliasingSame:
+
+        return;
+    case OFX::eImageAliasingOverlap:
+
+        return copyPixelsOverlapping(renderWindow, srcView, dstView);
+    case OFX::eImageAliasingNone:
+        break;
+    }
     if (dstBitDepth == OFX::eBitDepthUByte) {
         copyPixelsForDepth<unsigned char>(instance, renderWindow,
                                           srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
@@ -1259,6 +2029,18 @@ copyPixels(OFX::ImageEffect &instance,
     return copyPixels(instance, renderWindow, srcImg, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
 }
 
+// copy between views, which may be sub-rectangles of other images. Nothing is copied if they hold the same pixels.
+inline void
+copyPixels(OFX::ImageEffect &instance,
+           const OfxRectI & renderWindow,
+           const OFX::ImageView & src,
+           const OFX::ImageView & dst)
+{
+    return copyPixels(instance, renderWindow,
+                      src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                      dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+}
+
 inline void
 copyPixels(OFX::ImageEffect &instance,
            const OfxRectI & renderWindow,
@@ -1502,6 +2284,184 @@ copyPixelsOpaque(OFX::ImageEffect &instance,
 
     return copyPixelsOpaque(instance, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
 }
+
+// pixel converters, threaded versions
+template<class SRCPIX, class DSTPIX, int nComponents>
+void
+convertPixelsForDepthAndComponents(OFX::ImageEffect &instance,
+                                   const OfxRectI & renderWindow,
+                                   const SRCPIX *srcPixelData,
+                                   const OfxRectI & srcBounds,
+                                   OFX::PixelComponentEnum srcPixelComponents,
+                                   int srcPixelComponentCount,
+                                   OFX::BitDepthEnum srcBitDepth,
+                                   int srcRowBytes,
+                                   DSTPIX *dstPixelData,
+                                   const OfxRectI & dstBounds,
+                                   OFX::PixelComponentEnum dstPixelComponents,
+                                   int dstPixelComponentCount,
+                                   OFX::BitDepthEnum dstBitDepth,
+                                   int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    assert(dstPixelComponentCount == nComponents);
+
+    OFX::PixelCopierConvert<SRCPIX, DSTPIX, nComponents> processor(instance);
+    // set the images
+    processor.setDstImg(dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    processor.setSrcImg(srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, 0);
+
+    // set the render window
+    processor.setRenderWindow(renderWindow);
+
+    // Call the base class process member, this will call the derived templated process code
+    processor.process();
+}
+
+template<class SRCPIX, class DSTPIX>
+void
+convertPixelsForDepths(OFX::ImageEffect &instance,
+                       const OfxRectI & renderWindow,
+                       const void *srcPixelData,
+                       const OfxRectI & srcBounds,
+                       OFX::PixelComponentEnum srcPixelComponents,
+                       int srcPixelComponentCount,
+                       OFX::BitDepthEnum srcBitDepth,
+                       int srcRowBytes,
+                       void *dstPixelData,
+                       const OfxRectI & dstBounds,
+                       OFX::PixelComponentEnum dstPixelComponents,
+                       int dstPixelComponentCount,
+                       OFX::BitDepthEnum dstBitDepth,
+                       int dstRowBytes)
+{
+    if (dstPixelComponentCount == 4) {
+        convertPixelsForDepthAndComponents<SRCPIX, DSTPIX, 4>(instance, renderWindow,
+                                                              (const SRCPIX*)srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                              (DSTPIX *)dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } else if (dstPixelComponentCount == 3) {
+        convertPixelsForDepthAndComponents<SRCPIX, DSTPIX, 3>(instance, renderWindow,
+                                                              (const SRCPIX*)srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                              (DSTPIX *)dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } else if (dstPixelComponentCount == 2) {
+        convertPixelsForDepthAndComponents<SRCPIX, DSTPIX, 2>(instance, renderWindow,
+                                                              (const SRCPIX*)srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                              (DSTPIX *)dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    }  else if (dstPixelComponentCount == 1) {
+        convertPixelsForDepthAndComponents<SRCPIX, DSTPIX, 1>(instance, renderWindow,
+                                                              (const SRCPIX*)srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                              (DSTPIX *)dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } // switch
+}
+
+template<class SRCPIX>
+void
+convertPixelsForSrcDepth(OFX::ImageEffect &instance,
+                         const OfxRectI & renderWindow,
+                         const void *srcPixelData,
+                         const OfxRectI & srcBounds,
+                         OFX::PixelComponentEnum srcPixelComponents,
+                         int srcPixelComponentCount,
+                         OFX::BitDepthEnum srcBitDepth,
+                         int srcRowBytes,
+                         void *dstPixelData,
+                         const OfxRectI & dstBounds,
+                         OFX::PixelComponentEnum dstPixelComponents,
+                         int dstPixelComponentCount,
+                         OFX::BitDepthEnum dstBitDepth,
+                         int dstRowBytes)
+{
+    if (dstBitDepth == OFX::eBitDepthUByte) {
+        convertPixelsForDepths<SRCPIX, unsigned char>(instance, renderWindow,
+                                                      srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                      dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } else if ( (dstBitDepth == OFX::eBitDepthUShort) || (dstBitDepth == OFX::eBitDepthHalf) ) {
+        convertPixelsForDepths<SRCPIX, unsigned short>(instance, renderWindow,
+                                                       srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                       dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } else if (dstBitDepth == OFX::eBitDepthFloat) {
+        convertPixelsForDepths<SRCPIX, float>(instance, renderWindow,
+                                              srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                              dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } // switch
+}
+
+// Copy pixels between images of any depth and components, with the default component map (see getDefaultComponentMap()).
+// If the depths and components are the same, this is copyPixels().
+inline void
+convertPixels(OFX::ImageEffect &instance,
+              const OfxRectI & renderWindow,
+              const void *srcPixelData,
+              const OfxRectI & srcBounds,
+              OFX::PixelComponentEnum srcPixelComponents,
+              int srcPixelComponentCount,
+              OFX::BitDepthEnum srcBitDepth,
+              int srcRowBytes,
+              void *dstPixelData,
+              const OfxRectI & dstBounds,
+              OFX::PixelComponentEnum dstPixelComponents,
+              int dstPixelComponentCount,
+              OFX::BitDepthEnum dstBitDepth,
+              int dstRowBytes)
+{
+    assert(dstPixelData);
+    if (!srcPixelData) {
+        // no input, be black and transparent
+        return fillBlack(instance, renderWindow,
+                         dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    }
+    if ( (srcBitDepth == dstBitDepth) && (srcPixelComponents == dstPixelComponents) && (srcPixelComponentCount == dstPixelComponentCount) ) {
+        return copyPixels(instance, renderWindow,
+                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    }
+    // do the rendering
+    if ( ( (srcBitDepth != OFX::eBitDepthUByte) && (srcBitDepth != OFX::eBitDepthUShort) && (srcBitDepth != OFX::eBitDepthHalf) && (srcBitDepth != OFX::eBitDepthFloat) ) ||
+         ( (dstBitDepth != OFX::eBitDepthUByte) && (dstBitDepth != OFX::eBitDepthUShort) && (dstBitDepth != OFX::eBitDepthHalf) && (dstBitDepth != OFX::eBitDepthFloat) ) ||
+         (srcPixelComponentCount < 1) || (4 < srcPixelComponentCount) || (dstPixelComponentCount < 1) || (4 < dstPixelComponentCount) ) {
+        OFX::throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    if (srcBitDepth == OFX::eBitDepthUByte) {
+        convertPixelsForSrcDepth<unsigned char>(instance, renderWindow,
+                                                srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } else if ( (srcBitDepth == OFX::eBitDepthUShort) || (srcBitDepth == OFX::eBitDepthHalf) ) {
+        convertPixelsForSrcDepth<unsigned short>(instance, renderWindow,
+                                                 srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                                 dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } else if (srcBitDepth == OFX::eBitDepthFloat) {
+        convertPixelsForSrcDepth<float>(instance, renderWindow,
+                                        srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                        dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    } // switch
+} // convertPixels
+
+inline void
+convertPixels(OFX::ImageEffect &instance,
+              const OfxRectI & renderWindow,
+              const OFX::Image* srcImg,
+              OFX::Image* dstImg)
+{
+    const void* srcPixelData;
+    OfxRectI srcBounds;
+    OFX::PixelComponentEnum srcPixelComponents;
+    OFX::BitDepthEnum srcBitDepth;
+    int srcRowBytes;
+    void* dstPixelData;
+    OfxRectI dstBounds;
+    OFX::PixelComponentEnum dstPixelComponents;
+    OFX::BitDepthEnum dstBitDepth;
+    int dstRowBytes;
+
+    getImageData(srcImg, &srcPixelData, &srcBounds, &srcPixelComponents, &srcBitDepth, &srcRowBytes);
+    int srcPixelComponentCount = srcImg ? srcImg->getPixelComponentCount() : 0;
+    getImageData(dstImg, &dstPixelData, &dstBounds, &dstPixelComponents, &dstBitDepth, &dstRowBytes);
+    int dstPixelComponentCount = dstImg->getPixelComponentCount();
+
+    return convertPixels(instance, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+}
 } // OFX
 
 #endif // ifndef IO_ofxsCopier_h
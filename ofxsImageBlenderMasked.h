@@ -19,6 +19,9 @@
 #ifndef openfx_supportext_ofxsImageBlenderMasked_h
 #define openfx_supportext_ofxsImageBlenderMasked_h
 
+#include <vector>
+#include <algorithm>
+
 #include "ofxsProcessing.H"
 #include "ofxsMaskMix.h"
 #include "ofxsImageBlender.H"
@@ -77,7 +80,10 @@ public:
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
-        float tmpPix[nComponents];
+        if (masked) {
+            return multiThreadProcessImagesMasked(procWindow);
+        }
+
         float blend = _blend;
         float blendComp = 1.0f - blend;
 
@@ -92,13 +98,7 @@ public:
                 PIX *fromPix = (PIX *)  (_fromImg ? _fromImg->getPixelAddress(x, y) : 0);
                 PIX *toPix   = (PIX *)  (_toImg   ? _toImg->getPixelAddress(x, y)   : 0);
 
-                if ( masked && (fromPix || toPix) ) {
-                    for (int c = 0; c < nComponents; ++c) {
-                        // all images are supposed to be black and transparent outside o
-                        tmpPix[c] = toPix ? (float)toPix[c] : 0.f;
-                    }
-                    ofxsMaskMixPix<PIX, nComponents, maxValue, masked>(tmpPix, x, y, fromPix, _doMasking, _maskImg, blend, _maskInvert, dstPix);
-                } else if (fromPix && toPix) {
+                if (fromPix && toPix) {
                     assert(!masked);
                     for (int c = 0; c < nComponents; ++c) {
                         dstPix[c] = Lerp(fromPix[c], toPix[c], blend);
@@ -124,6 +124,56 @@ public:
             }
         }
     }
+
+private:
+    // blend a row at a time, using ofxsMaskMixRow
+    void multiThreadProcessImagesMasked(const OfxRectI &procWindow)
+    {
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> tmpRow(width * nComponents);
+
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            // the images exist in [fromx1, fromx2) and [tox1, tox2)
+            int fromx1, fromx2, tox1, tox2;
+            ofxsImageRow<PIX>(_fromImg, procWindow.x1, procWindow.x2, y, &fromx1, &fromx2);
+            const PIX *toPix = ofxsImageRow<PIX>(_toImg, procWindow.x1, procWindow.x2, y, &tox1, &tox2);
+
+            // all images are supposed to be black and transparent outside of their bounds
+            std::fill(tmpRow.begin(), tmpRow.end(), 0.f);
+            if (toPix) {
+                const int toStride = _toImg->getPixelComponentCount();
+                for (int x = tox1; x < tox2; ++x, toPix += toStride) {
+                    float *tmpPix = &tmpRow[(x - procWindow.x1) * nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = (float)toPix[c];
+                    }
+                }
+            }
+
+            // split the row where one of the images starts or ends: the pixels covered by
+            // neither image are black, the others are mixed
+            int bounds[6] = { procWindow.x1, fromx1, fromx2, tox1, tox2, procWindow.x2 };
+            std::sort(bounds, bounds + 6);
+            for (int i = 0; i < 5; ++i) {
+                const int x1 = bounds[i];
+                const int x2 = bounds[i + 1];
+                if (x2 <= x1) {
+                    continue;
+                }
+                PIX *rowPix = dstPix + (x1 - procWindow.x1) * nComponents;
+                if ( ( (fromx1 <= x1) && (x1 < fromx2) ) || ( (tox1 <= x1) && (x1 < tox2) ) ) {
+                    ofxsMaskMixRow<PIX, nComponents, maxValue, masked>(&tmpRow[(x1 - procWindow.x1) * nComponents], x1, x2, y, _fromImg, _doMasking, _maskImg, _blend, _maskInvert, rowPix);
+                } else {
+                    std::fill( rowPix, rowPix + (x2 - x1) * nComponents, PIX(0) );
+                }
+            }
+        }
+    }
 };
 };
 
@@ -0,0 +1,278 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX render instrumentation
+ */
+
+#ifdef OFXS_INSTRUMENTATION
+// use TinyThread 1.2 from https://gitorious.org/tinythread/tinythreadpp
+// for portable C++11-like threads.
+// It must come before the standard headers: in C++11, they define ATOMIC_FLAG_INIT, which tinythread.h
+// redefines unconditionally.
+#include "tinythread.h"
+#endif
+
+#include "ofxsInstrumentation.h"
+
+#ifdef OFXS_INSTRUMENTATION
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <iomanip>
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
+#include "ofxsProcessorTuning.h"
+
+// records beyond this number are dropped
+#define kOfxsInstrumentationMaxRecords 100000
+
+using namespace tthread;
+using std::vector;
+using std::string;
+
+namespace OFX {
+namespace Instrumentation {
+namespace {
+mutex recordsLock; // protects records, dropped and nextThreadId
+vector<ProcessRecord> records;
+std::size_t dropped = 0;
+unsigned long nextThreadId = 1;
+thread_local unsigned long currentId = 0; // 0 until currentThreadId() is called
+
+// the demangled name of the processor, with the characters that would break JSON removed
+string
+processorName(const char* name)
+{
+    string s(name);
+
+#ifdef __GNUC__
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+    if ( (status == 0) && demangled ) {
+        s = demangled;
+    }
+    std::free(demangled);
+#endif
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        if ( (s[i] == '"') || (s[i] == '\\') || ( (unsigned char)s[i] < 32 ) ) {
+            s[i] = ' ';
+        }
+    }
+
+    return s;
+}
+
+// dump the records when the plugin is unloaded, if OFXS_INSTRUMENTATION_FILE is set
+struct AutoDump
+{
+    ~AutoDump()
+    {
+        const char* filename = std::getenv("OFXS_INSTRUMENTATION_FILE");
+
+        if ( filename && *filename && !records.empty() ) {
+            writeFile(filename);
+        }
+    }
+};
+
+AutoDump autoDump;
+} // anon namespace
+
+double
+now()
+{
+    return OFX::ProcessorTuning::now();
+}
+
+unsigned long
+currentThreadId()
+{
+    if (currentId == 0) {
+        // small numbers, starting at 1, are easier to read in the trace viewer
+        lock_guard<mutex> guard(recordsLock);
+        currentId = nextThreadId++;
+    }
+
+    return currentId;
+}
+
+void
+record(const ProcessRecord & r)
+{
+    lock_guard<mutex> guard(recordsLock);
+
+    if (records.size() < kOfxsInstrumentationMaxRecords) {
+        records.push_back(r);
+    } else {
+        ++dropped;
+    }
+}
+
+void
+clear()
+{
+    lock_guard<mutex> guard(recordsLock);
+
+    records.clear();
+    dropped = 0;
+}
+
+std::size_t
+size()
+{
+    lock_guard<mutex> guard(recordsLock);
+
+    return records.size();
+}
+
+void
+writeJSON(std::ostream & os)
+{
+    lock_guard<mutex> guard(recordsLock);
+    // the times are in microseconds since an arbitrary origin: print them all
+    const std::ios_base::fmtflags flags = os.flags();
+    const std::streamsize precision = os.precision();
+
+    os << std::fixed << std::setprecision(3);
+    os << "{\n\"dropped\": " << dropped << ",\n\"processes\": [";
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        const ProcessRecord & r = records[i];
+        double pixels = 0.;
+        double busyMax = 0.;
+        double busySum = 0.;
+        int nBusy = 0;
+        double firstAbort = -1.;
+        for (std::size_t j = 0; j < r.threads.size(); ++j) {
+            const ThreadRecord & t = r.threads[j];
+            if (!t.threadId) {
+                continue;
+            }
+            pixels += t.pixels;
+            busyMax = std::max(busyMax, t.end - t.start);
+            busySum += t.end - t.start;
+            ++nBusy;
+            if ( t.aborted && ( (firstAbort < 0.) || (t.end < firstAbort) ) ) {
+                firstAbort = t.end;
+            }
+        }
+        os << (i ? ",\n" : "\n");
+        os << "{\"name\": \"" << processorName(r.name) << "\""
+           << ", \"thread\": " << r.threadId
+           << ", \"start_us\": " << r.start
+           << ", \"preprocess_us\": " << r.parallelStart - r.start
+           << ", \"parallel_us\": " << r.parallelEnd - r.parallelStart
+           << ", \"postprocess_us\": " << r.end - r.parallelEnd
+           << ", \"total_us\": " << r.end - r.start
+           << ", \"threads\": " << r.nThreads
+           << ", \"pixels\": " << pixels
+           // the ratio of the longest thread time to the average thread time: 1 is perfect balance
+           << ", \"imbalance\": " << ( (busySum > 0.) ? busyMax * nBusy / busySum : 1. )
+           << ", \"aborted\": " << (firstAbort >= 0. ? "true" : "false");
+        if (firstAbort >= 0.) {
+            os << ", \"abort_latency_us\": " << r.parallelEnd - firstAbort;
+        }
+        if (r.maskTilesSkipped >= 0.) {
+            os << ", \"mask_tiles_skipped\": " << r.maskTilesSkipped;
+        }
+        os << ", \"thread_busy_us\": [";
+        bool first = true;
+        for (std::size_t j = 0; j < r.threads.size(); ++j) {
+            const ThreadRecord & t = r.threads[j];
+            if (t.threadId) {
+                os << (first ? "" : ", ") << t.end - t.start;
+                first = false;
+            }
+        }
+        os << "]}";
+    }
+    os << "\n]\n}\n";
+    os.flags(flags);
+    os.precision(precision);
+} // writeJSON
+
+void
+writeChromeTrace(std::ostream & os)
+{
+    lock_guard<mutex> guard(recordsLock);
+    const std::ios_base::fmtflags flags = os.flags();
+    const std::streamsize precision = os.precision();
+
+    os << std::fixed << std::setprecision(3);
+    // see https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+    os << "{\"traceEvents\": [";
+    bool first = true;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        const ProcessRecord & r = records[i];
+        const string name = processorName(r.name);
+        const double phases[4] = { r.start, r.parallelStart, r.parallelEnd, r.end };
+        const char* phaseNames[3] = { "preProcess", "parallel", "postProcess" };
+        os << (first ? "\n" : ",\n");
+        first = false;
+        os << "{\"name\": \"" << name << "\", \"cat\": \"process\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << r.threadId
+           << ", \"ts\": " << r.start << ", \"dur\": " << r.end - r.start
+           << ", \"args\": {\"threads\": " << r.nThreads;
+        if (r.maskTilesSkipped >= 0.) {
+            os << ", \"mask_tiles_skipped\": " << r.maskTilesSkipped;
+        }
+        os << "}}";
+        for (int p = 0; p < 3; ++p) {
+            os << ",\n{\"name\": \"" << phaseNames[p] << "\", \"cat\": \"process\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << r.threadId
+               << ", \"ts\": " << phases[p] << ", \"dur\": " << phases[p + 1] - phases[p] << "}";
+        }
+        for (std::size_t j = 0; j < r.threads.size(); ++j) {
+            const ThreadRecord & t = r.threads[j];
+            if (!t.threadId) {
+                continue;
+            }
+            os << ",\n{\"name\": \"" << name << "\", \"cat\": \"thread\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << t.threadId
+               << ", \"ts\": " << t.start << ", \"dur\": " << t.end - t.start
+               << ", \"args\": {\"index\": " << j << ", \"pixels\": " << t.pixels << ", \"aborted\": " << (t.aborted ? "true" : "false") << "}}";
+        }
+    }
+    os << "\n],\n\"displayTimeUnit\": \"ms\"}\n";
+    os.flags(flags);
+    os.precision(precision);
+} // writeChromeTrace
+
+bool
+writeFile(const char* filename)
+{
+    std::ofstream os(filename);
+
+    if (!os) {
+        return false;
+    }
+    const std::size_t len = std::strlen(filename);
+    if ( ( (len >= 6) && (std::strcmp(filename + len - 6, ".trace") == 0) ) ||
+         ( (len >= 11) && (std::strcmp(filename + len - 11, ".trace.json") == 0) ) ) {
+        writeChromeTrace(os);
+    } else {
+        writeJSON(os);
+    }
+
+    return !os.fail();
+}
+} // namespace Instrumentation
+} // namespace OFX
+
+#endif // OFXS_INSTRUMENTATION
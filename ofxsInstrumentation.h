@@ -0,0 +1,211 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX render instrumentation
+ */
+
+#ifndef openfx_supportext_ofxsInstrumentation_h
+#define openfx_supportext_ofxsInstrumentation_h
+
+/** @file This file contains an optional recorder of the time spent in image processors.
+
+   It is compiled out unless OFXS_INSTRUMENTATION is defined (and ofxsInstrumentation.cpp is
+   compiled with the same definition). PixelProcessor and Transform3x3ProcessorBase use it
+   automatically. Other processors may hold a ProcessRecorder and call it the same way.
+
+   For each call to process(), the recorder stores the wall time of preProcess(), of the parallel
+   section and of postProcess(), and for each thread its busy time and the number of pixels it
+   processed. Each thread writes only into its own slot, so that nothing is locked while rendering.
+   Masked processors also store the fraction of the mask tiles that were skipped (see MaskOccupancy).
+   The record is added to a global list when process() returns.
+
+   If the render was aborted, the abort latency is the time between the first thread which returned
+   with abort() set, and the end of the parallel section, i.e. the time the other threads took
+   to notice.
+
+   The records can be written as JSON (a summary per process() call) or as a Chrome trace file
+   (load it in chrome://tracing or https://ui.perfetto.dev). If the environment variable
+   OFXS_INSTRUMENTATION_FILE is set, the records are written to that file when the plugin is
+   unloaded: as a Chrome trace if its name ends with ".trace" or ".trace.json", as JSON otherwise.
+ */
+
+#ifdef OFXS_INSTRUMENTATION
+
+#include <cstddef>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+
+namespace OFX {
+namespace Instrumentation {
+/// a monotonic clock, in microseconds
+double now();
+
+/// an identifier of the calling thread
+unsigned long currentThreadId();
+
+struct ThreadRecord
+{
+    unsigned long threadId; // 0 if the slot was not used
+    double start; // microseconds
+    double end;
+    double pixels;
+    bool aborted; // abort() was set when the thread returned
+};
+
+struct ProcessRecord
+{
+    const char* name; // typeid name of the processor
+    unsigned long threadId; // thread which called process()
+    double start; // start of process()
+    double parallelStart; // end of preProcess()
+    double parallelEnd; // start of postProcess()
+    double end; // end of process()
+    unsigned int nThreads;
+    double maskTilesSkipped; // fraction of the tiles of the MaskOccupancy that were skipped, -1 if there was none
+    std::vector<ThreadRecord> threads;
+};
+
+/// add a record to the global list (thread-safe)
+void record(const ProcessRecord & r);
+
+/// remove all records
+void clear();
+
+/// number of records
+std::size_t size();
+
+/// write a summary of each process() call as JSON
+void writeJSON(std::ostream & os);
+
+/// write the records in the Chrome trace event format
+void writeChromeTrace(std::ostream & os);
+
+/// write the records to a file, as a Chrome trace if the name ends with ".trace" or ".trace.json",
+/// as JSON otherwise. Returns false if the file could not be written.
+bool writeFile(const char* filename);
+
+/// the recorder of a processor. Each thread only writes into its own slot.
+class ProcessRecorder
+{
+public:
+    ProcessRecorder()
+        : _r()
+    {
+        _r.name = "";
+        _r.threadId = 0;
+        _r.start = _r.parallelStart = _r.parallelEnd = _r.end = 0.;
+        _r.nThreads = 0;
+        _r.maskTilesSkipped = -1.;
+    }
+
+    /// at the start of process(). nSlots is the maximum number of threads.
+    void beginProcess(const char* name,
+                      unsigned int nSlots)
+    {
+        _r.name = name;
+        _r.threadId = currentThreadId();
+        _r.nThreads = 0;
+        _r.maskTilesSkipped = -1.;
+        ThreadRecord t = { 0, 0., 0., 0., false };
+        _r.threads.assign(nSlots, t);
+        _r.start = now();
+        _r.parallelStart = _r.parallelEnd = 0.;
+    }
+
+    /// after preProcess()
+    void beginParallel(unsigned int nThreads)
+    {
+        _r.nThreads = nThreads;
+        _r.parallelStart = now();
+    }
+
+    /// at the start of multiThreadFunction()
+    void beginThread(unsigned int threadIndex)
+    {
+        if ( threadIndex < _r.threads.size() ) {
+            ThreadRecord & t = _r.threads[threadIndex];
+            t.threadId = currentThreadId();
+            t.start = now();
+        }
+    }
+
+    /// at the end of multiThreadFunction()
+    void endThread(unsigned int threadIndex,
+                   double pixels,
+                   bool aborted)
+    {
+        if ( threadIndex < _r.threads.size() ) {
+            ThreadRecord & t = _r.threads[threadIndex];
+            t.end = now();
+            t.pixels = pixels;
+            t.aborted = aborted;
+        }
+    }
+
+    /// the fraction of the tiles of the mask that were skipped (see MaskOccupancy)
+    void setMaskTilesSkipped(double fraction)
+    {
+        _r.maskTilesSkipped = fraction;
+    }
+
+    /// before postProcess()
+    void endParallel()
+    {
+        _r.parallelEnd = now();
+    }
+
+    /// at the end of process(). If beginParallel() and endParallel() were not called, the parallel
+    /// section is taken from the thread records.
+    void endProcess()
+    {
+        _r.end = now();
+        if (_r.parallelStart == 0. || _r.parallelEnd == 0.) {
+            _r.parallelStart = _r.end;
+            _r.parallelEnd = _r.start;
+            unsigned int nThreads = 0;
+            for (std::size_t i = 0; i < _r.threads.size(); ++i) {
+                const ThreadRecord & t = _r.threads[i];
+                if (t.threadId) {
+                    ++nThreads;
+                    _r.parallelStart = std::min(_r.parallelStart, t.start);
+                    _r.parallelEnd = std::max(_r.parallelEnd, t.end);
+                }
+            }
+            if (nThreads == 0) {
+                _r.parallelStart = _r.parallelEnd = _r.start;
+            }
+            if (_r.nThreads == 0) {
+                _r.nThreads = nThreads;
+            }
+        }
+        record(_r);
+    }
+
+private:
+    ProcessRecord _r;
+};
+} // namespace Instrumentation
+} // namespace OFX
+
+#endif // OFXS_INSTRUMENTATION
+
+#endif // ifndef openfx_supportext_ofxsInstrumentation_h
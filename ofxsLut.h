@@ -125,6 +125,83 @@ charToUint8xx(unsigned char quantum)
     return (unsigned short) (quantum << 8);
 }
 
+/// maps an IEEE 754 half-float, stored as an unsigned short (as in eBitDepthHalf images), to a float
+inline float
+halfToFloat(unsigned short h)
+{
+    const unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exponent = (h >> 10) & 0x1f;
+    unsigned int mantissa = h & 0x3ff;
+    unsigned int bits;
+
+    if (exponent == 0x1f) {
+        // inf or nan
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        // normalized
+        bits = sign | ( (exponent + 112) << 23 ) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        // zero
+        bits = sign;
+    } else {
+        // denormalized: normalize it
+        exponent = 113;
+        while ( !(mantissa & 0x400) ) {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ( (mantissa & 0x3ff) << 13 );
+    }
+    float f;
+    std::memcpy( &f, &bits, sizeof(f) );
+
+    return f;
+}
+
+/// maps a float to an IEEE 754 half-float stored as an unsigned short, rounding to nearest even
+inline unsigned short
+floatToHalf(float f)
+{
+    unsigned int bits;
+
+    std::memcpy( &bits, &f, sizeof(bits) );
+    const unsigned short sign = (unsigned short)( (bits >> 16) & 0x8000 );
+    const unsigned int absBits = bits & 0x7fffffff;
+    if (absBits >= 0x7f800000) {
+        // inf or nan (keep nans quiet)
+        return sign | 0x7c00 | (absBits > 0x7f800000 ? 0x200 : 0);
+    }
+    if (absBits >= 0x477ff000) {
+        // rounds to more than 65504, the largest half
+        return sign | 0x7c00;
+    }
+    if (absBits < 0x38800000) {
+        // below 2^-14, the smallest normalized half
+        if (absBits <= 0x33000000) {
+            // rounds to zero (2^-25 is a tie, rounded to even)
+            return sign;
+        }
+        const unsigned int mantissa = (absBits & 0x7fffff) | 0x800000;
+        const int shift = 126 - (int)(absBits >> 23);
+        unsigned int h = mantissa >> shift;
+        const unsigned int rem = mantissa & ( (1u << shift) - 1 );
+        const unsigned int tie = 1u << (shift - 1);
+        if ( (rem > tie) || ( (rem == tie) && (h & 1) ) ) {
+            ++h; // may carry to the smallest normalized half, which is correct
+        }
+
+        return sign | (unsigned short)h;
+    }
+    // rebias the exponent from 127 to 15
+    unsigned int h = (absBits - 0x38000000) >> 13;
+    const unsigned int rem = absBits & 0x1fff;
+    if ( (rem > 0x1000) || ( (rem == 0x1000) && (h & 1) ) ) {
+        ++h; // may carry to the exponent, which is correct
+    }
+
+    return sign | (unsigned short)h;
+}
+
 /* @brief Converts a float ranging in [0 - 1.f] in the desired color-space to linear color-space also ranging in [0 - 1.f]*/
 typedef float (*fromColorSpaceFunctionV1)(float v);
 
@@ -629,6 +706,61 @@ public:
         }
     }
 
+    // the same conversions, from and to image views (which may be sub-rectangles of other images)
+    void to_byte_packed_dither(const OFX::ImageView & src,
+                               const OfxRectI & renderWindow,
+                               const OFX::ImageView & dst) const
+    {
+        to_byte_packed_dither(src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                              renderWindow,
+                              dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+    }
+
+    void to_byte_packed_nodither(const OFX::ImageView & src,
+                                 const OfxRectI & renderWindow,
+                                 const OFX::ImageView & dst) const
+    {
+        to_byte_packed_nodither(src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                                renderWindow,
+                                dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+    }
+
+    void to_byte_grayscale_nodither(const OFX::ImageView & src,
+                                    const OfxRectI & renderWindow,
+                                    const OFX::ImageView & dst) const
+    {
+        to_byte_grayscale_nodither(src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                                   renderWindow,
+                                   dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+    }
+
+    void to_short_packed(const OFX::ImageView & src,
+                         const OfxRectI & renderWindow,
+                         const OFX::ImageView & dst) const
+    {
+        to_short_packed(src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                        renderWindow,
+                        dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+    }
+
+    void from_byte_packed(const OFX::ImageView & src,
+                          const OfxRectI & renderWindow,
+                          const OFX::ImageView & dst) const
+    {
+        from_byte_packed(src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                         renderWindow,
+                         dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+    }
+
+    void from_short_packed(const OFX::ImageView & src,
+                           const OfxRectI & renderWindow,
+                           const OFX::ImageView & dst) const
+    {
+        from_short_packed(src.getPixelData(), src.getBounds(), src.getPixelComponents(), src.getPixelComponentCount(), src.getPixelDepth(), src.getRowBytes(),
+                          renderWindow,
+                          dst.getPixelData(), dst.getBounds(), dst.getPixelComponents(), dst.getPixelComponentCount(), dst.getPixelDepth(), dst.getRowBytes());
+    }
+
 private:
     static float index_to_float(const unsigned short i);
     static unsigned short hipart(const float f);
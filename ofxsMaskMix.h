@@ -24,8 +24,17 @@
 #define Misc_ofxsMaskMix_h
 
 #include <cfloat> // FLT_EPSILON
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OFXS_MASKMIX_SSE2
+#include <emmintrin.h>
+#endif
 
 #include <ofxsImageEffect.h>
+#include "ofxsPixelProcessor.h"
 
 #define kParamPremult "premult"
 #define kParamPremultLabel "(Un)premult"
@@ -179,7 +188,7 @@ ofxsClampIfInt(float v,
         return v;
     }
 
-    return ofxsClamp(v, min, max) * maxValue + 0.5;
+    return ofxsClamp(v, min, max) + 0.5;
 }
 
 // normalize in [0,1]
@@ -360,6 +369,234 @@ ofxsPremultPix(const float unpPix[4], //!< interpolated unpremultiplied pixel
 }
 
 
+// Row kernels: the same computations as ofxsUnPremult, ofxsPremult and ofxsPix, on a span of n
+// contiguous pixels. The RGBA case is vectorized, one pixel per SSE register, with the alpha test
+// done as a blend instead of a branch. The results are identical to the per-pixel functions:
+// the divisions are real divisions (a reciprocal would be off by one ulp), and the integer
+// rounding is exact.
+
+// number of pixels processed at once by the users of the row kernels, so that their buffers stay in L1
+#define kOfxsMaskMixRowPixels 256
+
+#ifdef OFXS_MASKMIX_SSE2
+// load and store the four components of an RGBA pixel
+template <class PIX>
+struct MaskMixSSE2Pixel
+{
+    static const bool supported = false;
+    static __m128 load(const PIX* /*p*/) { return _mm_setzero_ps(); }
+    static void store(PIX* /*p*/, __m128 /*v*/) {}
+    static void storeInt(PIX* /*p*/, __m128i /*v*/) {}
+};
+
+template <>
+struct MaskMixSSE2Pixel<float>
+{
+    static const bool supported = true;
+    static __m128 load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, __m128 v) { _mm_storeu_ps(p, v); }
+    static void storeInt(float* /*p*/, __m128i /*v*/) {}
+};
+
+template <>
+struct MaskMixSSE2Pixel<unsigned short>
+{
+    static const bool supported = true;
+    static __m128 load(const unsigned short* p)
+    {
+        const __m128i i = _mm_loadl_epi64( (const __m128i*)p );
+
+        return _mm_cvtepi32_ps( _mm_unpacklo_epi16( i, _mm_setzero_si128() ) );
+    }
+
+    static void store(unsigned short* /*p*/, __m128 /*v*/) {}
+    // v is within [0,65535]. There is no unsigned pack in SSE2: shift to the signed range and back.
+    static void storeInt(unsigned short* p, __m128i v)
+    {
+        v = _mm_sub_epi32( v, _mm_set1_epi32(32768) );
+        v = _mm_packs_epi32(v, v);
+        _mm_storel_epi64( (__m128i*)p, _mm_add_epi16( v, _mm_set1_epi16( (short)0x8000 ) ) );
+    }
+};
+
+template <>
+struct MaskMixSSE2Pixel<unsigned char>
+{
+    static const bool supported = true;
+    static __m128 load(const unsigned char* p)
+    {
+        int rgba;
+
+        std::memcpy(&rgba, p, 4);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i i = _mm_unpacklo_epi8(_mm_cvtsi32_si128(rgba), zero);
+
+        return _mm_cvtepi32_ps( _mm_unpacklo_epi16(i, zero) );
+    }
+
+    static void store(unsigned char* /*p*/, __m128 /*v*/) {}
+    // v is within [0,255]
+    static void storeInt(unsigned char* p, __m128i v)
+    {
+        v = _mm_packs_epi32(v, v);
+        const int rgba = _mm_cvtsi128_si32( _mm_packus_epi16(v, v) );
+        std::memcpy(p, &rgba, 4);
+    }
+};
+
+// (int)(ofxsClamp(v, 0, maxValue) + 0.5), as ofxsClampIfInt computes it in double precision.
+// Adding 0.5f in single precision may round up to the next integer (e.g. for v = 0.49999997f),
+// so the fractional part is compared to 0.5 instead.
+inline __m128i
+ofxsClampRoundSSE2(__m128 v,
+                   float maxValue)
+{
+    v = _mm_min_ps( _mm_max_ps( v, _mm_setzero_ps() ), _mm_set1_ps(maxValue) );
+    const __m128i i = _mm_cvttps_epi32(v);
+    const __m128 roundUp = _mm_cmpge_ps( _mm_sub_ps( v, _mm_cvtepi32_ps(i) ), _mm_set1_ps(0.5f) );
+
+    // the mask is -1 where the value is rounded up
+    return _mm_sub_epi32( i, _mm_castps_si128(roundUp) );
+}
+
+#endif // OFXS_MASKMIX_SSE2
+
+// normalize n pixels in [0,1] and unpremultiply them, as ofxsUnPremult does.
+// unpPix receives 4 components per pixel.
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsUnPremultRow(const PIX *srcPix,
+                 int n,
+                 float *unpPix,
+                 bool premult,
+                 int premultChannel)
+{
+    int x = 0;
+
+#ifdef OFXS_MASKMIX_SSE2
+    if ( (nComponents == 4) && MaskMixSSE2Pixel<PIX>::supported ) {
+        const __m128 maxV = _mm_set1_ps( (float)maxValue );
+        // alpha is compared with the threshold converted to PIX, as in ofxsUnPremult (it is 0 for integer types),
+        // which also covers the alpha <= 0 case
+        const __m128 threshold = _mm_set1_ps( (float)(PIX)(FLT_EPSILON * maxValue) );
+        // R, G and B are divided by alpha if premult, alpha is always divided by maxValue
+        const __m128 rgbByAlpha = _mm_castsi128_ps( premult ? _mm_set_epi32(0, -1, -1, -1) : _mm_setzero_si128() );
+        for (; x < n; ++x) {
+            const __m128 p = MaskMixSSE2Pixel<PIX>::load(srcPix + 4 * x);
+            const __m128 alpha = _mm_shuffle_ps( p, p, _MM_SHUFFLE(3, 3, 3, 3) );
+            const __m128 byAlpha = _mm_and_ps( _mm_cmpgt_ps(alpha, threshold), rgbByAlpha );
+            const __m128 divisor = _mm_or_ps( _mm_and_ps(byAlpha, alpha), _mm_andnot_ps(byAlpha, maxV) );
+            _mm_storeu_ps( unpPix + 4 * x, _mm_div_ps(p, divisor) );
+        }
+    }
+#endif
+    for (; x < n; ++x) {
+        ofxsUnPremult<PIX, nComponents, maxValue>(srcPix + nComponents * x, unpPix + 4 * x, premult, premultChannel);
+    }
+}
+
+// normalize n pixels in [0,1] by multiplying by 1/maxValue, as the premultiplying copiers do
+// (this may differ from ofxsToRGBA by one ulp). unpPix receives 4 components per pixel.
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsNormalizeRow(const PIX *srcPix,
+                 int n,
+                 float *unpPix)
+{
+    int x = 0;
+
+#ifdef OFXS_MASKMIX_SSE2
+    if ( (nComponents == 4) && MaskMixSSE2Pixel<PIX>::supported ) {
+        const __m128 scale = _mm_set1_ps(1.f / maxValue);
+        for (; x < n; ++x) {
+            _mm_storeu_ps( unpPix + 4 * x, _mm_mul_ps(MaskMixSSE2Pixel<PIX>::load(srcPix + 4 * x), scale) );
+        }
+    }
+#endif
+    for (; x < n; ++x) {
+        const PIX *p = srcPix + nComponents * x;
+        float *unp = unpPix + 4 * x;
+        if (nComponents == 1) {
+            unp[0] = 0.f;
+            unp[1] = 0.f;
+            unp[2] = 0.f;
+            unp[3] = p[0] * (1.f / maxValue);
+        } else if (nComponents == 2) {
+            unp[0] = p[0] * (1.f / maxValue);
+            unp[1] = p[1] * (1.f / maxValue);
+            unp[2] = 0.f;
+            unp[3] = 1.f;
+        } else {
+            unp[0] = p[0] * (1.f / maxValue);
+            unp[1] = p[1] * (1.f / maxValue);
+            unp[2] = p[2] * (1.f / maxValue);
+            unp[3] = (nComponents == 4) ? (p[3] * (1.f / maxValue)) : 1.f;
+        }
+    }
+}
+
+// premultiply and denormalize n pixels in [0, maxValue], as ofxsPremult does.
+// unpPix has 4 components per pixel, tmpPix receives nComponents per pixel.
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsPremultRow(const float *unpPix,
+               int n,
+               float *tmpPix,
+               bool premult,
+               int premultChannel)
+{
+    int x = 0;
+
+#ifdef OFXS_MASKMIX_SSE2
+    if (nComponents == 4) {
+        const __m128 maxV = _mm_set1_ps( (float)maxValue );
+        if (!premult) {
+            for (; x < n; ++x) {
+                _mm_storeu_ps( tmpPix + 4 * x, _mm_mul_ps(_mm_loadu_ps(unpPix + 4 * x), maxV) );
+            }
+        } else {
+            const __m128 rgb = _mm_castsi128_ps( _mm_set_epi32(0, -1, -1, -1) );
+            const __m128 one = _mm_set_ps(1.f, 0.f, 0.f, 0.f);
+            for (; x < n; ++x) {
+                const __m128 p = _mm_loadu_ps(unpPix + 4 * x);
+                // premult by alpha <= 0 gives 0: max() returns 0 for negative and NaN alpha, as std::max(0.f, alpha)
+                const __m128 alpha = _mm_max_ps( _mm_shuffle_ps( p, p, _MM_SHUFFLE(3, 3, 3, 3) ), _mm_setzero_ps() );
+                // (r, g, b, 1) * alpha gives the premultiplied color and alpha
+                const __m128 rgb1 = _mm_or_ps(_mm_and_ps(p, rgb), one);
+                _mm_storeu_ps( tmpPix + 4 * x, _mm_mul_ps(_mm_mul_ps(rgb1, alpha), maxV) );
+            }
+        }
+    }
+#endif
+    for (; x < n; ++x) {
+        ofxsPremult<PIX, nComponents, maxValue>(unpPix + 4 * x, tmpPix + nComponents * x, premult, premultChannel);
+    }
+}
+
+// clamp and round n pixels, as ofxsPix does.
+// tmpPix is not normalized, it is within [0,maxValue]
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsPixRow(const float *tmpPix,
+           int n,
+           PIX *dstPix)
+{
+    // each component is processed independently, so this works for any number of components
+    const int size = n * nComponents;
+    int i = 0;
+
+#ifdef OFXS_MASKMIX_SSE2
+    if ( MaskMixSSE2Pixel<PIX>::supported && (maxValue != 1) ) {
+        for (; i + 4 <= size; i += 4) {
+            MaskMixSSE2Pixel<PIX>::storeInt( dstPix + i, ofxsClampRoundSSE2( _mm_loadu_ps(tmpPix + i), (float)maxValue ) );
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        dstPix[i] = ofxsClampIfInt<PIX, maxValue>(tmpPix[i], 0, maxValue);
+    }
+}
+
 // tmpPix is not normalized, it is within [0,maxValue]
 template <class PIX, int nComponents, int maxValue>
 void
@@ -536,6 +773,196 @@ ofxsMaskMix(const float *tmpPix, //!< interpolated pixel
 
     return ofxsMaskMixPix<PIX, nComponents, maxValue, masked>(tmpPix, x, y, srcPix, domask, maskImg, mix, maskInvert, dstPix);
 }
+
+// dstPix is tmpPix mixed with srcPix by alpha (one value per pixel), as ofxsMaskMixPix does once alpha is known.
+// tmpPix is not normalized, it is within [0,maxValue].
+// srcPix may be NULL (black and transparent), its pixels are srcStride components apart.
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsMixRow(const float *tmpPix,
+           const float *alpha,
+           const PIX *srcPix,
+           int srcStride,
+           int n,
+           PIX *dstPix)
+{
+    int x = 0;
+
+#ifdef OFXS_MASKMIX_SSE2
+    if ( (nComponents == 4) && MaskMixSSE2Pixel<PIX>::supported ) {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.f);
+        for (; x < n; ++x) {
+            const __m128 a = _mm_set1_ps(alpha[x]);
+            const __m128 t = _mm_loadu_ps(tmpPix + 4 * x);
+            const __m128 s = srcPix ? MaskMixSSE2Pixel<PIX>::load(srcPix + srcStride * x) : zero;
+            // tmpPix * alpha + (1 - alpha) * srcPix, without the second term if there is no srcPix (to keep the sign of zero)
+            __m128 v = _mm_mul_ps(t, a);
+            if (srcPix) {
+                v = _mm_add_ps( v, _mm_mul_ps(_mm_sub_ps(one, a), s) );
+            }
+            // alpha == 1 gives tmpPix, alpha == 0 gives srcPix, even if the other one is infinite
+            const __m128 isOne = _mm_cmpeq_ps(a, one);
+            const __m128 isZero = _mm_cmpeq_ps(a, zero);
+            v = _mm_or_ps( _mm_and_ps(isOne, t), _mm_andnot_ps(isOne, v) );
+            v = _mm_or_ps( _mm_and_ps(isZero, s), _mm_andnot_ps(isZero, v) );
+            if (maxValue == 1) {
+                MaskMixSSE2Pixel<PIX>::store(dstPix + 4 * x, v);
+            } else {
+                MaskMixSSE2Pixel<PIX>::storeInt( dstPix + 4 * x, ofxsClampRoundSSE2(v, (float)maxValue) );
+            }
+        }
+    }
+#endif
+    for (; x < n; ++x) {
+        const float *t = tmpPix + nComponents * x;
+        const PIX *s = srcPix ? (srcPix + srcStride * x) : NULL;
+        PIX *d = dstPix + nComponents * x;
+        const float a = alpha[x];
+        if (a == 0.) {
+            for (int c = 0; c < nComponents; ++c) {
+                d[c] = s ? ofxsClampIfInt<PIX, maxValue>(s[c], 0, maxValue) : PIX();
+            }
+        } else if (a == 1.) {
+            for (int c = 0; c < nComponents; ++c) {
+                d[c] = ofxsClampIfInt<PIX, maxValue>(t[c], 0, maxValue);
+            }
+        } else if (s) {
+            for (int c = 0; c < nComponents; ++c) {
+                d[c] = ofxsClampIfInt<PIX, maxValue>(t[c] * a + (1.f - a) * s[c], 0, maxValue);
+            }
+        } else {
+            for (int c = 0; c < nComponents; ++c) {
+                d[c] = ofxsClampIfInt<PIX, maxValue>(t[c] * a, 0, maxValue);
+            }
+        }
+    }
+} // ofxsMixRow
+
+// the part [*rowx1, *rowx2) of [x1, x2) on line y covered by img, and the address of its first pixel (NULL if it is empty)
+template <class PIX>
+const PIX *
+ofxsImageRow(const OFX::ImageView & img,
+             int x1,
+             int x2,
+             int y,
+             int *rowx1,
+             int *rowx2)
+{
+    *rowx1 = *rowx2 = x2;
+    if ( img.isEmpty() ) {
+        return NULL;
+    }
+    const OfxRectI bounds = img.getBounds();
+    if ( (y < bounds.y1) || (bounds.y2 <= y) ) {
+        return NULL;
+    }
+    const int rx1 = std::max(x1, bounds.x1);
+    const int rx2 = std::min(x2, bounds.x2);
+    const PIX *pix = (rx1 < rx2) ? (const PIX *)img.getPixelAddress(rx1, y) : NULL;
+    if (pix) {
+        *rowx1 = rx1;
+        *rowx2 = rx2;
+    }
+
+    return pix;
+}
+
+// the result of ofxsMaskMixRow where the mask scale or the mix is 0: the pixels [x1, x2) of line y of srcImg,
+// black and transparent outside of srcImg (which may be empty or NULL)
+template <class PIX, int nComponents, int maxValue>
+void
+ofxsBackgroundRow(int x1,
+                  int x2,
+                  int y,
+                  const OFX::ImageView & srcImg,
+                  PIX *dstPix) //!< destination pixel at x1,y
+{
+    int sx1, sx2;
+    const PIX *srcRow = ofxsImageRow<PIX>(srcImg, x1, x2, y, &sx1, &sx2);
+    const int srcStride = srcRow ? srcImg.getPixelComponentCount() : 0;
+    PIX *dst = dstPix + (sx1 - x1) * nComponents;
+
+    std::fill( dstPix, dst, PIX() );
+    if ( (maxValue == 1) || ( maxValue == std::numeric_limits<PIX>::max() ) ) {
+        // clamping and rounding does not change the value
+        if (srcStride == nComponents) {
+            std::copy(srcRow, srcRow + (sx2 - sx1) * nComponents, dst);
+        } else {
+            for (int x = sx1; x < sx2; ++x, srcRow += srcStride, dst += nComponents) {
+                std::copy(srcRow, srcRow + nComponents, dst);
+            }
+        }
+    } else {
+        for (int x = sx1; x < sx2; ++x, srcRow += srcStride, dst += nComponents) {
+            for (int c = 0; c < nComponents; ++c) {
+                dst[c] = ofxsClampIfInt<PIX, maxValue>(srcRow[c], 0, maxValue);
+            }
+        }
+    }
+    std::fill( dstPix + (sx2 - x1) * nComponents, dstPix + (x2 - x1) * nComponents, PIX() );
+} // ofxsBackgroundRow
+
+// tmpRow holds the pixels [x1, x2) of line y, it is not normalized, it is within [0,maxValue].
+// The result is the same as calling ofxsMaskMixPix on each pixel, with the background pixel taken from srcImg
+// (which may be empty or NULL). Unlike ofxsMaskMix, srcImg is also used if masked is false and mix is not 1.
+// The source and mask rows are fetched once, and the pixels outside of their bounds are processed in bulk.
+template <class PIX, int nComponents, int maxValue, bool masked>
+void
+ofxsMaskMixRow(const float *tmpRow, //!< interpolated pixels
+               int x1, //!< the row to be computed (PIXEL coordinates)
+               int x2,
+               int y,
+               const OFX::ImageView & srcImg, //!< the background image (the output is srcImg where maskImg=0, else it is tmpRow)
+               bool domask, //!< apply the mask?
+               const OFX::ImageView & maskImg, //!< the mask image (ignored if masked=false or domask=false)
+               float mix, //!< mix factor between the output and srcImg
+               bool maskInvert, //<! invert mask behavior
+               PIX *dstPix) //!< destination pixel at x1,y
+{
+    const bool useMask = masked && domask;
+
+    if ( !useMask && (mix == 1.) ) {
+        // no mask, no mix
+        ofxsPixRow<PIX, nComponents, maxValue>(tmpRow, x2 - x1, dstPix);
+
+        return;
+    }
+
+    // the background pixels exist in [sx1, sx2), the mask pixels in [mx1, mx2)
+    int sx1, sx2, mx1, mx2;
+    const PIX *srcRow = ofxsImageRow<PIX>(srcImg, x1, x2, y, &sx1, &sx2);
+    const int srcStride = srcRow ? srcImg.getPixelComponentCount() : 0;
+    const PIX *maskRow = useMask ? ofxsImageRow<PIX>(maskImg, x1, x2, y, &mx1, &mx2) : NULL;
+    const int maskStride = maskRow ? maskImg.getPixelComponentCount() : 0;
+    // the mask scale outside of the mask
+    const float outsideAlpha = useMask ? (maskInvert ? 1.f : 0.f) * mix : mix;
+    float alpha[kOfxsMaskMixRowPixels];
+
+    // [x1, sx1) and [sx2, x2) have no background, [sx1, sx2) has one
+    for (int seg = 0; seg < 3; ++seg) {
+        const int segx1 = (seg == 0) ? x1 : (seg == 1) ? sx1 : sx2;
+        const int segx2 = (seg == 0) ? sx1 : (seg == 1) ? sx2 : x2;
+        for (int x = segx1; x < segx2; x += kOfxsMaskMixRowPixels) {
+            const int n = std::min(segx2 - x, kOfxsMaskMixRowPixels);
+            for (int i = 0; i < n; ++i) {
+                const int mx = x + i;
+                if ( maskRow && (mx1 <= mx) && (mx < mx2) ) {
+                    float maskScale = maskRow[(mx - mx1) * maskStride] / float(maxValue);
+                    if (maskInvert) {
+                        maskScale = 1.f - maskScale;
+                    }
+                    alpha[i] = maskScale * mix;
+                } else {
+                    alpha[i] = outsideAlpha;
+                }
+            }
+            ofxsMixRow<PIX, nComponents, maxValue>(tmpRow + (x - x1) * nComponents, alpha,
+                                                   (seg == 1) ? srcRow + (x - sx1) * srcStride : NULL, srcStride,
+                                                   n, dstPix + (x - x1) * nComponents);
+        }
+    }
+} // ofxsMaskMixRow
 } // OFX
 
 #endif // ifndef Misc_ofxsMaskMix_h
@@ -0,0 +1,378 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX mask occupancy index
+ */
+
+#ifndef openfx_supportext_ofxsMaskOccupancy_h
+#define openfx_supportext_ofxsMaskOccupancy_h
+
+#include <cmath>
+#include <cfloat>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsMaskMix.h"
+#include "ofxsMacros.h"
+
+/** @file This file contains a summary of a mask image, used to skip the regions where it is 0 or 1.
+
+   Garbage mattes and roto masks are mostly 0 or 1, but a masked processor still computes and
+   mixes every pixel. A MaskOccupancy is built once per render (typically from preProcess()):
+   the render window is cut into tiles of kOfxsMaskOccupancyTileSize x kOfxsMaskOccupancyTileSize
+   pixels, and the minimum and maximum mask scale (after inversion) of each tile are stored.
+
+   From these and the mix, each tile is either:
+   - eTileStateZero: the mask scale times the mix is 0 on the whole tile, the output is the
+     background, and the processing can be skipped (see ofxsBackgroundRow()),
+   - eTileStateOne: it is 1 on the whole tile, the mixing can be skipped (see ofxsPixRow()),
+   - eTileStatePartial: ofxsMaskMixRow() must be used.
+
+   The result is exactly the same as calling ofxsMaskMixRow() everywhere. A tile containing a NaN
+   mask value has the range [-inf, +inf]. When the mask is not used, there are no tiles and the
+   state is the same everywhere.
+ */
+
+// size of a tile, in pixels
+#define kOfxsMaskOccupancyTileSize 64
+// below this number of mask pixels, the index is built by a single thread
+#define kOfxsMaskOccupancyMinThreadPixels 65536
+
+namespace OFX {
+class MaskOccupancy
+{
+public:
+    enum TileStateEnum
+    {
+        eTileStatePartial = 0, // the mask and mix have to be applied
+        eTileStateZero, // the output is the background
+        eTileStateOne // the output is the processed image
+    };
+
+    MaskOccupancy()
+        : _window()
+        , _nx(0)
+        , _ny(0)
+        , _uniformState(eTileStatePartial)
+        , _min()
+        , _max()
+        , _state()
+    {
+        _window.x1 = _window.y1 = _window.x2 = _window.y2 = 0;
+        std::fill(_count, _count + 3, 0);
+    }
+
+    /// summarize the mask over window, with the same arguments as ofxsMaskMixRow()
+    template <class PIX, int maxValue>
+    void build(const OfxRectI & window,
+               bool domask, //!< apply the mask? (false if the processor is not masked)
+               const OFX::Image *maskImg, //!< the mask image (ignored if domask=false)
+               float mix, //!< mix factor between the output and the background
+               bool maskInvert) //<! invert mask behavior
+    {
+        clear();
+        if ( !domask || !maskImg || (window.x2 <= window.x1) || (window.y2 <= window.y1) ) {
+            // the mask scale is the same everywhere
+            const float scale = !domask ? 1.f : (maskInvert ? 1.f : 0.f);
+            _uniformState = getState(scale, scale, mix);
+
+            return;
+        }
+        _window = window;
+        _nx = (window.x2 - window.x1 + kOfxsMaskOccupancyTileSize - 1) / kOfxsMaskOccupancyTileSize;
+        _ny = (window.y2 - window.y1 + kOfxsMaskOccupancyTileSize - 1) / kOfxsMaskOccupancyTileSize;
+        _min.assign( _nx * _ny, std::numeric_limits<float>::infinity() );
+        _max.assign( _nx * _ny, -std::numeric_limits<float>::infinity() );
+        _state.assign(_nx * _ny, (unsigned char)eTileStatePartial);
+
+        Builder<PIX, maxValue> builder(*this, maskImg, maskInvert);
+        builder.process();
+
+        for (int i = 0; i < _nx * _ny; ++i) {
+            const TileStateEnum state = getState(_min[i], _max[i], mix);
+            _state[i] = (unsigned char)state;
+            ++_count[state];
+        }
+    }
+
+    /// forget the summary: the state is eTileStatePartial everywhere
+    void clear()
+    {
+        _window.x1 = _window.y1 = _window.x2 = _window.y2 = 0;
+        _nx = _ny = 0;
+        _uniformState = eTileStatePartial;
+        _min.clear();
+        _max.clear();
+        _state.clear();
+        std::fill(_count, _count + 3, 0);
+    }
+
+    /// the state of the pixel x,y and the end of the run of pixels with the same state, on line y
+    /// and before x2. x < x2 and x < *runx2 <= x2.
+    TileStateEnum getRun(int x,
+                         int x2,
+                         int y,
+                         int *runx2) const
+    {
+        *runx2 = x2;
+        if ( _state.empty() ) {
+            return _uniformState;
+        }
+        if ( (y < _window.y1) || (_window.y2 <= y) || (x < _window.x1) || (_window.x2 <= x) ) {
+            return eTileStatePartial;
+        }
+        const unsigned char *row = &_state[( (y - _window.y1) / kOfxsMaskOccupancyTileSize ) * _nx];
+        int tx = (x - _window.x1) / kOfxsMaskOccupancyTileSize;
+        const unsigned char state = row[tx];
+        while ( (tx + 1 < _nx) && (row[tx + 1] == state) ) {
+            ++tx;
+        }
+        *runx2 = std::min( x2, std::min(_window.x2, _window.x1 + (tx + 1) * kOfxsMaskOccupancyTileSize) );
+
+        return (TileStateEnum)state;
+    }
+
+    /// the range of the mask scale over tile tx,ty. Returns false if there is no such tile.
+    bool getTileRange(int tx,
+                      int ty,
+                      float *min,
+                      float *max) const
+    {
+        if ( (tx < 0) || (_nx <= tx) || (ty < 0) || (_ny <= ty) ) {
+            return false;
+        }
+        *min = _min[ty * _nx + tx];
+        *max = _max[ty * _nx + tx];
+
+        return true;
+    }
+
+    /// the number of tiles (0 if the mask is not used)
+    int getTileCount() const
+    {
+        return _nx * _ny;
+    }
+
+    /// the number of tiles in a given state
+    int getTileCount(TileStateEnum state) const
+    {
+        return _count[state];
+    }
+
+    /// the fraction of the tiles where the processing or the mixing is skipped
+    double getSkippedFraction() const
+    {
+        const int n = getTileCount();
+
+        return n ? (_count[eTileStateZero] + _count[eTileStateOne]) / (double)n : 0.;
+    }
+
+private:
+    // the state of a tile where the mask scale is within [min, max].
+    // As in ofxsMixRow(), alpha is the mask scale times the mix.
+    static TileStateEnum getState(float min,
+                                  float max,
+                                  float mix)
+    {
+        const bool mixFinite = std::abs(mix) <= FLT_MAX;
+
+        if ( mixFinite && ( ( (min == 0.f) && (max == 0.f) ) ||
+                            ( (mix == 0.f) && (-FLT_MAX <= min) && (max <= FLT_MAX) ) ) ) {
+            return eTileStateZero;
+        }
+        if ( (mix == 1.f) && (min == 1.f) && (max == 1.f) ) {
+            return eTileStateOne;
+        }
+
+        return eTileStatePartial;
+    }
+
+    // extend the range of the tiles of row ty which intersect [x1, x2) by a constant value
+    void addConstant(int ty,
+                     int x1,
+                     int x2,
+                     float v)
+    {
+        if (x2 <= x1) {
+            return;
+        }
+        const int tx1 = (x1 - _window.x1) / kOfxsMaskOccupancyTileSize;
+        const int tx2 = (x2 - 1 - _window.x1) / kOfxsMaskOccupancyTileSize;
+        for (int tx = tx1; tx <= tx2; ++tx) {
+            float & min = _min[ty * _nx + tx];
+            float & max = _max[ty * _nx + tx];
+            min = std::min(min, v);
+            max = std::max(max, v);
+        }
+    }
+
+    // compute the range of the tiles of row ty
+    template <class PIX, int maxValue>
+    void summarizeTileRow(int ty,
+                          const OFX::Image *maskImg,
+                          bool maskInvert)
+    {
+        // the mask scale outside of the mask
+        const float outside = maskInvert ? 1.f : 0.f;
+        const int y1 = _window.y1 + ty * kOfxsMaskOccupancyTileSize;
+        const int y2 = std::min(_window.y2, y1 + kOfxsMaskOccupancyTileSize);
+        // the mask scale is monotonic in the mask value: the range of the values is enough
+        std::vector<PIX> lo(_nx), hi(_nx);
+        std::vector<char> seen(_nx, 0), nan(_nx, 0);
+
+        for (int y = y1; y < y2; ++y) {
+            int mx1, mx2;
+            const PIX *maskRow = ofxsImageRow<PIX>(maskImg, _window.x1, _window.x2, y, &mx1, &mx2);
+            if (!maskRow) {
+                addConstant(ty, _window.x1, _window.x2, outside);
+                continue;
+            }
+            const int maskStride = maskImg->getPixelComponentCount();
+            addConstant(ty, _window.x1, mx1, outside);
+            addConstant(ty, mx2, _window.x2, outside);
+            for (int x = mx1; x < mx2; ) {
+                const int tx = (x - _window.x1) / kOfxsMaskOccupancyTileSize;
+                const int tilex2 = std::min(mx2, _window.x1 + (tx + 1) * kOfxsMaskOccupancyTileSize);
+                if (!seen[tx]) {
+                    lo[tx] = hi[tx] = *maskRow;
+                    seen[tx] = 1;
+                }
+                PIX l = lo[tx];
+                PIX h = hi[tx];
+                bool n = false;
+                for (; x < tilex2; ++x, maskRow += maskStride) {
+                    const PIX v = *maskRow;
+                    l = std::min(l, v);
+                    h = std::max(h, v);
+                    n |= (v != v);
+                }
+                lo[tx] = l;
+                hi[tx] = h;
+                nan[tx] |= n;
+            }
+        }
+        for (int tx = 0; tx < _nx; ++tx) {
+            float & min = _min[ty * _nx + tx];
+            float & max = _max[ty * _nx + tx];
+            if (nan[tx]) {
+                min = -std::numeric_limits<float>::infinity();
+                max = std::numeric_limits<float>::infinity();
+            } else if (seen[tx]) {
+                // the same expression as in ofxsMaskMixRow()
+                float a = lo[tx] / float(maxValue);
+                float b = hi[tx] / float(maxValue);
+                if (maskInvert) {
+                    a = 1.f - a;
+                    b = 1.f - b;
+                }
+                min = std::min( min, std::min(a, b) );
+                max = std::max( max, std::max(a, b) );
+            }
+        }
+    } // summarizeTileRow
+
+    // each thread summarizes a band of tile rows
+    template <class PIX, int maxValue>
+    class Builder
+        : public OFX::MultiThread::Processor
+    {
+    public:
+        Builder(MaskOccupancy & occupancy,
+                const OFX::Image *maskImg,
+                bool maskInvert)
+            : _occupancy(occupancy)
+            , _maskImg(maskImg)
+            , _maskInvert(maskInvert)
+        {
+        }
+
+        void process()
+        {
+            const OfxRectI & window = _occupancy._window;
+            const double pixels = (double)(window.x2 - window.x1) * (window.y2 - window.y1);
+            unsigned int nCPUs = (unsigned int)std::min( pixels / kOfxsMaskOccupancyMinThreadPixels, (double)_occupancy._ny );
+
+            nCPUs = std::max( 1u, std::min( nCPUs, OFX::MultiThread::getNumCPUs() ) );
+            if (nCPUs == 1) {
+                multiThreadFunction(0, 1);
+            } else {
+                multiThread(nCPUs);
+            }
+        }
+
+    private:
+        virtual void multiThreadFunction(unsigned int threadId,
+                                         unsigned int nThreads) OVERRIDE FINAL
+        {
+            int ty1, ty2;
+
+            OFX::MultiThread::getThreadRange(threadId, nThreads, 0, _occupancy._ny, &ty1, &ty2);
+            for (int ty = ty1; ty < ty2; ++ty) {
+                _occupancy.summarizeTileRow<PIX, maxValue>(ty, _maskImg, _maskInvert);
+            }
+        }
+
+        MaskOccupancy & _occupancy;
+        const OFX::Image *_maskImg;
+        bool _maskInvert;
+    };
+
+    OfxRectI _window; // the window covered by the tiles
+    int _nx, _ny; // number of tiles
+    TileStateEnum _uniformState; // the state everywhere, if there are no tiles
+    std::vector<float> _min, _max; // range of the mask scale over each tile
+    std::vector<unsigned char> _state; // TileStateEnum of each tile
+    int _count[3]; // number of tiles in each state
+};
+
+// ofxsMaskMixRow() on a run of pixels which have the same state in a MaskOccupancy.
+// tmpRow is not read if the state is eTileStateZero.
+template <class PIX, int nComponents, int maxValue, bool masked>
+void
+ofxsMaskMixRun(MaskOccupancy::TileStateEnum state,
+               const float *tmpRow, //!< interpolated pixels
+               int x1, //!< the run to be computed (PIXEL coordinates)
+               int x2,
+               int y,
+               const OFX::ImageView & srcImg, //!< the background image (the output is srcImg where maskImg=0, else it is tmpRow)
+               bool domask, //!< apply the mask?
+               const OFX::ImageView & maskImg, //!< the mask image (ignored if masked=false or domask=false)
+               float mix, //!< mix factor between the output and srcImg
+               bool maskInvert, //<! invert mask behavior
+               PIX *dstPix) //!< destination pixel at x1,y
+{
+    switch (state) {
+    case MaskOccupancy::eTileStateZero:
+        ofxsBackgroundRow<PIX, nComponents, maxValue>(x1, x2, y, srcImg, dstPix);
+        break;
+    case MaskOccupancy::eTileStateOne:
+        ofxsPixRow<PIX, nComponents, maxValue>(tmpRow, x2 - x1, dstPix);
+        break;
+    case MaskOccupancy::eTileStatePartial:
+    default:
+        ofxsMaskMixRow<PIX, nComponents, maxValue, masked>(tmpRow, x1, x2, y, srcImg, domask, maskImg, mix, maskInvert, dstPix);
+        break;
+    }
+}
+} // namespace OFX
+
+#endif // ifndef openfx_supportext_ofxsMaskOccupancy_h
@@ -0,0 +1,327 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX merge stack
+ */
+
+#ifndef openfx_supportext_ofxsMergeStack_h
+#define openfx_supportext_ofxsMergeStack_h
+
+#include <vector>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsPixelProcessor.h"
+#include "ofxsMaskMix.h"
+#include "ofxsMerging.h"
+#include "ofxsMacros.h"
+
+/** @file This file contains a processor which merges a stack of layers in a single pass.
+
+   Merging K layers with a chain of binary merges takes K-1 passes over the full frame and K-2
+   intermediate images. A MergeStackProcessor reads each layer once instead: the render window is
+   processed in spans of kOfxsMergeStackSpanPixels pixels, and the result of the stack on a span is
+   kept in a float buffer, which stays in L1 or L2, while the layers are merged onto it from the first (bottom)
+   to the last (top). Only the final result is written to the destination.
+
+   The result starts black and transparent, and each layer does what a Merge with the layer as A and
+   the result so far as B does:
+       result = m * merge(layer, result) + (1 - m) * result,  with m = mix * maskScale
+   where merge is the layer operation as computed by mergeRow(), in float and normalized in [0,1],
+   and maskScale is the mask value (after inversion) if the layer has a mask, or 1. The first layer
+   is usually a eMergeCopy of the background.
+
+   Layers are black outside of their bounds (and transparent, if they have an alpha component).
+   With Alpha and RGBA images, these pixels are skipped when the operation gives B from a black and
+   transparent A (see isIdentityForBOnly()), and so are the spans where m is 0 and the layers with a
+   mix of 0.
+ */
+
+// the number of pixels merged at once (16KB per float RGBA row span)
+#ifndef kOfxsMergeStackSpanPixels
+#define kOfxsMergeStackSpanPixels 1024
+#endif
+
+namespace OFX {
+namespace MergeImages2D {
+struct MergeLayer
+{
+    OFX::ImageView img; // the A input of the operation, empty if there is none (black and transparent)
+    MergingFunctionEnum operation;
+    float mix;
+    OFX::ImageView mask; // empty if the layer is not masked. 0 outside of its bounds (1 if inverted)
+    bool maskInvert;
+
+    MergeLayer()
+        : img()
+        , operation(eMergeOver)
+        , mix(1.f)
+        , mask()
+        , maskInvert(false)
+    {
+    }
+
+    MergeLayer(const OFX::ImageView & image,
+               MergingFunctionEnum op,
+               float layerMix = 1.f,
+               const OFX::ImageView & maskImage = OFX::ImageView(),
+               bool invert = false)
+        : img(image)
+        , operation(op)
+        , mix(layerMix)
+        , mask(maskImage)
+        , maskInvert(invert)
+    {
+    }
+};
+
+// a layer row normalized in [0,1]. Float rows are used as they are.
+template <class PIX, int maxValue>
+struct MergeStackRow
+{
+    static const float * normalize(const PIX *pix,
+                                   int size, //!< number of components
+                                   float *buf)
+    {
+        for (int i = 0; i < size; ++i) {
+            buf[i] = pix[i] * (1.f / maxValue);
+        }
+
+        return buf;
+    }
+};
+
+template <>
+struct MergeStackRow<float, 1>
+{
+    static const float * normalize(const float *pix,
+                                   int /*size*/,
+                                   float * /*buf*/)
+    {
+        return pix;
+    }
+};
+
+/** @brief Base class of the merge stack processor */
+class MergeStackProcessorBase
+    : public OFX::PixelProcessor
+{
+protected:
+    std::vector<MergeLayer> _layers;
+    bool _alphaMasking;
+
+public:
+    MergeStackProcessorBase(OFX::ImageEffect &instance)
+        : OFX::PixelProcessor(instance)
+        , _layers()
+        , _alphaMasking(false)
+    {
+    }
+
+    /** @brief the layers, from bottom to top. Their images and masks must have the depth of the destination,
+        and the images its number of components */
+    void setLayers(const std::vector<MergeLayer> & layers)
+    {
+        _layers = layers;
+    }
+
+    /** @brief add a layer on top of the stack */
+    void addLayer(const MergeLayer & layer)
+    {
+        _layers.push_back(layer);
+    }
+
+    /** @brief set the alpha to a+b-ab for the operations that support it (see isMaskable()) */
+    void setAlphaMasking(bool v)
+    {
+        _alphaMasking = v;
+    }
+
+    // a merge per layer
+    double getPixelCostHint() const
+    {
+        return 2. * std::max(_layers.size(), (std::size_t)1);
+    }
+};
+
+/** @brief merge a stack of layers into the destination */
+template <class PIX, int nComponents, int maxValue>
+class MergeStackProcessor
+    : public MergeStackProcessorBase
+{
+public:
+    MergeStackProcessor(OFX::ImageEffect &instance)
+        : MergeStackProcessorBase(instance)
+    {
+    }
+
+    virtual void preProcess() OVERRIDE
+    {
+        for (std::size_t i = 0; i < _layers.size(); ++i) {
+            const MergeLayer & layer = _layers[i];
+            if ( !layer.img.isEmpty() &&
+                 ( ( layer.img.getPixelDepth() != _dstBitDepth) || ( layer.img.getPixelComponentCount() != nComponents) ) ) {
+                OFX::throwSuiteStatusException(kOfxStatErrFormat);
+            }
+            if ( !layer.mask.isEmpty() && (layer.mask.getPixelDepth() != _dstBitDepth) ) {
+                OFX::throwSuiteStatusException(kOfxStatErrFormat);
+            }
+        }
+    }
+
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(_dstBounds.x1 <= procWindow.x1 && procWindow.x2 <= _dstBounds.x2 && _dstBounds.y1 <= procWindow.y1 && procWindow.y2 <= _dstBounds.y2);
+        const int spanSize = kOfxsMergeStackSpanPixels * nComponents;
+        // the result of the stack, a normalized layer, the result of a merge, and the mix of each pixel
+        float *result = getScratchArena().allocateArray<float>(3 * spanSize + kOfxsMergeStackSpanPixels);
+        float *layerBuf = result + spanSize;
+        float *merged = layerBuf + spanSize;
+        float *alpha = merged + spanSize;
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) getDstPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            if (!dstPix) {
+                // coverity[dead_error_line]
+                continue;
+            }
+
+            for (int x1 = procWindow.x1; x1 < procWindow.x2; x1 += kOfxsMergeStackSpanPixels) {
+                const int x2 = std::min(x1 + kOfxsMergeStackSpanPixels, procWindow.x2);
+                std::fill(result, result + (x2 - x1) * nComponents, 0.f);
+                for (std::size_t i = 0; i < _layers.size(); ++i) {
+                    mergeLayer(_layers[i], x1, x2, y, result, layerBuf, merged, alpha);
+                }
+                // back to [0,maxValue], clamped and rounded
+                if (maxValue != 1) {
+                    for (int i = 0; i < (x2 - x1) * nComponents; ++i) {
+                        result[i] *= maxValue;
+                    }
+                }
+                ofxsPixRow<PIX, nComponents, maxValue>(result, x2 - x1, dstPix + (x1 - procWindow.x1) * nComponents);
+            }
+        }
+    }
+
+private:
+    // merge the pixels [x1, x2) of line y of a layer onto result
+    void mergeLayer(const MergeLayer & layer,
+                    int x1,
+                    int x2,
+                    int y,
+                    float *result,
+                    float *layerBuf,
+                    float *merged,
+                    float *alpha)
+    {
+        if (layer.mix == 0.) {
+            return;
+        }
+        const int n = x2 - x1;
+        // the mix of each pixel: the span is skipped if it is 0 everywhere, and merged in place if it is 1 everywhere
+        bool allZero = true;
+        bool allOne = true;
+        if ( layer.mask.isEmpty() ) {
+            allZero = false;
+            allOne = (layer.mix == 1.);
+            std::fill(alpha, alpha + n, layer.mix);
+        } else {
+            int mx1, mx2;
+            const PIX *maskRow = ofxsImageRow<PIX>(layer.mask, x1, x2, y, &mx1, &mx2);
+            const int maskStride = maskRow ? layer.mask.getPixelComponentCount() : 0;
+            const float outsideAlpha = (layer.maskInvert ? 1.f : 0.f) * layer.mix;
+            for (int i = 0; i < n; ++i) {
+                const int x = x1 + i;
+                if ( maskRow && (mx1 <= x) && (x < mx2) ) {
+                    float maskScale = maskRow[(x - mx1) * maskStride] / float(maxValue);
+                    if (layer.maskInvert) {
+                        maskScale = 1.f - maskScale;
+                    }
+                    alpha[i] = maskScale * layer.mix;
+                } else {
+                    alpha[i] = outsideAlpha;
+                }
+                allZero = allZero && (alpha[i] == 0.);
+                allOne = allOne && (alpha[i] == 1.);
+            }
+        }
+        if (allZero) {
+            return;
+        }
+
+        // the layer exists in [lx1, lx2), and is black and transparent elsewhere
+        int lx1, lx2;
+        const PIX *layerRow = ofxsImageRow<PIX>(layer.img, x1, x2, y, &lx1, &lx2);
+        if (!layerRow) {
+            lx1 = lx2 = x2;
+        }
+#ifdef OFXS_MERGING_SSE2
+        // the layers are read in short interleaved bursts, which the hardware prefetcher does not follow:
+        // fetch the next span of this layer while the stack is merged
+        if (layerRow) {
+            const char *next = (const char *)(layerRow + (lx2 - lx1) * nComponents);
+            for (int b = 0; b < (int)(kOfxsMergeStackSpanPixels * nComponents * sizeof(PIX)); b += 64) {
+                _mm_prefetch(next + b, _MM_HINT_T0);
+            }
+        }
+#endif
+        // without an alpha component, a black layer is opaque (see mergeRow())
+        const bool skipOutside = ( (nComponents == 1) || (nComponents == 4) ) && isIdentityForBOnly(layer.operation);
+        const int bounds[4] = { x1, lx1, lx2, x2 };
+        for (int seg = 0; seg < 3; ++seg) {
+            const int sx1 = bounds[seg];
+            const int sx2 = bounds[seg + 1];
+            const bool inside = (seg == 1);
+            if ( (sx2 <= sx1) || (!inside && skipOutside) ) {
+                continue;
+            }
+            const int m = sx2 - sx1;
+            const float *A = inside ? MergeStackRow<PIX, maxValue>::normalize(layerRow, m * nComponents, layerBuf) : NULL;
+            float *B = result + (sx1 - x1) * nComponents;
+            if (allOne) {
+                mergeRowForOperation<float, nComponents, 1>(layer.operation, _alphaMasking, A, B, B, m);
+                continue;
+            }
+            mergeRowForOperation<float, nComponents, 1>(layer.operation, _alphaMasking, A, B, merged, m);
+            // mix with the result so far
+            const float *a = alpha + (sx1 - x1);
+            for (int i = 0; i < m; ++i) {
+                const float ai = a[i];
+                float *r = B + i * nComponents;
+                const float *v = merged + i * nComponents;
+                if (ai == 1.) {
+                    std::copy(v, v + nComponents, r);
+                } else if (ai != 0.) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        r[c] = v[c] * ai + (1.f - ai) * r[c];
+                    }
+                }
+            }
+        }
+    } // mergeLayer
+};
+} // MergeImages2D
+} // OFX
+
+#endif // ifndef openfx_supportext_ofxsMergeStack_h
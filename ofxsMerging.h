@@ -27,6 +27,11 @@
 #include <cfloat>
 #include <algorithm>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OFXS_MERGING_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "ofxsImageEffect.h"
 
 #ifndef M_PI
@@ -1605,6 +1610,642 @@ mergePixel(bool doAlphaMasking,
         } // switch
     }
 } // mergePixel
+
+#ifdef OFXS_MERGING_SSE2
+inline __m128
+mergeSelectSSE2(__m128 mask,
+                __m128 ifTrue,
+                __m128 ifFalse)
+{
+    return _mm_or_ps( _mm_and_ps(mask, ifTrue), _mm_andnot_ps(mask, ifFalse) );
+}
+
+/**
+ * @brief The separable operators on a float RGBA pixel.
+ * A and B are the pixels of images A and B, a and b their alphas in all four lanes.
+ * These follow the scalar functors above, branches included, but compute in single precision,
+ * so that the results may differ in the last bits.
+ **/
+template <MergingFunctionEnum f, int maxValue>
+__m128
+mergeSSE2(__m128 A,
+          __m128 B,
+          __m128 a,
+          __m128 b)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 two = _mm_set1_ps(2.f);
+    const __m128 max = _mm_set1_ps( (float)maxValue );
+    const __m128 invMax = _mm_set1_ps(1.f / maxValue);
+
+    switch (f) {
+    case eMergeATop:
+
+        return _mm_add_ps( _mm_mul_ps(_mm_mul_ps(A, b), invMax), _mm_mul_ps( B, _mm_sub_ps( one, _mm_mul_ps(a, invMax) ) ) );
+    case eMergeAverage:
+
+        return _mm_mul_ps( _mm_add_ps(A, B), _mm_set1_ps(0.5f) );
+    case eMergeColorBurn: {
+        const __m128 r = _mm_mul_ps( max, _mm_sub_ps( one, _mm_min_ps(_mm_div_ps(_mm_sub_ps(max, B), A), one) ) );
+
+        return mergeSelectSSE2(_mm_cmple_ps(A, zero), A, r);
+    }
+    case eMergeColorDodge: {
+        const __m128 r = _mm_mul_ps( max, _mm_min_ps(_mm_div_ps( B, _mm_sub_ps(max, A) ), one) );
+
+        return mergeSelectSSE2(_mm_cmpge_ps(A, max), A, r);
+    }
+    case eMergeConjointOver: {
+        const __m128 r = _mm_add_ps( A, _mm_mul_ps( B, _mm_sub_ps( one, _mm_div_ps(a, b) ) ) );
+
+        return mergeSelectSSE2( _mm_cmpgt_ps(a, b), A, mergeSelectSSE2(_mm_cmple_ps(b, zero), _mm_add_ps(A, B), r) );
+    }
+    case eMergeCopy:
+
+        return A;
+    case eMergeDifference:
+
+        return _mm_andnot_ps( _mm_set1_ps(-0.f), _mm_sub_ps(A, B) );
+    case eMergeDisjointOver: {
+        const __m128 r = mergeSelectSSE2( _mm_cmple_ps(b, zero),
+                                          _mm_add_ps( A, _mm_mul_ps( B, _mm_sub_ps( one, _mm_mul_ps(a, invMax) ) ) ),
+                                          _mm_add_ps( A, _mm_div_ps(_mm_mul_ps( B, _mm_sub_ps(max, a) ), b) ) );
+
+        return mergeSelectSSE2( _mm_cmpge_ps(a, max), A, mergeSelectSSE2(_mm_cmplt_ps(_mm_add_ps(a, b), max), _mm_add_ps(A, B), r) );
+    }
+    case eMergeDivide:
+
+        return _mm_andnot_ps( _mm_cmple_ps(B, zero), _mm_div_ps(A, B) );
+    case eMergeExclusion:
+
+        return _mm_sub_ps( _mm_add_ps(A, B), _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(two, A), B), invMax) );
+    case eMergeFreeze: {
+        const __m128 s = _mm_sqrt_ps( _mm_max_ps(_mm_sub_ps( one, _mm_mul_ps(A, invMax) ), zero) );
+        const __m128 r = _mm_max_ps(_mm_mul_ps( max, _mm_sub_ps( one, _mm_div_ps( s, _mm_mul_ps(B, invMax) ) ) ), zero);
+
+        return _mm_andnot_ps(_mm_cmple_ps(B, zero), r);
+    }
+    case eMergeFrom:
+
+        return _mm_sub_ps(B, A);
+    case eMergeGeometric: {
+        const __m128 sum = _mm_add_ps(A, B);
+
+        return _mm_andnot_ps( _mm_cmpeq_ps(sum, zero), _mm_div_ps(_mm_mul_ps(_mm_mul_ps(two, A), B), sum) );
+    }
+    case eMergeGrainExtract:
+
+        return _mm_add_ps( _mm_sub_ps(B, A), _mm_set1_ps( (float)maxValue / 2 ) );
+    case eMergeGrainMerge:
+
+        return _mm_sub_ps( _mm_add_ps(B, A), _mm_set1_ps( (float)maxValue / 2 ) );
+    case eMergeHardLight: {
+        const __m128 r = _mm_mul_ps( max, _mm_sub_ps( one, _mm_mul_ps( _mm_mul_ps( two, _mm_sub_ps( one, _mm_mul_ps(A, invMax) ) ), _mm_sub_ps( one, _mm_mul_ps(B, invMax) ) ) ) );
+
+        return mergeSelectSSE2(_mm_cmplt_ps( A, _mm_set1_ps(maxValue / 2.f) ), _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(two, A), B), invMax), r);
+    }
+    case eMergeHypot:
+
+        return _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps(A, A), _mm_mul_ps(B, B) ) );
+    case eMergeIn:
+
+        return _mm_mul_ps(_mm_mul_ps(A, b), invMax);
+    case eMergeMask:
+
+        return _mm_mul_ps(_mm_mul_ps(B, a), invMax);
+    case eMergeMatte:
+
+        return _mm_add_ps( _mm_mul_ps(_mm_mul_ps(A, a), invMax), _mm_mul_ps( B, _mm_sub_ps( one, _mm_mul_ps(a, invMax) ) ) );
+    case eMergeMax:
+
+        return _mm_max_ps(B, A); // std::max(A, B)
+    case eMergeMin:
+
+        return _mm_min_ps(B, A); // std::min(A, B)
+    case eMergeMinus:
+
+        return _mm_sub_ps(A, B);
+    case eMergeMultiply:
+
+        return _mm_mul_ps(_mm_mul_ps(A, B), invMax);
+    case eMergeOut:
+
+        return _mm_mul_ps( A, _mm_sub_ps( one, _mm_mul_ps(b, invMax) ) );
+    case eMergeOver:
+
+        return _mm_add_ps( A, _mm_mul_ps( B, _mm_sub_ps( one, _mm_mul_ps(a, invMax) ) ) );
+    case eMergeOverlay: {
+        const __m128 An = _mm_mul_ps(A, invMax);
+        const __m128 Bn = _mm_mul_ps(B, invMax);
+        const __m128 r = _mm_mul_ps( max, _mm_sub_ps( one, _mm_mul_ps( _mm_mul_ps( two, _mm_sub_ps(one, Bn) ), _mm_sub_ps(one, An) ) ) );
+
+        return mergeSelectSSE2(_mm_cmple_ps(_mm_mul_ps(two, Bn), one), _mm_mul_ps( max, _mm_mul_ps(_mm_mul_ps(two, An), Bn) ), r);
+    }
+    case eMergePinLight: {
+        const __m128 max2 = _mm_set1_ps( (float)(maxValue / 2.) );
+
+        return mergeSelectSSE2( _mm_cmpge_ps(A, max2), _mm_max_ps(_mm_mul_ps(_mm_sub_ps(A, max2), two), B), _mm_min_ps(_mm_mul_ps(A, two), B) );
+    }
+    case eMergePlus:
+
+        return _mm_add_ps(A, B);
+    case eMergeReflect:
+
+        return mergeSelectSSE2( _mm_cmpge_ps(B, max), max, _mm_min_ps(_mm_div_ps( _mm_mul_ps(A, A), _mm_sub_ps(max, B) ), max) );
+    case eMergeScreen: {
+        const __m128 lo = _mm_or_ps( _mm_cmple_ps(A, max), _mm_cmple_ps(B, max) );
+
+        return mergeSelectSSE2( lo, _mm_sub_ps( _mm_add_ps(A, B), _mm_mul_ps(A, B) ), _mm_max_ps(B, A) );
+    }
+    case eMergeSoftLight: {
+        const __m128 An = _mm_mul_ps(A, invMax);
+        const __m128 Bn = _mm_mul_ps(B, invMax);
+        const __m128 twoAn = _mm_mul_ps(two, An);
+        const __m128 fourBn = _mm_mul_ps(_mm_set1_ps(4.f), Bn);
+        const __m128 r1 = _mm_sub_ps( Bn, _mm_mul_ps( _mm_mul_ps(_mm_sub_ps(one, twoAn), Bn), _mm_sub_ps(one, Bn) ) );
+        const __m128 r2 = _mm_add_ps( Bn, _mm_mul_ps( _mm_sub_ps(twoAn, one),
+                                                      _mm_add_ps( _mm_mul_ps( _mm_mul_ps( fourBn, _mm_add_ps(fourBn, one) ), _mm_sub_ps(Bn, one) ),
+                                                                  _mm_mul_ps(_mm_set1_ps(7.f), Bn) ) ) );
+        const __m128 r3 = _mm_add_ps( Bn, _mm_mul_ps( _mm_sub_ps(twoAn, one), _mm_sub_ps(_mm_sqrt_ps(Bn), Bn) ) );
+
+        return _mm_mul_ps( max, mergeSelectSSE2( _mm_cmple_ps(twoAn, one), r1, mergeSelectSSE2(_mm_cmple_ps(fourBn, one), r2, r3) ) );
+    }
+    case eMergeStencil:
+
+        return _mm_mul_ps( B, _mm_sub_ps( one, _mm_mul_ps(a, invMax) ) );
+    case eMergeUnder:
+
+        return _mm_add_ps(_mm_mul_ps( A, _mm_sub_ps( one, _mm_mul_ps(b, invMax) ) ), B);
+    case eMergeXOR:
+
+        return _mm_add_ps( _mm_mul_ps( A, _mm_sub_ps( one, _mm_mul_ps(b, invMax) ) ), _mm_mul_ps( B, _mm_sub_ps( one, _mm_mul_ps(a, invMax) ) ) );
+    default:
+        // the HSL modes are not separable
+        assert(false);
+
+        return zero;
+    } // switch
+} // mergeSSE2
+
+/*
+ * The non-separable (HSL) operators on four float pixels at once, one vector per channel.
+ * These follow pixman's clip_color, set_lum, set_sat and blend_hsl_* above, without branches.
+ */
+struct RGBSSE2
+{
+    __m128 r;
+    __m128 g;
+    __m128 b;
+};
+
+inline __m128
+lumSSE2(const RGBSSE2 &c)
+{
+    return _mm_add_ps( _mm_add_ps( _mm_mul_ps( c.r, _mm_set1_ps(0.3f) ), _mm_mul_ps( c.g, _mm_set1_ps(0.59f) ) ), _mm_mul_ps( c.b, _mm_set1_ps(0.11f) ) );
+}
+
+inline __m128
+channelMinSSE2(const RGBSSE2 &c)
+{
+    return _mm_min_ps(_mm_min_ps(c.r, c.g), c.b);
+}
+
+inline __m128
+channelMaxSSE2(const RGBSSE2 &c)
+{
+    return _mm_max_ps(_mm_max_ps(c.r, c.g), c.b);
+}
+
+inline __m128
+satSSE2(const RGBSSE2 &c)
+{
+    return _mm_sub_ps( channelMaxSSE2(c), channelMinSSE2(c) );
+}
+
+// the lanes where |v| >= FLT_MIN, i.e. where !PIXMAN_IS_ZERO(v) in single precision:
+// dividing by a denormal would overflow to inf
+inline __m128
+isNonZeroSSE2(__m128 v)
+{
+    return _mm_cmpge_ps( _mm_andnot_ps(_mm_set1_ps(-0.f), v), _mm_set1_ps(FLT_MIN) );
+}
+
+inline void
+clipColorSSE2(RGBSSE2 *c,
+              __m128 a)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 l = lumSSE2(*c);
+    const __m128 n = channelMinSSE2(*c);
+    const __m128 x = channelMaxSSE2(*c);
+    // n < 0: scale the channels around l, so that the min is 0
+    {
+        const __m128 t = _mm_sub_ps(l, n);
+        const __m128 f = _mm_div_ps(l, t);
+        const __m128 clip = _mm_cmplt_ps(n, zero);
+        const __m128 flat = _mm_andnot_ps(isNonZeroSSE2(t), clip);
+        c->r = _mm_andnot_ps( flat, mergeSelectSSE2( clip, _mm_add_ps( l, _mm_mul_ps(_mm_sub_ps(c->r, l), f) ), c->r ) );
+        c->g = _mm_andnot_ps( flat, mergeSelectSSE2( clip, _mm_add_ps( l, _mm_mul_ps(_mm_sub_ps(c->g, l), f) ), c->g ) );
+        c->b = _mm_andnot_ps( flat, mergeSelectSSE2( clip, _mm_add_ps( l, _mm_mul_ps(_mm_sub_ps(c->b, l), f) ), c->b ) );
+    }
+    // x > a: scale the channels around l, so that the max is a
+    {
+        const __m128 t = _mm_sub_ps(x, l);
+        const __m128 f = _mm_div_ps(_mm_sub_ps(a, l), t);
+        const __m128 clip = _mm_cmpgt_ps(x, a);
+        const __m128 flat = _mm_andnot_ps(isNonZeroSSE2(t), clip);
+        c->r = mergeSelectSSE2( clip, mergeSelectSSE2( flat, a, _mm_add_ps( l, _mm_mul_ps(_mm_sub_ps(c->r, l), f) ) ), c->r );
+        c->g = mergeSelectSSE2( clip, mergeSelectSSE2( flat, a, _mm_add_ps( l, _mm_mul_ps(_mm_sub_ps(c->g, l), f) ) ), c->g );
+        c->b = mergeSelectSSE2( clip, mergeSelectSSE2( flat, a, _mm_add_ps( l, _mm_mul_ps(_mm_sub_ps(c->b, l), f) ) ), c->b );
+    }
+}
+
+inline void
+setLumSSE2(RGBSSE2 *c,
+           __m128 sa,
+           __m128 l)
+{
+    const __m128 d = _mm_sub_ps( l, lumSSE2(*c) );
+
+    c->r = _mm_add_ps(c->r, d);
+    c->g = _mm_add_ps(c->g, d);
+    c->b = _mm_add_ps(c->b, d);
+    clipColorSSE2(c, sa);
+}
+
+// set_sat without sorting the channels: the max channel becomes sat, the min channel 0,
+// and the mid channel (mid - min) * sat / (max - min), which also gives the right values for ties.
+inline __m128
+setSatChannelSSE2(__m128 v,
+                  __m128 min,
+                  __m128 max,
+                  __m128 sat,
+                  __m128 satOverT,
+                  __m128 valid)
+{
+    return _mm_and_ps( valid, mergeSelectSSE2( _mm_cmpeq_ps(v, max), sat, _mm_mul_ps(_mm_sub_ps(v, min), satOverT) ) );
+}
+
+inline void
+setSatSSE2(RGBSSE2 *c,
+           __m128 sat)
+{
+    const __m128 min = channelMinSSE2(*c);
+    const __m128 max = channelMaxSSE2(*c);
+    const __m128 t = _mm_sub_ps(max, min);
+    const __m128 satOverT = _mm_div_ps(sat, t);
+    const __m128 valid = isNonZeroSSE2(t); // all channels are 0 if t is 0
+
+    c->r = setSatChannelSSE2(c->r, min, max, sat, satOverT, valid);
+    c->g = setSatChannelSSE2(c->g, min, max, sat, satOverT, valid);
+    c->b = setSatChannelSSE2(c->b, min, max, sat, satOverT, valid);
+}
+
+/**
+ * @brief The HSL operators on four float RGBA pixels, as mergePixel() computes them.
+ * A, a, B and b are the premultiplied colors and alphas of four pixels of images A and B,
+ * with one vector per channel. The result is written to dst and dstAlpha.
+ **/
+template <MergingFunctionEnum f, int maxValue>
+void
+mergeHSLSSE2(const RGBSSE2 &A,
+             __m128 a,
+             const RGBSSE2 &B,
+             __m128 b,
+             RGBSSE2 *dst,
+             __m128 *dstAlpha)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 max = _mm_set1_ps( (float)maxValue );
+    const __m128 invMax = _mm_set1_ps(1.f / maxValue);
+    // unpremultiplied colors, black where alpha is 0 or denormal (one division per alpha)
+    const __m128 invA = _mm_and_ps( isNonZeroSSE2(a), _mm_div_ps(one, a) );
+    const __m128 invB = _mm_and_ps( isNonZeroSSE2(b), _mm_div_ps(one, b) );
+    RGBSSE2 src, dest, res;
+
+    src.r = _mm_mul_ps(A.r, invA);
+    src.g = _mm_mul_ps(A.g, invA);
+    src.b = _mm_mul_ps(A.b, invA);
+    dest.r = _mm_mul_ps(B.r, invB);
+    dest.g = _mm_mul_ps(B.g, invB);
+    dest.b = _mm_mul_ps(B.b, invB);
+    const __m128 sa = _mm_mul_ps(a, invMax);
+    const __m128 da = _mm_mul_ps(b, invMax);
+    const __m128 sada = _mm_mul_ps(sa, da);
+
+    switch (f) {
+    case eMergeHue:
+        res.r = _mm_mul_ps(src.r, da);
+        res.g = _mm_mul_ps(src.g, da);
+        res.b = _mm_mul_ps(src.b, da);
+        setSatSSE2( &res, _mm_mul_ps(satSSE2(dest), sa) );
+        setLumSSE2( &res, sada, _mm_mul_ps(lumSSE2(dest), sa) );
+        break;
+    case eMergeSaturation:
+        res.r = _mm_mul_ps(dest.r, sa);
+        res.g = _mm_mul_ps(dest.g, sa);
+        res.b = _mm_mul_ps(dest.b, sa);
+        setSatSSE2( &res, _mm_mul_ps(satSSE2(src), da) );
+        setLumSSE2( &res, sada, _mm_mul_ps(lumSSE2(dest), sa) );
+        break;
+    case eMergeColor:
+        res.r = _mm_mul_ps(src.r, da);
+        res.g = _mm_mul_ps(src.g, da);
+        res.b = _mm_mul_ps(src.b, da);
+        setLumSSE2( &res, sada, _mm_mul_ps(lumSSE2(dest), sa) );
+        break;
+    case eMergeLuminosity:
+        res.r = _mm_mul_ps(dest.r, sa);
+        res.g = _mm_mul_ps(dest.g, sa);
+        res.b = _mm_mul_ps(dest.b, sa);
+        setLumSSE2( &res, sada, _mm_mul_ps(lumSSE2(src), da) );
+        break;
+    default:
+        res.r = res.g = res.b = zero;
+        assert(false);
+        break;
+    }
+    const __m128 oneMinusSa = _mm_sub_ps(one, sa);
+    const __m128 oneMinusDa = _mm_sub_ps(one, da);
+    dst->r = _mm_add_ps( _mm_add_ps( _mm_mul_ps(oneMinusSa, B.r), _mm_mul_ps(oneMinusDa, A.r) ), _mm_mul_ps(res.r, max) );
+    dst->g = _mm_add_ps( _mm_add_ps( _mm_mul_ps(oneMinusSa, B.g), _mm_mul_ps(oneMinusDa, A.g) ), _mm_mul_ps(res.g, max) );
+    dst->b = _mm_add_ps( _mm_add_ps( _mm_mul_ps(oneMinusSa, B.b), _mm_mul_ps(oneMinusDa, A.b) ), _mm_mul_ps(res.b, max) );
+    *dstAlpha = _mm_sub_ps( _mm_add_ps(a, b), _mm_mul_ps(_mm_mul_ps(a, b), invMax) );
+} // mergeHSLSSE2
+
+#endif // OFXS_MERGING_SSE2
+
+// Merge the pixels of rows with SIMD instructions, where available. Returns the number of pixels processed.
+template <MergingFunctionEnum f, typename PIX, int nComponents, int maxValue>
+struct MergeRowSIMD
+{
+    static int process(bool /*doAlphaMasking*/,
+                       const PIX * /*A*/,
+                       int /*aStep*/,
+                       const PIX * /*B*/,
+                       int /*bStep*/,
+                       PIX * /*dst*/,
+                       int /*count*/)
+    {
+        return 0;
+    }
+};
+
+#ifdef OFXS_MERGING_SSE2
+// float RGBA: one pixel per vector for the separable operators, four pixels per loop for the HSL operators
+template <MergingFunctionEnum f, int maxValue>
+struct MergeRowSIMD<f, float, 4, maxValue>
+{
+    static int process(bool doAlphaMasking,
+                       const float *A,
+                       int aStep,
+                       const float *B,
+                       int bStep,
+                       float *dst,
+                       int count)
+    {
+        if ( !isSeparable(f) ) {
+            return processRowHSL(A, aStep, B, bStep, dst, count);
+        }
+        if ( (f == eMergeMatte) || (doAlphaMasking && isMaskable(f)) ) {
+            processRow<true>(A, aStep, B, bStep, dst, count);
+        } else {
+            processRow<false>(A, aStep, B, bStep, dst, count);
+        }
+
+        return count;
+    }
+
+private:
+    template <bool doAlphaMasking>
+    static void processRow(const float *A,
+                           int aStep,
+                           const float *B,
+                           int bStep,
+                           float *dst,
+                           int count)
+    {
+        // the alpha lane, set to a+b-a*b by alpha masking
+        const __m128 alphaLane = _mm_castsi128_ps( _mm_set_epi32(-1, 0, 0, 0) );
+        const __m128 invMax = _mm_set1_ps(1.f / maxValue);
+
+        for (int i = 0; i < count; ++i, A += aStep, B += bStep, dst += 4) {
+            const __m128 vA = _mm_loadu_ps(A);
+            const __m128 vB = _mm_loadu_ps(B);
+            const __m128 a = _mm_shuffle_ps( vA, vA, _MM_SHUFFLE(3, 3, 3, 3) );
+            const __m128 b = _mm_shuffle_ps( vB, vB, _MM_SHUFFLE(3, 3, 3, 3) );
+            __m128 r = mergeSSE2<f, maxValue>(vA, vB, a, b);
+            if (doAlphaMasking) {
+                r = mergeSelectSSE2( alphaLane, _mm_sub_ps( _mm_add_ps(a, b), _mm_mul_ps(_mm_mul_ps(a, b), invMax) ), r );
+            }
+            _mm_storeu_ps(dst, r);
+        }
+    }
+
+    // four pixels at a time, transposed to one vector per channel. Returns the number of pixels processed.
+    static int processRowHSL(const float *A,
+                             int aStep,
+                             const float *B,
+                             int bStep,
+                             float *dst,
+                             int count)
+    {
+        const int n = count & ~3;
+
+        for (int i = 0; i < n; i += 4, A += 4 * aStep, B += 4 * bStep, dst += 16) {
+            RGBSSE2 vA, vB, r;
+            __m128 a = _mm_loadu_ps(A + 3 * aStep);
+            __m128 b = _mm_loadu_ps(B + 3 * bStep);
+            __m128 alpha;
+            vA.r = _mm_loadu_ps(A);
+            vA.g = _mm_loadu_ps(A + aStep);
+            vA.b = _mm_loadu_ps(A + 2 * aStep);
+            _MM_TRANSPOSE4_PS(vA.r, vA.g, vA.b, a);
+            vB.r = _mm_loadu_ps(B);
+            vB.g = _mm_loadu_ps(B + bStep);
+            vB.b = _mm_loadu_ps(B + 2 * bStep);
+            _MM_TRANSPOSE4_PS(vB.r, vB.g, vB.b, b);
+            mergeHSLSSE2<f, maxValue>(vA, a, vB, b, &r, &alpha);
+            _MM_TRANSPOSE4_PS(r.r, r.g, r.b, alpha);
+            _mm_storeu_ps(dst, r.r);
+            _mm_storeu_ps(dst + 4, r.g);
+            _mm_storeu_ps(dst + 8, r.b);
+            _mm_storeu_ps(dst + 12, alpha);
+        }
+
+        return n;
+    }
+};
+
+#endif // OFXS_MERGING_SSE2
+
+/**
+ * @brief Merge count pixels of the interleaved rows A and B into dst, as mergePixel() would do for each pixel.
+ * The alpha of a pixel is its last component if nComponents is 4, its only component if nComponents is 1,
+ * and maxValue (opaque) otherwise. A NULL row is black and transparent. dst may be A or B.
+ * All the operators on float RGBA rows use SSE2, where available.
+ **/
+template <MergingFunctionEnum f, typename PIX, int nComponents, int maxValue>
+void
+mergeRow(bool doAlphaMasking,
+         const PIX *A,
+         const PIX *B,
+         PIX *dst,
+         int count)
+{
+    const PIX zero[nComponents] = { 0 };
+    const int aStep = A ? nComponents : 0;
+    const int bStep = B ? nComponents : 0;
+
+    if (!A) {
+        A = zero;
+    }
+    if (!B) {
+        B = zero;
+    }
+    const int done = MergeRowSIMD<f, PIX, nComponents, maxValue>::process(doAlphaMasking, A, aStep, B, bStep, dst, count);
+    A += done * aStep;
+    B += done * bStep;
+    dst += done * nComponents;
+    for (int i = done; i < count; ++i, A += aStep, B += bStep, dst += nComponents) {
+        const PIX a = (nComponents == 4) ? A[3] : ( (nComponents == 1) ? A[0] : (PIX)maxValue );
+        const PIX b = (nComponents == 4) ? B[3] : ( (nComponents == 1) ? B[0] : (PIX)maxValue );
+        mergePixel<f, PIX, nComponents, maxValue>(doAlphaMasking, A, a, B, b, dst);
+    }
+} // mergeRow
+
+// mergeRow, for an operation known at run time
+template <typename PIX, int nComponents, int maxValue>
+void
+mergeRowForOperation(MergingFunctionEnum operation,
+                     bool doAlphaMasking,
+                     const PIX *A,
+                     const PIX *B,
+                     PIX *dst,
+                     int count)
+{
+    switch (operation) {
+    case eMergeATop:
+        mergeRow<eMergeATop, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeAverage:
+        mergeRow<eMergeAverage, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeColor:
+        mergeRow<eMergeColor, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeColorBurn:
+        mergeRow<eMergeColorBurn, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeColorDodge:
+        mergeRow<eMergeColorDodge, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeConjointOver:
+        mergeRow<eMergeConjointOver, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeCopy:
+        mergeRow<eMergeCopy, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeDifference:
+        mergeRow<eMergeDifference, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeDisjointOver:
+        mergeRow<eMergeDisjointOver, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeDivide:
+        mergeRow<eMergeDivide, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeExclusion:
+        mergeRow<eMergeExclusion, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeFreeze:
+        mergeRow<eMergeFreeze, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeFrom:
+        mergeRow<eMergeFrom, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeGeometric:
+        mergeRow<eMergeGeometric, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeGrainExtract:
+        mergeRow<eMergeGrainExtract, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeGrainMerge:
+        mergeRow<eMergeGrainMerge, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeHardLight:
+        mergeRow<eMergeHardLight, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeHue:
+        mergeRow<eMergeHue, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeHypot:
+        mergeRow<eMergeHypot, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeIn:
+        mergeRow<eMergeIn, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeLuminosity:
+        mergeRow<eMergeLuminosity, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeMask:
+        mergeRow<eMergeMask, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeMatte:
+        mergeRow<eMergeMatte, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeMax:
+        mergeRow<eMergeMax, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeMin:
+        mergeRow<eMergeMin, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeMinus:
+        mergeRow<eMergeMinus, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeMultiply:
+        mergeRow<eMergeMultiply, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeOut:
+        mergeRow<eMergeOut, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeOver:
+        mergeRow<eMergeOver, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeOverlay:
+        mergeRow<eMergeOverlay, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergePinLight:
+        mergeRow<eMergePinLight, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergePlus:
+        mergeRow<eMergePlus, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeReflect:
+        mergeRow<eMergeReflect, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeSaturation:
+        mergeRow<eMergeSaturation, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeScreen:
+        mergeRow<eMergeScreen, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeSoftLight:
+        mergeRow<eMergeSoftLight, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeStencil:
+        mergeRow<eMergeStencil, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeUnder:
+        mergeRow<eMergeUnder, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    case eMergeXOR:
+        mergeRow<eMergeXOR, PIX, nComponents, maxValue>(doAlphaMasking, A, B, dst, count);
+        break;
+    } // switch
+} // mergeRowForOperation
 } // MergeImages2D
 } // OFX
 
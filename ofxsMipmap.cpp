@@ -20,84 +20,584 @@
  * OFX mipmapping help functions
  */
 
-#include "ofxsMipMap.h"
+#include "ofxsMipmap.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include "ofxsCoords.h"
+#include "ofxsLut.h"
+#include "ofxsMultiThread.h"
+#include "ofxsMacros.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OFXS_MIPMAP_SSE2
+#include <emmintrin.h>
+#endif
+
+// minimum number of rows per thread at the last level streamed in a single pass (see MipMapStreamProcessor)
+#define kOfxsMipMapStreamRowsPerThread 4
 
 namespace OFX {
-// update the window of dst defined by dstRoI by halving the corresponding area in src.
+// storage type for half-float components, so that they are averaged as floats rather than integers
+struct MipMapHalf
+{
+    unsigned short bits;
+};
+
+// the accumulator type used to average each component type, and the conversions to and from it.
+// Integer averages are rounded to the nearest integer.
+// toFloat() and fromFloat() are used for weighted averages, which are always computed in float.
+template <typename PIX>
+struct MipMapTraits;
+
+template <>
+struct MipMapTraits<unsigned char>
+{
+    typedef int acc_t;
+    static acc_t toAcc(unsigned char v) { return v; }
+
+    static unsigned char fromAcc(acc_t sum,
+                                 int n) { return (unsigned char)( (sum + n / 2) / n ); }
+
+    static float toFloat(unsigned char v) { return v; }
+
+    static unsigned char fromFloat(float v) { return v <= 0.f ? 0 : ( v >= 255.f ? 255 : (unsigned char)(v + 0.5f) ); }
+};
+
+template <>
+struct MipMapTraits<unsigned short>
+{
+    typedef int acc_t;
+    static acc_t toAcc(unsigned short v) { return v; }
+
+    static unsigned short fromAcc(acc_t sum,
+                                  int n) { return (unsigned short)( (sum + n / 2) / n ); }
+
+    static float toFloat(unsigned short v) { return v; }
+
+    static unsigned short fromFloat(float v) { return v <= 0.f ? 0 : ( v >= 65535.f ? 65535 : (unsigned short)(v + 0.5f) ); }
+};
+
+template <>
+struct MipMapTraits<MipMapHalf>
+{
+    typedef float acc_t;
+    static acc_t toAcc(MipMapHalf v) { return Color::halfToFloat(v.bits); }
+
+    static MipMapHalf fromAcc(acc_t sum,
+                              int n) { MipMapHalf h; h.bits = Color::floatToHalf(sum / n); return h; }
+
+    static float toFloat(MipMapHalf v) { return Color::halfToFloat(v.bits); }
+
+    static MipMapHalf fromFloat(float v) { MipMapHalf h; h.bits = Color::floatToHalf(v); return h; }
+};
+
+template <>
+struct MipMapTraits<float>
+{
+    typedef float acc_t;
+    static acc_t toAcc(float v) { return v; }
+
+    static float fromAcc(acc_t sum,
+                         int n) { return sum / n; }
+
+    static float toFloat(float v) { return v; }
+
+    static float fromFloat(float v) { return v; }
+};
+
+// halve a row of width pixels, where both source rows and all source columns are inside the
+// source image: no bounds checking is necessary, and the sum is always 4.
+template <typename PIX, int nComponents>
+static inline void
+halveRowInterior(const PIX* srcThisRow,
+                 const PIX* srcNextRow,
+                 PIX* dst,
+                 int width)
+{
+    typedef MipMapTraits<PIX> Traits;
+
+    for (int x = 0; x < width; ++x, srcThisRow += 2 * nComponents, srcNextRow += 2 * nComponents, dst += nComponents) {
+        for (int k = 0; k < nComponents; ++k) {
+            ///a b
+            ///c d
+            dst[k] = Traits::fromAcc(Traits::toAcc(srcThisRow[k]) + Traits::toAcc(srcThisRow[k + nComponents]) +
+                                     Traits::toAcc(srcNextRow[k]) + Traits::toAcc(srcNextRow[k + nComponents]), 4);
+        }
+    }
+}
+
+#ifdef OFXS_MIPMAP_SSE2
+// RGBA float: one pixel per SSE register
+template <>
+inline void
+halveRowInterior<float, 4>(const float* srcThisRow,
+                           const float* srcNextRow,
+                           float* dst,
+                           int width)
+{
+    const __m128 quarter = _mm_set1_ps(0.25f);
+
+    for (int x = 0; x < width; ++x, srcThisRow += 8, srcNextRow += 8, dst += 4) {
+        const __m128 a = _mm_loadu_ps(srcThisRow);
+        const __m128 b = _mm_loadu_ps(srcThisRow + 4);
+        const __m128 c = _mm_loadu_ps(srcNextRow);
+        const __m128 d = _mm_loadu_ps(srcNextRow + 4);
+        // same summation order as the generic version, so that results are identical
+        _mm_storeu_ps( dst, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(a, b), c), d), quarter) );
+    }
+}
+
+// Alpha float: four pixels per SSE register
+template <>
+inline void
+halveRowInterior<float, 1>(const float* srcThisRow,
+                           const float* srcNextRow,
+                           float* dst,
+                           int width)
+{
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4, srcThisRow += 8, srcNextRow += 8, dst += 4) {
+        const __m128 t0 = _mm_loadu_ps(srcThisRow);
+        const __m128 t1 = _mm_loadu_ps(srcThisRow + 4);
+        const __m128 n0 = _mm_loadu_ps(srcNextRow);
+        const __m128 n1 = _mm_loadu_ps(srcNextRow + 4);
+        // deinterleave even (a, c) and odd (b, d) columns
+        const __m128 a = _mm_shuffle_ps( t0, t1, _MM_SHUFFLE(2, 0, 2, 0) );
+        const __m128 b = _mm_shuffle_ps( t0, t1, _MM_SHUFFLE(3, 1, 3, 1) );
+        const __m128 c = _mm_shuffle_ps( n0, n1, _MM_SHUFFLE(2, 0, 2, 0) );
+        const __m128 d = _mm_shuffle_ps( n0, n1, _MM_SHUFFLE(3, 1, 3, 1) );
+        _mm_storeu_ps( dst, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(a, b), c), d), quarter) );
+    }
+    for (; x < width; ++x, srcThisRow += 2, srcNextRow += 2, ++dst) {
+        *dst = (srcThisRow[0] + srcThisRow[1] + srcNextRow[0] + srcNextRow[1]) / 4;
+    }
+}
+#endif // OFXS_MIPMAP_SSE2
+
+// halve the dst pixel at x, where some of the source pixels may be outside of the source image.
+// srcThisRow and srcNextRow point to the source pixel at srcX1 of rows 2y and 2y+1, or are NULL
+// if the row is outside of the source image.
+template <typename PIX, int nComponents>
+static inline void
+halvePixelBorder(int x,
+                 const PIX* srcThisRow,
+                 const PIX* srcNextRow,
+                 int srcX1,
+                 int srcX2,
+                 PIX* dstPixStart)
+{
+    typedef MipMapTraits<PIX> Traits;
+    typedef typename Traits::acc_t acc_t;
+    const bool pickThisRow = (srcThisRow != NULL);
+    const bool pickNextRow = (srcNextRow != NULL);
+    const int sumH = (int)pickNextRow + (int)pickThisRow;
+
+    // The current dst col, at y, covers the src cols x*2 (thisCol) and x*2+1 (nextCol).
+    // Check that if are within srcBounds.
+    int srcx = x * 2;
+    bool pickThisCol = srcX1 <= (srcx + 0) && (srcx + 0) < srcX2;
+    bool pickNextCol = srcX1 <= (srcx + 1) && (srcx + 1) < srcX2;
+    const int sumW = (int)pickThisCol + (int)pickNextCol;
+    assert(sumW == 1 || sumW == 2);
+    const int sum = sumW * sumH;
+    assert(0 < sum && sum <= 4);
+    const int thisCol = (srcx - srcX1) * nComponents;
+    const int nextCol = thisCol + nComponents;
+
+    for (int k = 0; k < nComponents; ++k) {
+        ///a b
+        ///c d
+
+        const acc_t a = (pickThisCol && pickThisRow) ? Traits::toAcc(srcThisRow[thisCol + k]) : 0;
+        const acc_t b = (pickNextCol && pickThisRow) ? Traits::toAcc(srcThisRow[nextCol + k]) : 0;
+        const acc_t c = (pickThisCol && pickNextRow) ? Traits::toAcc(srcNextRow[thisCol + k]) : 0;
+        const acc_t d = (pickNextCol && pickNextRow) ? Traits::toAcc(srcNextRow[nextCol + k]) : 0;
+
+        dstPixStart[k] = Traits::fromAcc(a + b + c + d, sum);
+    }
+}
+
+// update the columns [dstX1, dstX2) of a dst row by halving the two corresponding src rows.
+// srcThisRow and srcNextRow point to the source pixel at srcX1 of rows 2y and 2y+1, or are NULL
+// if the row is outside of the source image. dstRow points to the dst pixel at dstX1.
+// Pixels which depend on source pixels outside of [srcX1, srcX2) are computed by halvePixelBorder(),
+// and the others by the branch-free halveRowInterior().
 // proofread and fixed by F. Devernay on 3/10/2014
 template <typename PIX, int nComponents>
 static void
-halveWindow(const OfxRectI & dstRoI,
-            const PIX* srcPixels,
-            const OfxRectI & srcBounds,
-            int srcRowBytes,
-            PIX* dstPixels,
-            const OfxRectI & dstBounds,
-            int dstRowBytes)
+halveRow(int dstX1,
+         int dstX2,
+         const PIX* srcThisRow,
+         const PIX* srcNextRow,
+         int srcX1,
+         int srcX2,
+         PIX* dstRow)
 {
-    assert(srcPixels && dstPixels);
-    if (!srcPixels || !dstPixels) {
-        throwSuiteStatusException(kOfxStatFailed);
+    assert( (srcThisRow || srcNextRow) && dstRow );
+    assert(dstX1 * 2 >= (srcX1 - 1) && (dstX2 - 1) * 2 < srcX2);
+
+    if (!srcThisRow || !srcNextRow) {
+        // top or bottom border row
+        for (int x = dstX1; x < dstX2; ++x) {
+            halvePixelBorder<PIX, nComponents>(x, srcThisRow, srcNextRow, srcX1, srcX2, dstRow + (x - dstX1) * nComponents);
+        }
+
+        return;
+    }
+
+    // the interior columns: x such that both x*2 and x*2+1 are within [srcX1, srcX2)
+    const int interiorX1 = std::min( dstX2, std::max(dstX1, (srcX1 + 1) >> 1) );
+    const int interiorX2 = std::max( interiorX1, std::min(dstX2, srcX2 >> 1) );
+
+    for (int x = dstX1; x < interiorX1; ++x) {
+        halvePixelBorder<PIX, nComponents>(x, srcThisRow, srcNextRow, srcX1, srcX2, dstRow + (x - dstX1) * nComponents);
+    }
+    if (interiorX1 < interiorX2) {
+        const int srcOffset = (interiorX1 * 2 - srcX1) * nComponents;
+        halveRowInterior<PIX, nComponents>(srcThisRow + srcOffset,
+                                           srcNextRow + srcOffset,
+                                           dstRow + (interiorX1 - dstX1) * nComponents,
+                                           interiorX2 - interiorX1);
     }
+    for (int x = interiorX2; x < dstX2; ++x) {
+        halvePixelBorder<PIX, nComponents>(x, srcThisRow, srcNextRow, srcX1, srcX2, dstRow + (x - dstX1) * nComponents);
+    }
+} // halveRow
+
+// one level of a pyramid, as seen by MipMapStreamProcessor
+template <typename PIX>
+struct MipMapStreamLevel
+{
+    OfxRectI window; // the pixels to compute at this level
+    PIX* data; // pixel (window.x1, window.y1), or the first of the two rows if ring is true
+    int rowSize; // in PIX
+    bool ring; // only keep the last two rows: row y is stored at (y & 1)
+
+    PIX* row(int y) const
+    {
+        return ring ? ( data + (y & 1) * rowSize ) : ( data + (std::ptrdiff_t)(y - window.y1) * rowSize );
+    }
+};
+
+// Build all the levels of a pyramid in a single pass over the source rows.
+// As soon as the two rows of a level that a row of the next level depends on are computed,
+// that row is computed too, while the data it reads is still in cache, so that each level
+// is read once just after it was written, and the source image is read only once.
+// Levels which are not stored (the intermediate levels of ofxsScalePixelData) only keep
+// their last two rows.
+// Each thread processes a band of rows of the last level of a group of levels, and all the rows of
+// the previous levels they depend on: bands do not overlap at any level.
+// The number of threads is chosen from the size of the first level, and a group ends at the last level
+// which has at least kOfxsMipMapStreamRowsPerThread rows per thread. The next levels are built from
+// that level, which is stored, by another pass.
+template <typename PIX, int nComponents>
+class MipMapStreamProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    MipMapStreamProcessor(const PIX* srcPixels,
+                          const OfxRectI & srcBounds,
+                          int srcRowBytes,
+                          const std::vector<MipMapStreamLevel<PIX> > & levels)
+        : _srcPixels(srcPixels)
+        , _srcBounds(srcBounds)
+        , _srcRowSize(srcRowBytes / (int)sizeof(PIX))
+        , _levels(levels)
+        , _groupSize( levels.size() )
+        , _groupLastRows()
+    {
+    }
+
+    void process()
+    {
+        if ( _levels.empty() ) {
+            return;
+        }
+        const OfxRectI & firstWindow = _levels.front().window;
+        const OfxRectI & lastWindow = _levels.back().window;
+        if ( (firstWindow.x1 >= firstWindow.x2) || (firstWindow.y1 >= firstWindow.y2) ||
+             (lastWindow.x1 >= lastWindow.x2) || (lastWindow.y1 >= lastWindow.y2) ) {
+            return;
+        }
+        // make sure there are at least 4096 pixels of the first level per CPU and at least 1 line of the first level par CPU
+        unsigned int nCPUs = ( std::min(firstWindow.x2 - firstWindow.x1, 4096) *
+                               (firstWindow.y2 - firstWindow.y1) ) / 4096;
+        nCPUs = std::min( nCPUs, (unsigned int)(firstWindow.y2 - firstWindow.y1) );
+        // make sure the number of CPUs is valid (and use at least 1 CPU)
+        nCPUs = std::max( 1u, std::min( nCPUs, OFX::MultiThread::getNumCPUs() ) );
+
+        if (nCPUs > 1) {
+            // the levels which have enough rows to give a band to each thread
+            _groupSize = 1;
+            while ( ( _groupSize < _levels.size() ) &&
+                    ( (unsigned int)(_levels[_groupSize].window.y2 - _levels[_groupSize].window.y1) >= nCPUs * kOfxsMipMapStreamRowsPerThread ) ) {
+                ++_groupSize;
+            }
+        }
+        MipMapStreamLevel<PIX> & groupLast = _levels[_groupSize - 1];
+        if ( (_groupSize < _levels.size()) && groupLast.ring ) {
+            // the next levels are built from the last level of the group, which must be stored
+            _groupLastRows.resize( (std::size_t)(groupLast.window.y2 - groupLast.window.y1) * groupLast.rowSize );
+            groupLast.data = &_groupLastRows[0];
+            groupLast.ring = false;
+        }
+        nCPUs = std::min( nCPUs, (unsigned int)(groupLast.window.y2 - groupLast.window.y1) );
 
-    assert(dstRoI.x1 * 2 >= (srcBounds.x1 - 1) && (dstRoI.x2 - 1) * 2 < srcBounds.x2 &&
-           dstRoI.y1 * 2 >= (srcBounds.y1 - 1) && (dstRoI.y2 - 1) * 2 < srcBounds.y2);
-    int srcRowSize = srcRowBytes / sizeof(PIX);
-    int dstRowSize = dstRowBytes / sizeof(PIX);
+        multiThread(nCPUs);
 
-    // offset pointers so that srcData and dstData correspond to pixel (0,0)
-    const PIX* const srcData = srcPixels - (srcBounds.x1 * nComponents + srcRowSize * srcBounds.y1);
-    PIX* const dstData       = dstPixels - (dstBounds.x1 * nComponents + dstRowSize * dstBounds.y1);
+        if ( _groupSize < _levels.size() ) {
+            std::vector<MipMapStreamLevel<PIX> > next(_levels.begin() + _groupSize, _levels.end());
+            MipMapStreamProcessor<PIX, nComponents> processor(groupLast.data, groupLast.window, groupLast.rowSize * (int)sizeof(PIX), next);
+            processor.process();
+        }
+    }
 
-    for (int y = dstRoI.y1; y < dstRoI.y2; ++y) {
-        const PIX* const srcLineStart    = srcData + y * 2 * srcRowSize;
-        PIX* const dstLineStart          = dstData + y     * dstRowSize;
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int nLevels = (int)_groupSize;
+        const OfxRectI & lastWindow = _levels[nLevels - 1].window;
+        int lastY1, lastY2;
+
+        OFX::MultiThread::getThreadRange(threadId, nThreads, lastWindow.y1, lastWindow.y2, &lastY1, &lastY2);
+        if (lastY2 <= lastY1) {
+            return;
+        }
 
-        // The current dst row, at y, covers the src rows y*2 (thisRow) and y*2+1 (nextRow).
-        // Check that if are within srcBounds.
-        int srcy = y * 2;
-        bool pickThisRow = srcBounds.y1 <= (srcy + 0) && (srcy + 0) < srcBounds.y2;
-        bool pickNextRow = srcBounds.y1 <= (srcy + 1) && (srcy + 1) < srcBounds.y2;
-        const int sumH = (int)pickNextRow + (int)pickThisRow;
-        assert(sumH == 1 || sumH == 2);
+        // the two-row buffers of this thread
+        std::vector<MipMapStreamLevel<PIX> > levels(_levels.begin(), _levels.begin() + nLevels);
+        std::size_t ringSize = 0;
+        for (int l = 0; l < nLevels; ++l) {
+            if (levels[l].ring) {
+                ringSize += 2 * levels[l].rowSize;
+            }
+        }
+        std::vector<PIX> rings(ringSize);
+        ringSize = 0;
+        for (int l = 0; l < nLevels; ++l) {
+            if (levels[l].ring) {
+                levels[l].data = &rings[ringSize];
+                ringSize += 2 * levels[l].rowSize;
+            }
+        }
 
-        for (int x = dstRoI.x1; x < dstRoI.x2; ++x) {
-            const PIX* const srcPixStart    = srcLineStart   + x * 2 * nComponents;
-            PIX* const dstPixStart          = dstLineStart   + x * nComponents;
+        // the rows of the first level this band depends on
+        const int scale = 1 << (nLevels - 1);
+        const OfxRectI & firstWindow = levels[0].window;
+        const int y1 = std::max(firstWindow.y1, lastY1 * scale);
+        const int y2 = std::min(firstWindow.y2, lastY2 * scale);
 
-            // The current dst col, at y, covers the src cols x*2 (thisCol) and x*2+1 (nextCol).
+        for (int y = y1; y < y2; ++y) {
+            // The current row, at y, covers the src rows y*2 (thisRow) and y*2+1 (nextRow).
             // Check that if are within srcBounds.
-            int srcx = x * 2;
-            bool pickThisCol = srcBounds.x1 <= (srcx + 0) && (srcx + 0) < srcBounds.x2;
-            bool pickNextCol = srcBounds.x1 <= (srcx + 1) && (srcx + 1) < srcBounds.x2;
-            const int sumW = (int)pickThisCol + (int)pickNextCol;
-            assert(sumW == 1 || sumW == 2);
-            const int sum = sumW * sumH;
-            assert(0 < sum && sum <= 4);
-
-            for (int k = 0; k < nComponents; ++k) {
-                ///a b
-                ///c d
-
-                const PIX a = (pickThisCol && pickThisRow) ? *(srcPixStart + k) : 0;
-                const PIX b = (pickNextCol && pickThisRow) ? *(srcPixStart + k + nComponents) : 0;
-                const PIX c = (pickThisCol && pickNextRow) ? *(srcPixStart + k + srcRowSize) : 0;
-                const PIX d = (pickNextCol && pickNextRow) ? *(srcPixStart + k + srcRowSize  + nComponents)  : 0;
-
-                assert( sumW == 2 || ( sumW == 1 && ( (a == 0 && c == 0) || (b == 0 && d == 0) ) ) );
-                assert( sumH == 2 || ( sumH == 1 && ( (a == 0 && b == 0) || (c == 0 && d == 0) ) ) );
-                dstPixStart[k] = (a + b + c + d) / sum;
+            const int srcy = y * 2;
+            const PIX* srcThisRow = NULL;
+            const PIX* srcNextRow = NULL;
+            if ( (_srcBounds.y1 <= srcy) && (srcy < _srcBounds.y2) ) {
+                srcThisRow = _srcPixels + (std::ptrdiff_t)(srcy - _srcBounds.y1) * _srcRowSize;
             }
+            if ( (_srcBounds.y1 <= srcy + 1) && (srcy + 1 < _srcBounds.y2) ) {
+                srcNextRow = _srcPixels + (std::ptrdiff_t)(srcy + 1 - _srcBounds.y1) * _srcRowSize;
+            }
+            halveRow<PIX, nComponents>(firstWindow.x1, firstWindow.x2, srcThisRow, srcNextRow,
+                                       _srcBounds.x1, _srcBounds.x2, levels[0].row(y));
+
+            // compute the rows of the next levels which are now complete
+            int yl = y;
+            for (int l = 1; l < nLevels; ++l) {
+                const MipMapStreamLevel<PIX> & prev = levels[l - 1];
+                const MipMapStreamLevel<PIX> & next = levels[l];
+                if ( !(yl & 1) && (yl != prev.window.y2 - 1) ) {
+                    // row yl/2 of the next level also depends on row yl+1
+                    break;
+                }
+                const int yn = yl >> 1;
+                assert(next.window.y1 <= yn && yn < next.window.y2);
+                if ( (yn < next.window.y1) || (next.window.y2 <= yn) ) {
+                    break;
+                }
+                const PIX* thisRow = (prev.window.y1 <= yn * 2) ? prev.row(yn * 2) : NULL;
+                const PIX* nextRow = (yn * 2 + 1 < prev.window.y2) ? prev.row(yn * 2 + 1) : NULL;
+                halveRow<PIX, nComponents>(next.window.x1, next.window.x2, thisRow, nextRow,
+                                           prev.window.x1, prev.window.x2, next.row(yn));
+                yl = yn;
+            }
+        }
+    } // multiThreadFunction
+
+    const PIX* const _srcPixels;
+    const OfxRectI _srcBounds;
+    const int _srcRowSize;
+    std::vector<MipMapStreamLevel<PIX> > _levels;
+    std::size_t _groupSize; // the number of levels processed by multiThreadFunction()
+    std::vector<PIX> _groupLastRows; // the last level of the group, if it is not stored
+};
+
+static int
+mipMapComponentBytes(BitDepthEnum pixelDepth)
+{
+    switch (pixelDepth) {
+    case eBitDepthUByte:
+
+        return 1;
+    case eBitDepthUShort:
+    case eBitDepthHalf:
+
+        return 2;
+    case eBitDepthFloat:
+
+        return 4;
+    default:
+
+        return 0;
+    }
+}
+
+static int
+mipMapComponentCount(PixelComponentEnum pixelComponents)
+{
+    switch (pixelComponents) {
+    case ePixelComponentRGBA:
+
+        return 4;
+    case ePixelComponentRGB:
+
+        return 3;
+    case ePixelComponentXY:
+
+        return 2;
+    case ePixelComponentAlpha:
+
+        return 1;
+    default:
+
+        return 0;
+    }
+}
+
+static inline std::size_t
+mipMapAlign(std::size_t n)
+{
+    return (n + kOfxsMipMapAlignment - 1) & ~( (std::size_t)kOfxsMipMapAlignment - 1 );
+}
+
+void
+MipMapsVector::allocate(ImageEffect* instance,
+                        const OfxRectI & renderWindow,
+                        unsigned int maxLevel,
+                        PixelComponentEnum pixelComponents,
+                        BitDepthEnum pixelDepth)
+{
+    const int pixelBytes = mipMapComponentCount(pixelComponents) * mipMapComponentBytes(pixelDepth);
+
+    if (pixelBytes <= 0) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+
+    // compute the layout of all levels in a single block
+    std::vector<MipMap> levels(maxLevel);
+    std::vector<std::size_t> offsets(maxLevel);
+    std::size_t totalSize = 0;
+    OfxRectI levelWindow = renderWindow;
+    for (unsigned int i = 0; i < maxLevel; ++i) {
+        ///Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
+        levelWindow = Coords::downscalePowerOfTwoSmallestEnclosing(levelWindow, 1);
+#     ifdef DEBUG
+        {
+            // check that doing i times 1 level is the same as doing i levels
+            OfxRectI nrw = Coords::downscalePowerOfTwoSmallestEnclosing(renderWindow, i + 1);
+            assert(nrw.x1 == levelWindow.x1 && nrw.x2 == levelWindow.x2 && nrw.y1 == levelWindow.y1 && nrw.y2 == levelWindow.y2);
+        }
+#     endif
+        MipMap & m = levels[i];
+        const int width = std::max(0, levelWindow.x2 - levelWindow.x1);
+        const int height = std::max(0, levelWindow.y2 - levelWindow.y1);
+        m.bounds = levelWindow;
+        m.pixelBytes = pixelBytes;
+        m.rowBytes = (int)mipMapAlign( (std::size_t)width * pixelBytes );
+        m.memSize = (std::size_t)height * m.rowBytes;
+        offsets[i] = totalSize;
+        totalSize += m.memSize; // rowBytes is aligned, so is memSize
+    }
+
+    // reuse the block if it is large enough, else reallocate it
+    const std::size_t neededSize = totalSize + kOfxsMipMapAlignment; // room for aligning the start of the block
+    if ( !_mem || (_memSize < neededSize) ) {
+        clear();
+        _mem = new ImageMemory(neededSize, instance);
+        _memSize = neededSize;
+        char* memData = (char*)_mem->lock();
+        if (!memData) {
+            clear();
+            throwSuiteStatusException(kOfxStatErrMemory);
         }
+        _memData = memData + ( mipMapAlign( (std::size_t)memData ) - (std::size_t)memData );
+    }
+    for (unsigned int i = 0; i < maxLevel; ++i) {
+        levels[i].data = _memData + offsets[i];
+    }
+    _levels.swap(levels);
+    _renderWindow = renderWindow;
+    _pixelComponents = pixelComponents;
+    _pixelDepth = pixelDepth;
+} // MipMapsVector::allocate
+
+void
+MipMapsVector::clear()
+{
+    if (_mem) {
+        _mem->unlock();
+        delete _mem;
+        _mem = NULL;
+    }
+    _memSize = 0;
+    _memData = NULL;
+    _levels.clear();
+    _pixelComponents = ePixelComponentNone;
+    _pixelDepth = eBitDepthNone;
+}
+
+// build all the levels of mipmaps, which must have been allocated, from the source image
+template <typename PIX, int nComponents>
+static void
+ofxsBuildMipMapsForComponents(const PIX* srcPixelData,
+                              const OfxRectI & srcBounds,
+                              int srcRowBytes,
+                              MipMapsVector & mipmaps)
+{
+    assert(srcPixelData);
+    if (!srcPixelData) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( mipmaps.empty() ) {
+        return;
+    }
+
+    // all levels are stored
+    std::vector<MipMapStreamLevel<PIX> > levels( mipmaps.size() );
+    for (std::size_t i = 0; i < mipmaps.size(); ++i) {
+        const MipMap & m = mipmaps[i];
+        levels[i].window = m.bounds;
+        levels[i].data = (PIX*)m.data;
+        levels[i].rowSize = m.rowBytes / (int)sizeof(PIX);
+        levels[i].ring = false;
     }
-} // halveWindow
 
-// update the window of dst defined by originalRenderWindow by mipmapping the windows of src defined by renderWindowFullRes
+    MipMapStreamProcessor<PIX, nComponents> processor(srcPixelData, srcBounds, srcRowBytes, levels);
+    processor.process();
+}
+
+// update the window of dst defined by originalRenderWindow by mipmapping the windows of src defined by renderWindowFullRes.
+// The intermediate levels are not stored: only two rows of each are kept while streaming.
 // proofread and fixed by F. Devernay on 3/10/2014
 template <typename PIX, int nComponents>
 static void
-buildMipMapLevel(ImageEffect* instance,
-                 const OfxRectI & originalRenderWindow,
+buildMipMapLevel(const OfxRectI & originalRenderWindow,
                  const OfxRectI & renderWindowFullRes,
                  unsigned int level,
                  const PIX* srcPixels,
@@ -113,66 +613,65 @@ buildMipMapLevel(ImageEffect* instance,
         throwSuiteStatusException(kOfxStatFailed);
     }
 
-    auto_ptr<ImageMemory> mem;
-    size_t memSize = 0;
-    auto_ptr<ImageMemory> tmpMem;
-    size_t tmpMemSize = 0;
-    PIX* nextImg = NULL;
-    const PIX* previousImg = srcPixels;
-    OfxRectI previousBounds = srcBounds;
-    int previousRowBytes = srcRowBytes;
+    std::vector<MipMapStreamLevel<PIX> > levels(level);
     OfxRectI nextRenderWindow = renderWindowFullRes;
-
-    ///Build all the mipmap levels until we reach the one we are interested in
-    for (unsigned int i = 1; i < level; ++i) {
-        // loop invariant:
-        // - previousImg, previousBounds, previousRowBytes describe the data ate the level before i
-        // - nextRenderWindow contains the renderWindow at the level before i
-        //
+    for (unsigned int i = 0; i + 1 < level; ++i) {
         ///Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
-        nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-#     ifdef DEBUG
-        {
-            // check that doing i times 1 level is the same as doing i levels
-            OfxRectI nrw = downscalePowerOfTwoSmallestEnclosing(renderWindowFullRes, i);
-            assert(nrw.x1 == nextRenderWindow.x1 && nrw.x2 == nextRenderWindow.x2 && nrw.y1 == nextRenderWindow.y1 && nrw.y2 == nextRenderWindow.y2);
-        }
-#     endif
-        ///Allocate a temporary image if necessary, or reuse the previously allocated buffer
-        int nextRowBytes =  (nextRenderWindow.x2 - nextRenderWindow.x1)  * nComponents * sizeof(PIX);
-        size_t newMemSize =  (nextRenderWindow.y2 - nextRenderWindow.y1) * nextRowBytes;
-        if ( tmpMem.get() ) {
-            // there should be enough memory: no need to reallocate
-            assert(tmpMemSize >= memSize);
-        } else {
-            tmpMem.reset( new ImageMemory(newMemSize, instance) );
-            tmpMemSize = newMemSize;
-        }
-        nextImg = (float*)tmpMem->lock();
-
-        halveWindow<PIX, nComponents>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, nextImg, nextRenderWindow, nextRowBytes);
-
-        ///Switch for next pass
-        previousBounds = nextRenderWindow;
-        previousRowBytes = nextRowBytes;
-        previousImg = nextImg;
-        mem = tmpMem;
-        memSize = tmpMemSize;
+        nextRenderWindow = Coords::downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
+        levels[i].window = nextRenderWindow;
+        levels[i].data = NULL; // allocated by each thread
+        levels[i].rowSize = std::max(0, nextRenderWindow.x2 - nextRenderWindow.x1) * nComponents;
+        levels[i].ring = true;
     }
-    // here:
-    // - previousImg, previousBounds, previousRowBytes describe the data ate the level before 'level'
-    // - nextRenderWindow contains the renderWindow at the level before 'level'
 
-    ///On the last iteration halve directly into the dstPixels
-    ///The nextRenderWindow should be equal to the original render window.
-    nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-    assert(originalRenderWindow.x1 == nextRenderWindow.x1 && originalRenderWindow.x2 == nextRenderWindow.x2 &&
-           originalRenderWindow.y1 == nextRenderWindow.y1 && originalRenderWindow.y2 == nextRenderWindow.y2);
+    ///On the last level halve directly into the dstPixels
+    ///The render window at this level should be equal to the original render window.
+#ifdef DEBUG
+    {
+        OfxRectI nrw = Coords::downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
+        assert(originalRenderWindow.x1 == nrw.x1 && originalRenderWindow.x2 == nrw.x2 &&
+               originalRenderWindow.y1 == nrw.y1 && originalRenderWindow.y2 == nrw.y2);
+    }
+#endif
+    assert(dstBounds.x1 <= originalRenderWindow.x1 && originalRenderWindow.x2 <= dstBounds.x2 &&
+           dstBounds.y1 <= originalRenderWindow.y1 && originalRenderWindow.y2 <= dstBounds.y2);
+    MipMapStreamLevel<PIX> & last = levels[level - 1];
+    const int dstRowSize = dstRowBytes / (int)sizeof(PIX);
+    last.window = originalRenderWindow;
+    last.data = dstPixels + ( (std::ptrdiff_t)(originalRenderWindow.y1 - dstBounds.y1) * dstRowSize +
+                              (originalRenderWindow.x1 - dstBounds.x1) * nComponents );
+    last.rowSize = dstRowSize;
+    last.ring = false;
 
-    halveWindow<PIX, nComponents>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, dstPixels, dstBounds, dstRowBytes);
-    // mem and tmpMem are freed at destruction
+    MipMapStreamProcessor<PIX, nComponents> processor(srcPixels, srcBounds, srcRowBytes, levels);
+    processor.process();
 } // buildMipMapLevel
 
+template <typename PIX>
+static void
+buildMipMapLevelForDepth(const OfxRectI & originalRenderWindow,
+                         const OfxRectI & renderWindow,
+                         unsigned int level,
+                         const void* srcPixelData,
+                         const OfxRectI & srcBounds,
+                         int srcRowBytes,
+                         void* dstPixelData,
+                         PixelComponentEnum dstPixelComponents,
+                         const OfxRectI & dstBounds,
+                         int dstRowBytes)
+{
+    if (dstPixelComponents == ePixelComponentRGBA) {
+        buildMipMapLevel<PIX, 4>(originalRenderWindow, renderWindow, level, (const PIX*)srcPixelData,
+                                 srcBounds, srcRowBytes, (PIX*)dstPixelData, dstBounds, dstRowBytes);
+    } else if (dstPixelComponents == ePixelComponentRGB) {
+        buildMipMapLevel<PIX, 3>(originalRenderWindow, renderWindow, level, (const PIX*)srcPixelData,
+                                 srcBounds, srcRowBytes, (PIX*)dstPixelData, dstBounds, dstRowBytes);
+    }  else if (dstPixelComponents == ePixelComponentAlpha) {
+        buildMipMapLevel<PIX, 1>(originalRenderWindow, renderWindow, level, (const PIX*)srcPixelData,
+                                 srcBounds, srcRowBytes, (PIX*)dstPixelData, dstBounds, dstRowBytes);
+    }     // switch
+}
+
 void
 ofxsScalePixelData(ImageEffect* instance,
                    const OfxRectI & originalRenderWindow,
@@ -189,13 +688,17 @@ ofxsScalePixelData(ImageEffect* instance,
                    const OfxRectI & dstBounds,
                    int dstRowBytes)
 {
+    (void)instance; // the intermediate levels are streamed, and need no ImageMemory
     assert(srcPixelData && dstPixelData);
     if (!srcPixelData || !dstPixelData) {
         throwSuiteStatusException(kOfxStatFailed);
     }
 
     // do the rendering
-    if ( ( dstPixelDepth != eBitDepthFloat) ||
+    if ( ( ( dstPixelDepth != eBitDepthUByte) &&
+           ( dstPixelDepth != eBitDepthUShort) &&
+           ( dstPixelDepth != eBitDepthHalf) &&
+           ( dstPixelDepth != eBitDepthFloat) ) ||
          ( ( dstPixelComponents != ePixelComponentRGBA) &&
            ( dstPixelComponents != ePixelComponentRGB) &&
            ( dstPixelComponents != ePixelComponentAlpha) ) ||
@@ -203,71 +706,47 @@ ofxsScalePixelData(ImageEffect* instance,
          ( dstPixelComponents != srcPixelComponents) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
     }
+    assert(levels > 0);
+    if (levels == 0) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
 
-    if (dstPixelComponents == ePixelComponentRGBA) {
-        buildMipMapLevel<float, 4>(instance, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    } else if (dstPixelComponents == ePixelComponentRGB) {
-        buildMipMapLevel<float, 3>(instance, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    }  else if (dstPixelComponents == ePixelComponentAlpha) {
-        buildMipMapLevel<float, 1>(instance, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    }     // switch
+    switch (dstPixelDepth) {
+    case eBitDepthUByte:
+        buildMipMapLevelForDepth<unsigned char>(originalRenderWindow, renderWindow, levels, srcPixelData, srcBounds, srcRowBytes,
+                                                dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        buildMipMapLevelForDepth<unsigned short>(originalRenderWindow, renderWindow, levels, srcPixelData, srcBounds, srcRowBytes,
+                                                 dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    case eBitDepthHalf:
+        buildMipMapLevelForDepth<MipMapHalf>(originalRenderWindow, renderWindow, levels, srcPixelData, srcBounds, srcRowBytes,
+                                             dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        buildMipMapLevelForDepth<float>(originalRenderWindow, renderWindow, levels, srcPixelData, srcBounds, srcRowBytes,
+                                        dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
 }
 
-template <typename PIX, int nComponents>
+template <typename PIX>
 static void
-ofxsBuildMipMapsForComponents(ImageEffect* instance,
-                              const OfxRectI & renderWindow,
-                              const PIX* srcPixelData,
-                              const OfxRectI & srcBounds,
-                              int srcRowBytes,
-                              unsigned int maxLevel,
-                              MipMapsVector & mipmaps)
+ofxsBuildMipMapsForDepth(const void* srcPixelData,
+                         PixelComponentEnum srcPixelComponents,
+                         const OfxRectI & srcBounds,
+                         int srcRowBytes,
+                         MipMapsVector & mipmaps)
 {
-    assert(srcPixelData);
-    if (!srcPixelData) {
-        throwSuiteStatusException(kOfxStatFailed);
-    }
-    const PIX* previousImg = srcPixelData;
-    OfxRectI previousBounds = srcBounds;
-    int previousRowBytes = srcRowBytes;
-    OfxRectI nextRenderWindow = renderWindow;
-
-    ///Build all the mipmap levels until we reach the one we are interested in
-    for (unsigned int i = 1; i <= maxLevel; ++i) {
-        // loop invariant:
-        // - previousImg, previousBounds, previousRowBytes describe the data ate the level before i
-        // - nextRenderWindow contains the renderWindow at the level before i
-        //
-        ///Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
-        nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-#     ifdef DEBUG
-        {
-            // check that doing i times 1 level is the same as doing i levels
-            OfxRectI nrw = downscalePowerOfTwoSmallestEnclosing(renderWindowFullRes, i);
-            assert(nrw.x1 == nextRenderWindow.x1 && nrw.x2 == nextRenderWindow.x2 && nrw.y1 == nextRenderWindow.y1 && nrw.y2 == nextRenderWindow.y2);
-        }
-#     endif
-        assert(i - 1 >= 0);
-
-        ///Allocate a temporary image if necessary, or reuse the previously allocated buffer
-        int nextRowBytes = (nextRenderWindow.x2 - nextRenderWindow.x1)  * nComponents * sizeof(PIX);
-        mipmaps[i - 1].memSize = (nextRenderWindow.y2 - nextRenderWindow.y1) * nextRowBytes;
-        mipmaps[i - 1].bounds = nextRenderWindow;
-
-        mipmaps[i - 1].data = new ImageMemory(mipmaps[i - 1].memSize, instance);
-        tmpMemSize = newMemSize;
-
-        float* nextImg = (float*)tmpMem->lock();
-
-        halveWindow<PIX, nComponents>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, nextImg, nextRenderWindow, nextRowBytes);
-
-        ///Switch for next pass
-        previousBounds = nextRenderWindow;
-        previousRowBytes = nextRowBytes;
-        previousImg = nextImg;
+    if (srcPixelComponents == ePixelComponentRGBA) {
+        ofxsBuildMipMapsForComponents<PIX, 4>( (const PIX*)srcPixelData, srcBounds, srcRowBytes, mipmaps );
+    } else if (srcPixelComponents == ePixelComponentRGB) {
+        ofxsBuildMipMapsForComponents<PIX, 3>( (const PIX*)srcPixelData, srcBounds, srcRowBytes, mipmaps );
+    }  else if (srcPixelComponents == ePixelComponentAlpha) {
+        ofxsBuildMipMapsForComponents<PIX, 1>( (const PIX*)srcPixelData, srcBounds, srcRowBytes, mipmaps );
     }
 }
 
@@ -282,28 +761,303 @@ ofxsBuildMipMaps(ImageEffect* instance,
                  unsigned int maxLevel,
                  MipMapsVector & mipmaps)
 {
-    assert(srcPixelData && mipmaps->size() == maxLevel);
-    if ( !srcPixelData || (mipmaps->size() != maxLevel) ) {
+    assert(srcPixelData);
+    if (!srcPixelData) {
         throwSuiteStatusException(kOfxStatFailed);
     }
 
     // do the rendering
-    if ( srcPixelData && ( ( srcPixelDepth != eBitDepthFloat) ||
-                           ( ( srcPixelComponents != ePixelComponentRGBA) &&
-                             ( srcPixelComponents != ePixelComponentRGB) &&
-                             ( srcPixelComponents != ePixelComponentAlpha) ) ) ) {
+    if ( ( ( srcPixelDepth != eBitDepthUByte) &&
+           ( srcPixelDepth != eBitDepthUShort) &&
+           ( srcPixelDepth != eBitDepthHalf) &&
+           ( srcPixelDepth != eBitDepthFloat) ) ||
+         ( ( srcPixelComponents != ePixelComponentRGBA) &&
+           ( srcPixelComponents != ePixelComponentRGB) &&
+           ( srcPixelComponents != ePixelComponentAlpha) ) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+
+    // all levels are allocated in a single block, which is reused if possible
+    mipmaps.allocate(instance, renderWindow, maxLevel, srcPixelComponents, srcPixelDepth);
+
+    switch (srcPixelDepth) {
+    case eBitDepthUByte:
+        ofxsBuildMipMapsForDepth<unsigned char>(srcPixelData, srcPixelComponents, srcBounds, srcRowBytes, mipmaps);
+        break;
+    case eBitDepthUShort:
+        ofxsBuildMipMapsForDepth<unsigned short>(srcPixelData, srcPixelComponents, srcBounds, srcRowBytes, mipmaps);
+        break;
+    case eBitDepthHalf:
+        ofxsBuildMipMapsForDepth<MipMapHalf>(srcPixelData, srcPixelComponents, srcBounds, srcRowBytes, mipmaps);
+        break;
+    case eBitDepthFloat:
+        ofxsBuildMipMapsForDepth<float>(srcPixelData, srcPixelComponents, srcBounds, srcRowBytes, mipmaps);
+        break;
+    default:
         throwSuiteStatusException(kOfxStatErrFormat);
     }
+}
+
+// the source pixels covered by each destination pixel along one axis, and their weights
+struct AreaScaleWeights
+{
+    std::vector<int> first; // first source pixel of each destination pixel
+    std::vector<int> count; // number of source pixels of each destination pixel
+    std::vector<int> offset; // index in weights of the weight of the first source pixel
+    std::vector<float> weights; // normalized weights
+    int maxCount;
+};
+
+// Destination pixel x covers the source interval [x/scale, (x+1)/scale), and the weight of each
+// source pixel is the length of its intersection with that interval. Source pixels outside of
+// [src1, src2) are ignored, and the weights are normalized so that they sum to 1.
+static void
+computeAreaScaleWeights(int dst1,
+                        int dst2,
+                        double scale,
+                        int src1,
+                        int src2,
+                        AreaScaleWeights* w)
+{
+    // ignore intersections shorter than eps, which come from rounding errors
+    const double eps = 1e-6;
+    const int n = std::max(0, dst2 - dst1);
+
+    w->first.resize(n);
+    w->count.resize(n);
+    w->offset.resize(n);
+    w->weights.clear();
+    w->maxCount = 0;
+    for (int j = 0; j < n; ++j) {
+        const double a = (dst1 + j) / scale;
+        const double b = (dst1 + j + 1) / scale;
+        const int i1 = std::max( src1, (int)std::floor(a + eps) );
+        const int i2 = std::min( src2, (int)std::ceil(b - eps) );
+        double sum = 0.;
+        for (int i = i1; i < i2; ++i) {
+            sum += std::min(i + 1., b) - std::max( (double)i, a );
+        }
+        w->first[j] = i1;
+        w->count[j] = (sum > 0.) ? (i2 - i1) : 0;
+        w->offset[j] = (int)w->weights.size();
+        for (int i = i1; i < i1 + w->count[j]; ++i) {
+            w->weights.push_back( (float)( ( std::min(i + 1., b) - std::max( (double)i, a ) ) / sum ) );
+        }
+        w->maxCount = std::max(w->maxCount, w->count[j]);
+    }
+}
+
+// Separable area resampling: each thread processes a band of destination rows.
+// Source rows are first filtered horizontally into a ring buffer of maxCount rows,
+// and the destination rows are then computed by filtering the ring buffer vertically.
+// Each source row is filtered horizontally only once per thread.
+template <typename PIX, int nComponents>
+class AreaScaleProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    AreaScaleProcessor(const OfxRectI & renderWindow,
+                       double scaleX,
+                       double scaleY,
+                       const PIX* srcPixels,
+                       const OfxRectI & srcBounds,
+                       int srcRowBytes,
+                       PIX* dstPixels,
+                       const OfxRectI & dstBounds,
+                       int dstRowBytes)
+        : _renderWindow(renderWindow)
+        , _srcPixels(srcPixels)
+        , _srcBounds(srcBounds)
+        , _srcRowSize(srcRowBytes / (int)sizeof(PIX))
+        , _dstPixels(dstPixels)
+        , _dstBounds(dstBounds)
+        , _dstRowSize(dstRowBytes / (int)sizeof(PIX))
+    {
+        computeAreaScaleWeights(renderWindow.x1, renderWindow.x2, scaleX, srcBounds.x1, srcBounds.x2, &_weightsX);
+        computeAreaScaleWeights(renderWindow.y1, renderWindow.y2, scaleY, srcBounds.y1, srcBounds.y2, &_weightsY);
+    }
+
+    void process()
+    {
+        if ( (_renderWindow.x1 >= _renderWindow.x2) || (_renderWindow.y1 >= _renderWindow.y2) ) {
+            return;
+        }
+        // make sure there are at least 4096 source pixels per CPU and at least 1 line par CPU
+        const double srcPixelsPerRow = (double)(_renderWindow.x2 - _renderWindow.x1) * std::max(1, _weightsX.maxCount) * std::max(1, _weightsY.maxCount);
+        unsigned int nCPUs = (unsigned int)std::min( (double)(_renderWindow.y2 - _renderWindow.y1), srcPixelsPerRow * (_renderWindow.y2 - _renderWindow.y1) / 4096 );
+        // make sure the number of CPUs is valid (and use at least 1 CPU)
+        nCPUs = std::max( 1u, std::min( nCPUs, OFX::MultiThread::getNumCPUs() ) );
+
+        multiThread(nCPUs);
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        int y1, y2;
+
+        OFX::MultiThread::getThreadRange(threadId, nThreads, _renderWindow.y1, _renderWindow.y2, &y1, &y2);
+        if (y2 <= y1) {
+            return;
+        }
+
+        typedef MipMapTraits<PIX> Traits;
+        const int width = _renderWindow.x2 - _renderWindow.x1;
+        const int rowSize = width * nComponents;
+        const int ringRows = std::max(1, _weightsY.maxCount);
+        // the horizontally filtered source rows, and which source row each slot contains
+        std::vector<float> ring( (std::size_t)ringRows * rowSize );
+        std::vector<int> ringRow(ringRows, _srcBounds.y1 - 1);
+        std::vector<float> acc(rowSize);
 
+        for (int y = y1; y < y2; ++y) {
+            const int j = y - _renderWindow.y1;
+            const int first = _weightsY.first[j];
+            const int count = _weightsY.count[j];
+            const float* wy = count ? &_weightsY.weights[_weightsY.offset[j]] : NULL;
+
+            std::fill( acc.begin(), acc.end(), 0.f );
+            for (int k = 0; k < count; ++k) {
+                const int sy = first + k;
+                const int slot = ( (sy % ringRows) + ringRows ) % ringRows;
+                float* hRow = &ring[(std::size_t)slot * rowSize];
+                if (ringRow[slot] != sy) {
+                    // horizontal pass
+                    const PIX* srcRow = _srcPixels + (std::ptrdiff_t)(sy - _srcBounds.y1) * _srcRowSize;
+                    for (int i = 0; i < width; ++i) {
+                        const int n = _weightsX.count[i];
+                        const float* wx = n ? &_weightsX.weights[_weightsX.offset[i]] : NULL;
+                        const PIX* srcPix = srcRow + (_weightsX.first[i] - _srcBounds.x1) * nComponents;
+                        float* h = hRow + i * nComponents;
+                        for (int c = 0; c < nComponents; ++c) {
+                            h[c] = 0.f;
+                        }
+                        for (int l = 0; l < n; ++l, srcPix += nComponents) {
+                            for (int c = 0; c < nComponents; ++c) {
+                                h[c] += wx[l] * Traits::toFloat(srcPix[c]);
+                            }
+                        }
+                    }
+                    ringRow[slot] = sy;
+                }
+                // vertical pass
+                const float w = wy[k];
+                for (int i = 0; i < rowSize; ++i) {
+                    acc[i] += w * hRow[i];
+                }
+            }
+
+            PIX* dstRow = _dstPixels + (std::ptrdiff_t)(y - _dstBounds.y1) * _dstRowSize + (_renderWindow.x1 - _dstBounds.x1) * nComponents;
+            for (int i = 0; i < rowSize; ++i) {
+                dstRow[i] = Traits::fromFloat(acc[i]);
+            }
+        }
+    } // multiThreadFunction
+
+    const OfxRectI _renderWindow;
+    const PIX* const _srcPixels;
+    const OfxRectI _srcBounds;
+    const int _srcRowSize;
+    PIX* const _dstPixels;
+    const OfxRectI _dstBounds;
+    const int _dstRowSize;
+    AreaScaleWeights _weightsX;
+    AreaScaleWeights _weightsY;
+};
+
+template <typename PIX>
+static void
+ofxsAreaScalePixelDataForDepth(const OfxRectI & renderWindow,
+                               double scaleX,
+                               double scaleY,
+                               const void* srcPixelData,
+                               const OfxRectI & srcBounds,
+                               int srcRowBytes,
+                               void* dstPixelData,
+                               PixelComponentEnum dstPixelComponents,
+                               const OfxRectI & dstBounds,
+                               int dstRowBytes)
+{
     if (dstPixelComponents == ePixelComponentRGBA) {
-        ofxsBuildMipMapsForComponents<float, 4>(instance, renderWindow, srcPixelData, srcBounds,
-                                                srcRowBytes, maxLevel, mipmaps);
+        AreaScaleProcessor<PIX, 4> processor(renderWindow, scaleX, scaleY, (const PIX*)srcPixelData, srcBounds, srcRowBytes,
+                                             (PIX*)dstPixelData, dstBounds, dstRowBytes);
+        processor.process();
     } else if (dstPixelComponents == ePixelComponentRGB) {
-        ofxsBuildMipMapsForComponents<float, 3>(instance, renderWindow, srcPixelData, srcBounds,
-                                                srcRowBytes, maxLevel, mipmaps);
+        AreaScaleProcessor<PIX, 3> processor(renderWindow, scaleX, scaleY, (const PIX*)srcPixelData, srcBounds, srcRowBytes,
+                                             (PIX*)dstPixelData, dstBounds, dstRowBytes);
+        processor.process();
     }  else if (dstPixelComponents == ePixelComponentAlpha) {
-        ofxsBuildMipMapsForComponents<float, 1>(instance, renderWindow, srcPixelData, srcBounds,
-                                                srcRowBytes, maxLevel, mipmaps);
+        AreaScaleProcessor<PIX, 1> processor(renderWindow, scaleX, scaleY, (const PIX*)srcPixelData, srcBounds, srcRowBytes,
+                                             (PIX*)dstPixelData, dstBounds, dstRowBytes);
+        processor.process();
     }
 }
+
+void
+ofxsAreaScalePixelData(ImageEffect* instance,
+                       const OfxRectI & renderWindow,
+                       double scaleX,
+                       double scaleY,
+                       const void* srcPixelData,
+                       PixelComponentEnum srcPixelComponents,
+                       BitDepthEnum srcPixelDepth,
+                       const OfxRectI & srcBounds,
+                       int srcRowBytes,
+                       void* dstPixelData,
+                       PixelComponentEnum dstPixelComponents,
+                       BitDepthEnum dstPixelDepth,
+                       const OfxRectI & dstBounds,
+                       int dstRowBytes)
+{
+    (void)instance;
+    assert(srcPixelData && dstPixelData);
+    if (!srcPixelData || !dstPixelData) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+    assert(scaleX > 0. && scaleY > 0.);
+    if ( !(scaleX > 0.) || !(scaleY > 0.) ) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    // do the rendering
+    if ( ( ( dstPixelDepth != eBitDepthUByte) &&
+           ( dstPixelDepth != eBitDepthUShort) &&
+           ( dstPixelDepth != eBitDepthHalf) &&
+           ( dstPixelDepth != eBitDepthFloat) ) ||
+         ( ( dstPixelComponents != ePixelComponentRGBA) &&
+           ( dstPixelComponents != ePixelComponentRGB) &&
+           ( dstPixelComponents != ePixelComponentAlpha) ) ||
+         ( dstPixelDepth != srcPixelDepth) ||
+         ( dstPixelComponents != srcPixelComponents) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+    assert(dstBounds.x1 <= renderWindow.x1 && renderWindow.x2 <= dstBounds.x2 &&
+           dstBounds.y1 <= renderWindow.y1 && renderWindow.y2 <= dstBounds.y2);
+    if ( (renderWindow.x1 < dstBounds.x1) || (dstBounds.x2 < renderWindow.x2) ||
+         (renderWindow.y1 < dstBounds.y1) || (dstBounds.y2 < renderWindow.y2) ) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    switch (dstPixelDepth) {
+    case eBitDepthUByte:
+        ofxsAreaScalePixelDataForDepth<unsigned char>(renderWindow, scaleX, scaleY, srcPixelData, srcBounds, srcRowBytes,
+                                                      dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        ofxsAreaScalePixelDataForDepth<unsigned short>(renderWindow, scaleX, scaleY, srcPixelData, srcBounds, srcRowBytes,
+                                                       dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    case eBitDepthHalf:
+        ofxsAreaScalePixelDataForDepth<MipMapHalf>(renderWindow, scaleX, scaleY, srcPixelData, srcBounds, srcRowBytes,
+                                                   dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        ofxsAreaScalePixelDataForDepth<float>(renderWindow, scaleX, scaleY, srcPixelData, srcBounds, srcRowBytes,
+                                              dstPixelData, dstPixelComponents, dstBounds, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+} // ofxsAreaScalePixelData
 } // OFX
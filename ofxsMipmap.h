@@ -26,8 +26,12 @@
 #include <cmath>
 #include <cassert>
 #include <vector>
+#include <list>
+#include <map>
+#include <algorithm>
 
 #include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
 
 namespace OFX {
 void ofxsScalePixelData(OFX::ImageEffect* instance,
@@ -45,34 +49,137 @@ void ofxsScalePixelData(OFX::ImageEffect* instance,
                         const OfxRectI & dstBounds,
                         int dstRowBytes);
 
+/**
+   @brief Scale the source image by arbitrary ratios, using area resampling: each pixel of
+   renderWindow is the average of the source pixels it covers, weighted by their coverage.
+   Destination pixel (x,y) covers the source area [x/scaleX, (x+1)/scaleX) x [y/scaleY, (y+1)/scaleY),
+   in pixel coordinates. Source pixels outside of srcBounds are not taken into account.
+   This is meant for downscaling (0 < scale <= 1), e.g. for proxies at a non-power-of-two scale.
+   Source and destination must have the same components and depth (ubyte, ushort, half or float).
+ **/
+void ofxsAreaScalePixelData(OFX::ImageEffect* instance,
+                            const OfxRectI & renderWindow,
+                            double scaleX,
+                            double scaleY,
+                            const void* srcPixelData,
+                            OFX::PixelComponentEnum srcPixelComponents,
+                            OFX::BitDepthEnum srcPixelDepth,
+                            const OfxRectI & srcBounds,
+                            int srcRowBytes,
+                            void* dstPixelData,
+                            OFX::PixelComponentEnum dstPixelComponents,
+                            OFX::BitDepthEnum dstPixelDepth,
+                            const OfxRectI & dstBounds,
+                            int dstRowBytes);
+
+// A view on one level of a mipmap pyramid. The pixel data is owned by the MipMapsVector
+// it belongs to, and stays valid until the MipMapsVector is cleared, reallocated or destroyed.
 struct MipMap
 {
-    std::size_t memSize;
-    OFX::ImageMemory* data;
+    std::size_t memSize; // size of the level, including row padding
+    void* data; // address of pixel (bounds.x1, bounds.y1)
     OfxRectI bounds;
+    int rowBytes; // always a multiple of kOfxsMipMapAlignment
+    int pixelBytes;
 
     MipMap()
         : memSize(0)
         , data(NULL)
         , bounds()
+        , rowBytes(0)
+        , pixelBytes(0)
     {
     }
 
-    ~MipMap()
+    void* getPixelAddress(int x,
+                          int y) const
     {
-        delete data;
-        data = 0;
+        if ( !data || (x < bounds.x1) || (x >= bounds.x2) || (y < bounds.y1) || (y >= bounds.y2) ) {
+            return NULL;
+        }
+
+        return (char*)data + (std::size_t)(y - bounds.y1) * rowBytes + (std::size_t)(x - bounds.x1) * pixelBytes;
     }
 };
 
-//Contains all levels of details > 0, sort by decreasing LoD
-typedef std::vector<MipMap> MipMapsVector;
+// alignment of each level and of each row in a MipMapsVector, in bytes
+#define kOfxsMipMapAlignment 32
+
+// Contains all levels of details > 0, sorted by decreasing LoD.
+// All levels are allocated in a single ImageMemory block, which is kept locked for
+// the lifetime of the MipMapsVector, so that the levels may be sampled by several passes
+// of a render without being rebuilt. Calling allocate() again with a pyramid that fits in
+// the current block reuses it.
+class MipMapsVector
+{
+public:
+    MipMapsVector()
+        : _mem(NULL)
+        , _memSize(0)
+        , _memData(NULL)
+        , _levels()
+        , _renderWindow()
+        , _pixelComponents(ePixelComponentNone)
+        , _pixelDepth(eBitDepthNone)
+    {
+    }
+
+    ~MipMapsVector()
+    {
+        clear();
+    }
+
+    /// allocate (or reuse) the memory for levels 1..maxLevel of renderWindow
+    void allocate(OFX::ImageEffect* instance,
+                  const OfxRectI & renderWindow,
+                  unsigned int maxLevel,
+                  OFX::PixelComponentEnum pixelComponents,
+                  OFX::BitDepthEnum pixelDepth);
+
+    /// release the memory
+    void clear();
+
+    std::size_t size() const { return _levels.size(); }
+
+    bool empty() const { return _levels.empty(); }
+
+    /// level i+1 of the pyramid
+    const MipMap & operator[](std::size_t i) const { assert( i < _levels.size() ); return _levels[i]; }
+
+    MipMap & operator[](std::size_t i) { assert( i < _levels.size() ); return _levels[i]; }
+
+    /// the render window at level 0 that was used to build the pyramid
+    const OfxRectI & getRenderWindow() const { return _renderWindow; }
+
+    OFX::PixelComponentEnum getPixelComponents() const { return _pixelComponents; }
+
+    OFX::BitDepthEnum getPixelDepth() const { return _pixelDepth; }
+
+    /// total size of the memory block
+    std::size_t getMemSize() const { return _memSize; }
+
+private:
+    // non-copyable: the levels point into _mem
+    MipMapsVector(const MipMapsVector &);
+    MipMapsVector & operator=(const MipMapsVector &);
+
+    OFX::ImageMemory* _mem;
+    std::size_t _memSize;
+    char* _memData; // locked and aligned start of _mem
+    std::vector<MipMap> _levels;
+    OfxRectI _renderWindow;
+    OFX::PixelComponentEnum _pixelComponents;
+    OFX::BitDepthEnum _pixelDepth;
+};
 
 /**
    @brief Given the original image, this function builds all mipmap levels
    up to maxLevel and stores them in the mipmaps vector, in decreasing LoD.
    The original image will not be stored in the mipmaps vector.
-   @param mipmaps[out] The mipmaps vector should contains at least maxLevel
+   Level i covers the smallest power-of-two enclosing rectangle of renderWindow at that level.
+   The levels are stored in the depth of the source image (ubyte, ushort, half or float): integer
+   averages are rounded to nearest, and half-floats are averaged as floats.
+   @param mipmaps[out] The mipmaps vector, which is (re)allocated to contain exactly maxLevel
    entries
  **/
 void ofxsBuildMipMaps(OFX::ImageEffect* instance,
@@ -84,6 +191,346 @@ void ofxsBuildMipMaps(OFX::ImageEffect* instance,
                       int srcRowBytes,
                       unsigned int maxLevel,
                       MipMapsVector & mipmaps);
+
+// A cache of mipmap pyramids, shared by all the instances of the plug-ins in the process, so that
+// a pyramid built by one effect can be reused by another during the same render.
+// As for LutManager, the MipMapCache object should be constructed in the plugin factory's load()
+// function, and destructed in the unload() function.
+// A pyramid is identified by its source image, the source bounds, components and depth, and the render
+// window. The source image is either an identity (e.g. a hash of the pixel data or of the clip name and
+// time, see hashPixelData()), which is used when it is nonzero, or else the address of the pixel data and
+// the row bytes. A pyramid with more levels also serves requests for fewer levels.
+// At most maxBytes of pyramids are kept: when over budget, the least recently used pyramids which
+// are not in use are evicted. The pyramids are allocated as ImageMemory with no associated effect,
+// so that they do not depend on the lifetime of the instance which built them.
+template <class MUTEX>
+class MipMapCache
+{
+    typedef OFX::MultiThread::AutoMutexT<MUTEX> AutoMutex;
+
+    struct Key
+    {
+        unsigned long long identity;
+        const void* data;
+        OfxRectI bounds;
+        int rowBytes;
+        OfxRectI renderWindow;
+        int components;
+        int depth;
+
+        // with a nonzero identity, the pixel data address and row bytes are not part of the key,
+        // so that buffers with the same contents share their pyramid
+        bool operator<(const Key & other) const
+        {
+            if (identity != other.identity) {
+                return identity < other.identity;
+            }
+            if (identity == 0) {
+                if (data != other.data) {
+                    return data < other.data;
+                }
+                if (rowBytes != other.rowBytes) {
+                    return rowBytes < other.rowBytes;
+                }
+            }
+            const int a[10] = {
+                bounds.x1, bounds.y1, bounds.x2, bounds.y2,
+                renderWindow.x1, renderWindow.y1, renderWindow.x2, renderWindow.y2, components, depth
+            };
+            const int b[10] = {
+                other.bounds.x1, other.bounds.y1, other.bounds.x2, other.bounds.y2,
+                other.renderWindow.x1, other.renderWindow.y1, other.renderWindow.x2, other.renderWindow.y2, other.components, other.depth
+            };
+
+            return std::lexicographical_compare(a, a + 10, b, b + 10);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        MipMapsVector* mipmaps;
+        unsigned int refCount;
+        bool detached; // replaced by a larger pyramid, or invalidated while in use: deleted on release
+    };
+
+    typedef std::list<Entry> EntryList; // most recently used first
+    typedef std::map<Key, typename EntryList::iterator> EntryMap;
+
+public:
+    struct Stats
+    {
+        std::size_t hits;
+        std::size_t misses;
+        std::size_t evictions;
+        std::size_t entries;
+        std::size_t bytes;
+    };
+
+    explicit MipMapCache(std::size_t maxBytes)
+        : _lock()
+        , _entries()
+        , _map()
+        , _maxBytes(maxBytes)
+        , _bytes(0)
+        , _hits(0)
+        , _misses(0)
+        , _evictions(0)
+    {
+    }
+
+    ~MipMapCache()
+    {
+        // all pyramids should have been released
+        for (typename EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            assert(it->refCount == 0);
+            delete it->mipmaps;
+        }
+    }
+
+    /**
+     * @brief Returns the pyramid of levels 1..maxLevel of renderWindow (see ofxsBuildMipMaps()),
+     * building it if it is not in the cache. The returned pyramid may have more than maxLevel levels.
+     * Ownership remains to the MipMapCache: the pyramid is valid until it is released with release(),
+     * which must be called exactly once for each call to acquire().
+     **/
+    const MipMapsVector* acquire(unsigned long long identity,
+                                 const OfxRectI & renderWindow,
+                                 const void* srcPixelData,
+                                 OFX::PixelComponentEnum srcPixelComponents,
+                                 OFX::BitDepthEnum srcPixelDepth,
+                                 const OfxRectI & srcBounds,
+                                 int srcRowBytes,
+                                 unsigned int maxLevel)
+    {
+        Key key;
+
+        key.identity = identity;
+        key.data = srcPixelData;
+        key.bounds = srcBounds;
+        key.rowBytes = srcRowBytes;
+        key.renderWindow = renderWindow;
+        key.components = (int)srcPixelComponents;
+        key.depth = (int)srcPixelDepth;
+        {
+            AutoMutex l(_lock);
+            typename EntryMap::iterator found = _map.find(key);
+            if ( ( found != _map.end() ) && (found->second->mipmaps->size() >= maxLevel) ) {
+                ++_hits;
+                ++found->second->refCount;
+                _entries.splice( _entries.begin(), _entries, found->second );
+
+                return found->second->mipmaps;
+            }
+            ++_misses;
+        }
+
+        // build the pyramid without holding the lock
+        MipMapsVector* mipmaps = new MipMapsVector;
+        try {
+            ofxsBuildMipMaps(NULL, renderWindow, srcPixelData, srcPixelComponents, srcPixelDepth, srcBounds, srcRowBytes, maxLevel, *mipmaps);
+        } catch (...) {
+            delete mipmaps;
+            throw;
+        }
+
+        AutoMutex l(_lock);
+        typename EntryMap::iterator found = _map.find(key);
+        if ( found != _map.end() ) {
+            if (found->second->mipmaps->size() >= maxLevel) {
+                // another thread built it in the meantime
+                delete mipmaps;
+                ++found->second->refCount;
+                _entries.splice( _entries.begin(), _entries, found->second );
+
+                return found->second->mipmaps;
+            }
+            // replace the smaller pyramid
+            detach(found->second);
+            _map.erase(found);
+        }
+        Entry entry;
+        entry.key = key;
+        entry.mipmaps = mipmaps;
+        entry.refCount = 1;
+        entry.detached = false;
+        _entries.push_front(entry);
+        _map[key] = _entries.begin();
+        _bytes += mipmaps->getMemSize();
+        evict();
+
+        return mipmaps;
+    } // acquire
+
+    /**
+     * @brief Release a pyramid previously returned by acquire()
+     **/
+    void release(const MipMapsVector* mipmaps)
+    {
+        AutoMutex l(_lock);
+
+        for (typename EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->mipmaps == mipmaps) {
+                assert(it->refCount > 0);
+                --it->refCount;
+                if ( (it->refCount == 0) && it->detached ) {
+                    erase(it);
+                }
+                evict();
+
+                return;
+            }
+        }
+        assert(false); // not acquired from this cache
+    }
+
+    /**
+     * @brief Remove all the pyramids built from srcPixelData without an identity, e.g. before the source
+     * image is released. Pyramids which are in use are deleted when they are released.
+     * Pyramids with an identity do not depend on the pixel data address, and are not removed.
+     **/
+    void invalidate(const void* srcPixelData)
+    {
+        AutoMutex l(_lock);
+
+        for (typename EntryList::iterator it = _entries.begin(); it != _entries.end(); ) {
+            typename EntryList::iterator next = it;
+            ++next;
+            if ( (it->key.identity == 0) && (it->key.data == srcPixelData) && !it->detached ) {
+                _map.erase(it->key);
+                detach(it);
+            }
+            it = next;
+        }
+    }
+
+    /**
+     * @brief Remove all the pyramids which are not in use.
+     **/
+    void clear()
+    {
+        AutoMutex l(_lock);
+
+        for (typename EntryList::iterator it = _entries.begin(); it != _entries.end(); ) {
+            typename EntryList::iterator next = it;
+            ++next;
+            if (it->refCount == 0) {
+                _map.erase(it->key);
+                erase(it);
+                ++_evictions;
+            }
+            it = next;
+        }
+    }
+
+    void setMaxBytes(std::size_t maxBytes)
+    {
+        AutoMutex l(_lock);
+
+        _maxBytes = maxBytes;
+        evict();
+    }
+
+    std::size_t getMaxBytes() const
+    {
+        AutoMutex l(_lock);
+
+        return _maxBytes;
+    }
+
+    Stats getStats() const
+    {
+        AutoMutex l(_lock);
+        Stats stats;
+
+        stats.hits = _hits;
+        stats.misses = _misses;
+        stats.evictions = _evictions;
+        stats.entries = _entries.size();
+        stats.bytes = _bytes;
+
+        return stats;
+    }
+
+    void resetStats()
+    {
+        AutoMutex l(_lock);
+
+        _hits = _misses = _evictions = 0;
+    }
+
+    /**
+     * @brief A 64-bit FNV-1a hash of the pixels of an image, which can be used as the identity
+     * of a source image whose pixel data address may be reused for different contents.
+     **/
+    static unsigned long long hashPixelData(const void* pixelData,
+                                            const OfxRectI & bounds,
+                                            int rowBytes,
+                                            int pixelBytes)
+    {
+        unsigned long long h = 14695981039346656037ULL;
+        const std::size_t lineBytes = (std::size_t)std::max(0, bounds.x2 - bounds.x1) * pixelBytes;
+
+        for (int y = bounds.y1; y < bounds.y2; ++y) {
+            const unsigned char* p = (const unsigned char*)pixelData + (std::size_t)(y - bounds.y1) * rowBytes;
+            for (std::size_t i = 0; i < lineBytes; ++i) {
+                h = (h ^ p[i]) * 1099511628211ULL;
+            }
+        }
+
+        return h;
+    }
+
+private:
+    // the following functions must be called with _lock held
+
+    // remove an entry from the map: it is deleted now if unused, or else when released
+    void detach(typename EntryList::iterator it)
+    {
+        if (it->refCount == 0) {
+            erase(it);
+        } else {
+            it->detached = true;
+        }
+    }
+
+    void erase(typename EntryList::iterator it)
+    {
+        _bytes -= it->mipmaps->getMemSize();
+        delete it->mipmaps;
+        _entries.erase(it);
+    }
+
+    // evict the least recently used pyramids which are not in use, until the cache is within budget
+    void evict()
+    {
+        typename EntryList::iterator it = _entries.end();
+
+        while ( (_bytes > _maxBytes) && ( it != _entries.begin() ) ) {
+            --it;
+            if ( (it->refCount == 0) && !it->detached ) {
+                typename EntryList::iterator prev = it;
+                ++prev;
+                _map.erase(it->key);
+                erase(it);
+                ++_evictions;
+                it = prev;
+            }
+        }
+    }
+
+    mutable MUTEX _lock;
+    EntryList _entries;
+    EntryMap _map;
+    std::size_t _maxBytes;
+    std::size_t _bytes;
+    std::size_t _hits;
+    std::size_t _misses;
+    std::size_t _evictions;
+
+    MipMapCache &operator= (const MipMapCache &);
+    MipMapCache(const MipMapCache &);
+};
 } // OFX
 
 #endif // ifndef openfx_supportext_ofxsMipmap_h
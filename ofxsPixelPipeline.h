@@ -0,0 +1,562 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+
+#ifndef openfx_supportext_ofxsPixelPipeline_h
+#define openfx_supportext_ofxsPixelPipeline_h
+
+/*
+ * ofxsPixelPipeline: run a chain of PixelProcessors tile by tile
+ */
+
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <typeinfo>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+#include "ofxsPixelProcessor.h"
+#include "ofxsProcessorTuning.h"
+#include "ofxsScratchArena.h"
+#include "ofxsMacros.h"
+
+/** @file This file contains a pipeline which chains several PixelProcessors.
+
+   Instead of running each processor on the whole render window, one after the other, the pipeline
+   splits the render window into tiles of a few rows, and runs all the stages on each tile, so that
+   the intermediate images stay in the cache. Only the last stage writes to the destination image.
+
+   The first stage may be any processor which reads its source images as set by the caller (a
+   PixelProcessor, or e.g. a Transform3x3Processor), and writes into the first intermediate tile.
+   It must be copyable, and have public preProcess(), postProcess(), setRenderWindow() and
+   multiThreadProcessImages() functions, and a setDstImg() function taking a pixel buffer, as
+   PixelProcessor::setDstImg(). The following stages must be PixelProcessorFilterBase
+   processors which only read the pixel at the same position in their source image (copiers, mask/mix,
+   premult/unpremult, color conversions...): their source is set to the tile produced by the
+   previous stage.
+
+   The processors given to the pipeline are copied. Their render window is set to the one of the
+   pipeline, and their preProcess() and postProcess() functions are called on these prototypes,
+   before and after the tiles are processed. Each thread then makes
+   its own copy of each stage, and processes all its tiles with it, after setting its source and
+   destination.
+
+   The number of threads and chunks is chosen from the sum of the pixel costs of the stages (see
+   ProcessorTuning). The time spent in each PixelProcessor stage is measured, and updates the cost
+   of its processor type.
+ */
+
+namespace OFX {
+// the size in bytes of the intermediate tiles, which should fit in the L2 cache together
+#define kPixelProcessorPipelineTileBytes (128 * 1024)
+
+// the estimated cost of a pixel of a stage (see ProcessorTuning), if it is a PixelProcessor
+inline double
+pixelProcessorPipelinePixelCost(const OFX::PixelProcessor* processor)
+{
+    return OFX::ProcessorTuning::getPixelCost( typeid(*processor).name(), processor->getPixelCostHint() );
+}
+
+inline double
+pixelProcessorPipelinePixelCost(const void* /*processor*/)
+{
+    return kOfxsProcessorTuningDefaultPixelCost;
+}
+
+// record the time spent by a stage to process a number of pixels (see ProcessorTuning), if it is a PixelProcessor
+inline void
+pixelProcessorPipelineAddMeasurement(const OFX::PixelProcessor* processor,
+                                     double busyMicroseconds,
+                                     double pixels)
+{
+    OFX::ProcessorTuning::addMeasurement(typeid(*processor).name(), busyMicroseconds, pixels);
+}
+
+inline void
+pixelProcessorPipelineAddMeasurement(const void* /*processor*/,
+                                     double /*busyMicroseconds*/,
+                                     double /*pixels*/)
+{
+}
+
+// release the scratch memory used by a stage for a tile, if it is a PixelProcessor
+inline void
+pixelProcessorPipelineResetScratch(OFX::PixelProcessor* processor)
+{
+    processor->resetScratchArenas();
+}
+
+inline void
+pixelProcessorPipelineResetScratch(void* /*processor*/)
+{
+}
+
+// a stage of the pipeline, with the format of the image it produces
+class PixelProcessorPipelineStage
+{
+public:
+    // a copy of the processor of a stage, which processes the tiles of a single thread
+    class Worker
+    {
+    public:
+        virtual ~Worker() {}
+
+        /** @brief process the window, reading from src (NULL for the first stage) and writing into dst */
+        virtual void processTile(const OfxRectI & window,
+                                 const void* srcPixelData,
+                                 const OfxRectI & srcBounds,
+                                 OFX::PixelComponentEnum srcPixelComponents,
+                                 int srcPixelComponentCount,
+                                 OFX::BitDepthEnum srcBitDepth,
+                                 int srcRowBytes,
+                                 void* dstPixelData,
+                                 const OfxRectI & dstBounds,
+                                 int dstRowBytes) = 0;
+    };
+
+    PixelProcessorPipelineStage(OFX::PixelComponentEnum dstPixelComponents,
+                                int dstPixelComponentCount,
+                                OFX::BitDepthEnum dstBitDepth)
+        : _dstPixelComponents(dstPixelComponents)
+        , _dstPixelComponentCount(dstPixelComponentCount)
+        , _dstBitDepth(dstBitDepth)
+        , _dstPixelBytes( dstPixelComponentCount * getComponentBytes(dstBitDepth) )
+    {
+    }
+
+    virtual ~PixelProcessorPipelineStage() {}
+
+    /** @brief set the render window of the processor, before preProcess() */
+    virtual void setRenderWindow(const OfxRectI & rect) = 0;
+    virtual void preProcess() = 0;
+    virtual void postProcess() = 0;
+
+    /** @brief the estimated time to process a pixel on one thread, in nanoseconds */
+    virtual double getPixelCost() const = 0;
+
+    /** @brief record the time spent by all threads in this stage (in microseconds) to process a number of pixels */
+    virtual void addMeasurement(double busyMicroseconds, double pixels) const = 0;
+
+    /** @brief a copy of the processor, to be deleted by the caller */
+    virtual Worker* createWorker() const = 0;
+
+    OFX::PixelComponentEnum _dstPixelComponents;
+    int _dstPixelComponentCount;
+    OFX::BitDepthEnum _dstBitDepth;
+    int _dstPixelBytes;
+};
+
+// the first stage: a processor which reads its own source images
+template <class PROCESSOR>
+class PixelProcessorPipelineSourceStage
+    : public PixelProcessorPipelineStage
+{
+    class SourceWorker
+        : public PixelProcessorPipelineStage::Worker
+    {
+    public:
+        SourceWorker(const PixelProcessorPipelineSourceStage & stage)
+            : _stage(stage)
+            , _processor(stage._processor)
+        {
+        }
+
+        virtual void processTile(const OfxRectI & window,
+                                 const void* /*srcPixelData*/,
+                                 const OfxRectI & /*srcBounds*/,
+                                 OFX::PixelComponentEnum /*srcPixelComponents*/,
+                                 int /*srcPixelComponentCount*/,
+                                 OFX::BitDepthEnum /*srcBitDepth*/,
+                                 int /*srcRowBytes*/,
+                                 void* dstPixelData,
+                                 const OfxRectI & dstBounds,
+                                 int dstRowBytes) OVERRIDE FINAL
+        {
+            _processor.setDstImg(dstPixelData, dstBounds, _stage._dstPixelComponents, _stage._dstPixelComponentCount, _stage._dstBitDepth, dstRowBytes);
+            _processor.setRenderWindow(window);
+            _processor.multiThreadProcessImages(window);
+            pixelProcessorPipelineResetScratch(&_processor);
+        }
+
+    private:
+        const PixelProcessorPipelineSourceStage & _stage;
+        PROCESSOR _processor;
+    };
+
+public:
+    PixelProcessorPipelineSourceStage(const PROCESSOR & processor,
+                                      OFX::PixelComponentEnum dstPixelComponents,
+                                      int dstPixelComponentCount,
+                                      OFX::BitDepthEnum dstBitDepth)
+        : PixelProcessorPipelineStage(dstPixelComponents, dstPixelComponentCount, dstBitDepth)
+        , _processor(processor)
+    {
+    }
+
+    virtual void setRenderWindow(const OfxRectI & rect) OVERRIDE FINAL { _processor.setRenderWindow(rect); }
+
+    virtual void preProcess() OVERRIDE FINAL { _processor.preProcess(); }
+
+    virtual void postProcess() OVERRIDE FINAL { _processor.postProcess(); }
+
+    virtual double getPixelCost() const OVERRIDE FINAL { return pixelProcessorPipelinePixelCost(&_processor); }
+
+    virtual void addMeasurement(double busyMicroseconds, double pixels) const OVERRIDE FINAL { pixelProcessorPipelineAddMeasurement(&_processor, busyMicroseconds, pixels); }
+
+    virtual Worker* createWorker() const OVERRIDE FINAL { return new SourceWorker(*this); }
+
+private:
+    PROCESSOR _processor;
+};
+
+// the following stages: a PixelProcessorFilterBase which reads the output of the previous stage
+template <class PROCESSOR>
+class PixelProcessorPipelineFilterStage
+    : public PixelProcessorPipelineStage
+{
+    class FilterWorker
+        : public PixelProcessorPipelineStage::Worker
+    {
+    public:
+        FilterWorker(const PixelProcessorPipelineFilterStage & stage)
+            : _stage(stage)
+            , _processor(stage._processor)
+        {
+        }
+
+        virtual void processTile(const OfxRectI & window,
+                                 const void* srcPixelData,
+                                 const OfxRectI & srcBounds,
+                                 OFX::PixelComponentEnum srcPixelComponents,
+                                 int srcPixelComponentCount,
+                                 OFX::BitDepthEnum srcBitDepth,
+                                 int srcRowBytes,
+                                 void* dstPixelData,
+                                 const OfxRectI & dstBounds,
+                                 int dstRowBytes) OVERRIDE FINAL
+        {
+            // the tile only contains the window: use black boundary conditions
+            _processor.setSrcImg(srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, 0);
+            _processor.setDstImg(dstPixelData, dstBounds, _stage._dstPixelComponents, _stage._dstPixelComponentCount, _stage._dstBitDepth, dstRowBytes);
+            _processor.setRenderWindow(window);
+            _processor.multiThreadProcessImages(window);
+            _processor.resetScratchArenas();
+        }
+
+    private:
+        const PixelProcessorPipelineFilterStage & _stage;
+        PROCESSOR _processor;
+    };
+
+public:
+    PixelProcessorPipelineFilterStage(const PROCESSOR & processor,
+                                      OFX::PixelComponentEnum dstPixelComponents,
+                                      int dstPixelComponentCount,
+                                      OFX::BitDepthEnum dstBitDepth)
+        : PixelProcessorPipelineStage(dstPixelComponents, dstPixelComponentCount, dstBitDepth)
+        , _processor(processor)
+    {
+    }
+
+    virtual void setRenderWindow(const OfxRectI & rect) OVERRIDE FINAL { _processor.setRenderWindow(rect); }
+
+    virtual void preProcess() OVERRIDE FINAL { _processor.preProcess(); }
+
+    virtual void postProcess() OVERRIDE FINAL { _processor.postProcess(); }
+
+    virtual double getPixelCost() const OVERRIDE FINAL { return pixelProcessorPipelinePixelCost(&_processor); }
+
+    virtual void addMeasurement(double busyMicroseconds, double pixels) const OVERRIDE FINAL { pixelProcessorPipelineAddMeasurement(&_processor, busyMicroseconds, pixels); }
+
+    virtual Worker* createWorker() const OVERRIDE FINAL { return new FilterWorker(*this); }
+
+private:
+    PROCESSOR _processor;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// a chain of PixelProcessors, processed tile by tile
+class PixelProcessorPipeline
+    : public OFX::MultiThread::Processor
+{
+public:
+    /** @brief ctor */
+    PixelProcessorPipeline(OFX::ImageEffect &effect)
+        : _effect(effect)
+        , _stages()
+        , _dstPixelData(NULL)
+        , _dstBounds()
+        , _dstPixelComponents(OFX::ePixelComponentNone)
+        , _dstPixelComponentCount(0)
+        , _dstBitDepth(OFX::eBitDepthNone)
+        , _dstRowBytes(0)
+        , _tileRows(1)
+        , _maxPixelBytes(0)
+        , _nChunks(0)
+        , _stageBusy()
+        , _scratchArenas()
+    {
+        _renderWindow.x1 = _renderWindow.y1 = _renderWindow.x2 = _renderWindow.y2 = 0;
+    }
+
+    virtual ~PixelProcessorPipeline()
+    {
+        for (std::size_t i = 0; i < _stages.size(); ++i) {
+            delete _stages[i];
+        }
+    }
+
+    /** @brief set the first stage, which must be added before the others. It is copied.
+        The format is the one of the image it produces, which is the format of the destination
+        image if it is the only stage. */
+    template <class PROCESSOR>
+    void addSourceStage(const PROCESSOR & processor,
+                        OFX::PixelComponentEnum dstPixelComponents,
+                        int dstPixelComponentCount,
+                        OFX::BitDepthEnum dstBitDepth)
+    {
+        assert( _stages.empty() );
+        _stages.push_back( new PixelProcessorPipelineSourceStage<PROCESSOR>(processor, dstPixelComponents, dstPixelComponentCount, dstBitDepth) );
+    }
+
+    /** @brief add a stage which reads the image produced by the previous stage. It is copied.
+        The format is the one of the image it produces, which is the format of the destination
+        image if it is the last stage. */
+    template <class PROCESSOR>
+    void addFilterStage(const PROCESSOR & processor,
+                        OFX::PixelComponentEnum dstPixelComponents,
+                        int dstPixelComponentCount,
+                        OFX::BitDepthEnum dstBitDepth)
+    {
+        assert( !_stages.empty() );
+        _stages.push_back( new PixelProcessorPipelineFilterStage<PROCESSOR>(processor, dstPixelComponents, dstPixelComponentCount, dstBitDepth) );
+    }
+
+    /** @brief set the destination image */
+    void setDstImg(OFX::Image *v)
+    {
+        _dstPixelData = v->getPixelData();
+        _dstBounds = v->getBounds();
+        _dstPixelComponents = v->getPixelComponents();
+        _dstPixelComponentCount = v->getPixelComponentCount();
+        _dstBitDepth = v->getPixelDepth();
+        _dstRowBytes = v->getRowBytes();
+    }
+
+    /** @brief set the destination image */
+    void setDstImg(void *dstPixelData,
+                   const OfxRectI & dstBounds,
+                   OFX::PixelComponentEnum dstPixelComponents,
+                   int dstPixelComponentCount,
+                   OFX::BitDepthEnum dstPixelDepth,
+                   int dstRowBytes)
+    {
+        _dstPixelData = dstPixelData;
+        _dstBounds = dstBounds;
+        _dstPixelComponents = dstPixelComponents;
+        _dstPixelComponentCount = dstPixelComponentCount;
+        _dstBitDepth = dstPixelDepth;
+        _dstRowBytes = dstRowBytes;
+    }
+
+    /** @brief reset the render window */
+    void setRenderWindow(OfxRectI rect)
+    {
+        _renderWindow = rect;
+    }
+
+    /** @brief called to process everything */
+    void process(void)
+    {
+        assert( !_stages.empty() );
+        assert( _dstPixelData &&
+                _dstBounds.x1 <= _renderWindow.x1 && _renderWindow.x2 <= _dstBounds.x2 &&
+                _dstBounds.y1 <= _renderWindow.y1 && _renderWindow.y2 <= _dstBounds.y2 );
+        // is it OK ?
+        if ( _stages.empty() || !_dstPixelData ||
+             !( ( _dstBounds.x1 <= _renderWindow.x1) && ( _renderWindow.x2 <= _dstBounds.x2) &&
+                ( _dstBounds.y1 <= _renderWindow.y1) && ( _renderWindow.y2 <= _dstBounds.y2) ) ||
+             (_renderWindow.x1 >= _renderWindow.x2) ||
+             (_renderWindow.y1 >= _renderWindow.y2) ) {
+            return;
+        }
+        assert(_stages.back()->_dstPixelComponents == _dstPixelComponents && _stages.back()->_dstBitDepth == _dstBitDepth);
+        if ( (_stages.back()->_dstPixelComponents != _dstPixelComponents) || (_stages.back()->_dstBitDepth != _dstBitDepth) ) {
+            throwSuiteStatusException(kOfxStatErrFormat);
+        }
+
+        // the intermediate tiles have the width of the render window, and as many rows as fit in kPixelProcessorPipelineTileBytes
+        _maxPixelBytes = 0;
+        for (std::size_t i = 0; i + 1 < _stages.size(); ++i) {
+            _maxPixelBytes = std::max(_maxPixelBytes, _stages[i]->_dstPixelBytes);
+        }
+        const int width = _renderWindow.x2 - _renderWindow.x1;
+        _tileRows = (_maxPixelBytes == 0) ? (_renderWindow.y2 - _renderWindow.y1) : std::max(1, kPixelProcessorPipelineTileBytes / (width * _maxPixelBytes) );
+
+        // call the pre MP pass, which may depend on the render window (e.g. to build a MaskOccupancy)
+        for (std::size_t i = 0; i < _stages.size(); ++i) {
+            _stages[i]->setRenderWindow(_renderWindow);
+            _stages[i]->preProcess();
+        }
+
+        // choose the number of threads and chunks from the cost of a pixel through all the stages
+        double pixelCost = 0.;
+        for (std::size_t i = 0; i < _stages.size(); ++i) {
+            pixelCost += _stages[i]->getPixelCost();
+        }
+        const OFX::ProcessorTuning::Plan plan = OFX::ProcessorTuning::plan(pixelCost,
+                                                                           width,
+                                                                           _renderWindow.y2 - _renderWindow.y1,
+                                                                           OFX::MultiThread::getNumCPUs() );
+        const unsigned int nCPUs = plan.nThreads;
+        _nChunks = plan.nChunks;
+        _stageBusy.assign(nCPUs * _stages.size(), 0.);
+
+        // the intermediate tiles are allocated from the scratch arena of each thread
+        _scratchArenas.resize(nCPUs, &_effect);
+
+        // call the base multi threading code
+        multiThread(nCPUs);
+
+        // the cost of each stage, measured in the pipeline, is used by the next renders with the
+        // same processor type (an aborted render did not process all pixels)
+        if ( !_effect.abort() ) {
+            const double pixels = (double)width * (_renderWindow.y2 - _renderWindow.y1);
+            for (std::size_t i = 0; i < _stages.size(); ++i) {
+                double busy = 0.;
+                for (std::size_t j = i; j < _stageBusy.size(); j += _stages.size()) {
+                    busy += _stageBusy[j];
+                }
+                _stages[i]->addMeasurement(busy, pixels);
+            }
+        }
+
+        // call the post MP pass
+        for (std::size_t i = 0; i < _stages.size(); ++i) {
+            _stages[i]->postProcess();
+        }
+
+        // keep the tile memory for the next render
+        _scratchArenas.reset();
+    } // process
+
+private:
+    /** @brief overridden from OFX::MultiThread::Processor. This function is called once on each SMP thread by the base class */
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        // two intermediate tiles: stage i reads one and writes the other
+        const int width = _renderWindow.x2 - _renderWindow.x1;
+        const std::size_t tileBytes = (std::size_t)width * _maxPixelBytes * _tileRows;
+        ScratchArena & arena = _scratchArenas.get(threadId);
+        void* tiles[2] = { arena.allocate(tileBytes), arena.allocate(tileBytes) };
+
+        // a copy of each stage for this thread, and the time it spends in each stage
+        std::vector<PixelProcessorPipelineStage::Worker*> workers( _stages.size(), (PixelProcessorPipelineStage::Worker*)NULL );
+        double* busy = ( (threadId + 1) * _stages.size() <= _stageBusy.size() ) ? &_stageBusy[threadId * _stages.size()] : NULL;
+        try {
+            for (std::size_t i = 0; i < _stages.size(); ++i) {
+                workers[i] = _stages[i]->createWorker();
+            }
+
+            // the render window is cut into chunks of rows, which are given to the threads in turn
+            const unsigned int nChunks = std::max(_nChunks, nThreads);
+            for (unsigned int chunk = threadId; chunk < nChunks && !_effect.abort(); chunk += nThreads) {
+                int y1, y2;
+                MultiThread::getThreadRange(chunk, nChunks, _renderWindow.y1, _renderWindow.y2, &y1, &y2);
+                processChunk(y1, y2, tiles, workers, busy);
+            }
+        } catch (...) {
+            for (std::size_t i = 0; i < workers.size(); ++i) {
+                delete workers[i];
+            }
+            throw;
+        }
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            delete workers[i];
+        }
+    } // multiThreadFunction
+
+    // process the rows [y1, y2) of the render window, tile by tile, and add the time spent in each stage to busy (if not NULL)
+    void processChunk(int y1,
+                      int y2,
+                      void* tiles[2],
+                      const std::vector<PixelProcessorPipelineStage::Worker*> & workers,
+                      double* busy)
+    {
+        const int width = _renderWindow.x2 - _renderWindow.x1;
+
+        for (int ty = y1; ty < y2; ty += _tileRows) {
+            if ( _effect.abort() ) {
+                break;
+            }
+            OfxRectI tile = _renderWindow;
+            tile.y1 = ty;
+            tile.y2 = std::min(y2, ty + _tileRows);
+
+            const void* srcPixelData = NULL;
+            OfxRectI srcBounds = tile;
+            OFX::PixelComponentEnum srcPixelComponents = OFX::ePixelComponentNone;
+            int srcPixelComponentCount = 0;
+            OFX::BitDepthEnum srcBitDepth = OFX::eBitDepthNone;
+            int srcRowBytes = 0;
+            for (std::size_t i = 0; i < _stages.size(); ++i) {
+                const PixelProcessorPipelineStage & stage = *_stages[i];
+                const bool last = (i + 1 == _stages.size());
+                // the last stage writes into the destination image
+                void* dstPixelData = last ? _dstPixelData : tiles[i & 1];
+                const OfxRectI & dstBounds = last ? _dstBounds : tile;
+                const int dstRowBytes = last ? _dstRowBytes : width * stage._dstPixelBytes;
+                const double start = busy ? OFX::ProcessorTuning::now() : 0.;
+                workers[i]->processTile(tile,
+                                        srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
+                                        dstPixelData, dstBounds, dstRowBytes);
+                if (busy) {
+                    busy[i] += OFX::ProcessorTuning::now() - start;
+                }
+                srcPixelData = dstPixelData;
+                srcPixelComponents = stage._dstPixelComponents;
+                srcPixelComponentCount = stage._dstPixelComponentCount;
+                srcBitDepth = stage._dstBitDepth;
+                srcRowBytes = dstRowBytes;
+            }
+        }
+    } // processChunk
+
+    OFX::ImageEffect &_effect;          /**< @brief effect to render with */
+    std::vector<PixelProcessorPipelineStage*> _stages;
+    void* _dstPixelData;
+    OfxRectI _dstBounds;
+    OFX::PixelComponentEnum _dstPixelComponents;
+    int _dstPixelComponentCount;
+    OFX::BitDepthEnum _dstBitDepth;
+    int _dstRowBytes;
+    OfxRectI _renderWindow;               /**< @brief render window to use */
+    int _tileRows;
+    int _maxPixelBytes;
+    unsigned int _nChunks; // the number of chunks the render window is cut into, set by process()
+    std::vector<double> _stageBusy; // the time spent by each thread in each stage, in microseconds, set by process()
+    ScratchArenaPool _scratchArenas;
+
+    PixelProcessorPipeline &operator= (const PixelProcessorPipeline &);
+    PixelProcessorPipeline(const PixelProcessorPipeline &);
+};
+} // namespace OFX
+
+#endif // ifndef openfx_supportext_ofxsPixelPipeline_h
@@ -25,11 +25,17 @@
  */
 
 #include <cassert>
+#include <cstddef>
+#include <vector>
 #include <algorithm>
+#include <typeinfo>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 #include "ofxsThreadSuite.h"
+#include "ofxsScratchArena.h"
+#include "ofxsProcessorTuning.h"
+#include "ofxsInstrumentation.h"
 
 /** @file This file contains a useful base class that can be used to process images
 
@@ -163,6 +169,182 @@ getPixelAddress(const void* pixelData,
     return (void *) pix;
 }
 
+/**
+ * @brief A non-owning view of the pixels of an image: pixel data, bounds, components, depth and row bytes.
+ *
+ * It can be built from an OFX::Image (implicitly, a NULL image giving an empty view) or from raw pixel data,
+ * and its accessors have the same names as those of OFX::Image. It is cheap to copy, never owns nor frees
+ * the pixels, and may alias a sub-rectangle of another image without copying it (see getSubView()).
+ */
+class ImageView
+{
+public:
+    /** @brief an empty view */
+    ImageView()
+        : _pixelData(NULL)
+        , _bounds()
+        , _pixelComponents(OFX::ePixelComponentNone)
+        , _pixelComponentCount(0)
+        , _bitDepth(OFX::eBitDepthNone)
+        , _rowBytes(0)
+    {
+        _bounds.x1 = _bounds.y1 = _bounds.x2 = _bounds.y2 = 0;
+    }
+
+    /** @brief a view of all the pixels of img, or an empty view if img is NULL */
+    ImageView(const OFX::Image *img)
+        : _pixelData(NULL)
+        , _bounds()
+        , _pixelComponents(OFX::ePixelComponentNone)
+        , _pixelComponentCount(0)
+        , _bitDepth(OFX::eBitDepthNone)
+        , _rowBytes(0)
+    {
+        if (img) {
+            _pixelData = img->getPixelData();
+            _bounds = img->getBounds();
+            _pixelComponents = img->getPixelComponents();
+            _pixelComponentCount = img->getPixelComponentCount();
+            _bitDepth = img->getPixelDepth();
+            _rowBytes = img->getRowBytes();
+        } else {
+            _bounds.x1 = _bounds.y1 = _bounds.x2 = _bounds.y2 = 0;
+        }
+    }
+
+    /** @brief a view of raw pixel data, pixelData being the address of pixel (bounds.x1, bounds.y1) */
+    ImageView(const void *pixelData,
+              const OfxRectI & bounds,
+              OFX::PixelComponentEnum pixelComponents,
+              int pixelComponentCount,
+              OFX::BitDepthEnum bitDepth,
+              int rowBytes)
+        : _pixelData( const_cast<void *>(pixelData) )
+        , _bounds(bounds)
+        , _pixelComponents(pixelComponents)
+        , _pixelComponentCount(pixelComponentCount)
+        , _bitDepth(bitDepth)
+        , _rowBytes(rowBytes)
+    {
+    }
+
+    // as with OFX::Image, constness of the pixels is up to the caller
+    void* getPixelData() const { return _pixelData; }
+
+    OfxRectI getBounds() const { return _bounds; }
+
+    OFX::PixelComponentEnum getPixelComponents() const { return _pixelComponents; }
+
+    int getPixelComponentCount() const { return _pixelComponentCount; }
+
+    OFX::BitDepthEnum getPixelDepth() const { return _bitDepth; }
+
+    int getRowBytes() const { return _rowBytes; }
+
+    int getPixelBytes() const { return _pixelComponentCount * getComponentBytes(_bitDepth); }
+
+    /** @brief true if there are no pixels to read or write */
+    bool isEmpty() const
+    {
+        return !_pixelData || (_bounds.x2 <= _bounds.x1) || (_bounds.y2 <= _bounds.y1);
+    }
+
+    /** @brief the address of pixel (x,y), or NULL if it is outside of the bounds */
+    void* getPixelAddress(int x,
+                          int y) const
+    {
+        if ( !_pixelData || (x < _bounds.x1) || (_bounds.x2 <= x) || (y < _bounds.y1) || (_bounds.y2 <= y) ) {
+            return NULL;
+        }
+
+        return (char *)_pixelData + (std::ptrdiff_t)(y - _bounds.y1) * _rowBytes + (std::ptrdiff_t)(x - _bounds.x1) * getPixelBytes();
+    }
+
+    /** @brief a view of the pixels of rect within the bounds, sharing the pixels of this view (nothing is copied) */
+    ImageView getSubView(const OfxRectI & rect) const
+    {
+        OfxRectI bounds;
+
+        bounds.x1 = std::max(rect.x1, _bounds.x1);
+        bounds.x2 = std::min(rect.x2, _bounds.x2);
+        bounds.y1 = std::max(rect.y1, _bounds.y1);
+        bounds.y2 = std::min(rect.y2, _bounds.y2);
+        if ( (bounds.x2 <= bounds.x1) || (bounds.y2 <= bounds.y1) ) {
+            return ImageView();
+        }
+
+        return ImageView(getPixelAddress(bounds.x1, bounds.y1), bounds, _pixelComponents, _pixelComponentCount, _bitDepth, _rowBytes);
+    }
+
+    /** @brief the range of memory [*begin,*end) spanned by the pixels of rect within the bounds. Returns false if there are none. */
+    bool getMemoryRange(const OfxRectI & rect,
+                        const char **begin,
+                        const char **end) const
+    {
+        const ImageView sub = getSubView(rect);
+
+        if ( sub.isEmpty() ) {
+            return false;
+        }
+        const OfxRectI & b = sub._bounds;
+        const char *first = (const char *)sub._pixelData;
+        const char *last = first + (std::ptrdiff_t)(b.y2 - 1 - b.y1) * _rowBytes; // row bytes may be negative
+        *begin = std::min(first, last);
+        *end = std::max(first, last) + (std::ptrdiff_t)(b.x2 - b.x1) * getPixelBytes();
+
+        return true;
+    }
+
+private:
+    void *_pixelData;
+    OfxRectI _bounds;
+    OFX::PixelComponentEnum _pixelComponents;
+    int _pixelComponentCount;
+    OFX::BitDepthEnum _bitDepth;
+    int _rowBytes;
+};
+
+enum ImageAliasingEnum
+{
+    eImageAliasingNone = 0, // the images do not share memory
+    eImageAliasingSame, // the pixels are the same in both images: copying them would not change anything
+    eImageAliasingOverlap // the images share some memory: copying row by row in any order may overwrite source pixels
+};
+
+/** @brief how the pixels of the destination within window share memory with the pixels of the source.
+ *
+ * eImageAliasingSame means that a copy from src to dst over window can be skipped: all these destination
+ * pixels are inside the source bounds, and are the same bytes with the same format.
+ * eImageAliasingOverlap is conservative: the memory ranges spanned by the rows intersect.
+ */
+inline ImageAliasingEnum
+getImageAliasing(const ImageView & src,
+                 const ImageView & dst,
+                 const OfxRectI & window)
+{
+    const ImageView dstSub = dst.getSubView(window);
+
+    if ( dstSub.isEmpty() || src.isEmpty() ) {
+        return eImageAliasingNone;
+    }
+    const OfxRectI b = dstSub.getBounds();
+    const OfxRectI sb = src.getBounds();
+    if ( (src.getPixelAddress(b.x1, b.y1) == dstSub.getPixelData()) &&
+         (sb.x1 <= b.x1) && (b.x2 <= sb.x2) && (sb.y1 <= b.y1) && (b.y2 <= sb.y2) &&
+         ( src.getRowBytes() == dst.getRowBytes() ) &&
+         ( src.getPixelDepth() == dst.getPixelDepth() ) &&
+         ( src.getPixelComponents() == dst.getPixelComponents() ) &&
+         ( src.getPixelComponentCount() == dst.getPixelComponentCount() ) ) {
+        return eImageAliasingSame;
+    }
+    const char *srcBegin, *srcEnd, *dstBegin, *dstEnd;
+    if ( !src.getMemoryRange(b, &srcBegin, &srcEnd) || !dst.getMemoryRange(b, &dstBegin, &dstEnd) ) {
+        return eImageAliasingNone;
+    }
+
+    return (srcBegin < dstEnd && dstBegin < srcEnd) ? eImageAliasingOverlap : eImageAliasingNone;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // base class to process images with
 class PixelProcessor
@@ -180,6 +362,15 @@ protected:
     int _dstRowBytes;
     OfxRectI _renderWindow;               /**< @brief render window to use */
 
+private:
+    OFX::ScratchArenaPool _scratchArenas; /**< @brief per-thread scratch memory, not copied with the processor */
+    bool _scratchThreaded; /**< @brief true while process() runs multiThread() */
+    unsigned int _nChunks; /**< @brief number of chunks of the render window, 0 for one per thread */
+    std::vector<double> _threadBusy; /**< @brief time spent by each thread in multiThreadProcessImages(), in microseconds */
+#ifdef OFXS_INSTRUMENTATION
+    OFX::Instrumentation::ProcessRecorder _instrumentation;
+#endif
+
 public:
     /** @brief ctor */
     PixelProcessor(OFX::ImageEffect &effect)
@@ -191,6 +382,10 @@ public:
         , _dstBitDepth(OFX::eBitDepthNone)
         , _dstPixelBytes(0)
         , _dstRowBytes(0)
+        , _scratchArenas()
+        , _scratchThreaded(false)
+        , _nChunks(0)
+        , _threadBusy()
     {
         _renderWindow.x1 = _renderWindow.y1 = _renderWindow.x2 = _renderWindow.y2 = 0;
     }
@@ -224,6 +419,12 @@ public:
         _dstRowBytes = dstRowBytes;
     }
 
+    /** @brief set the destination image from a view, which may alias a part of another image */
+    void setDstImg(const OFX::ImageView & v)
+    {
+        setDstImg(v.getPixelData(), v.getBounds(), v.getPixelComponents(), v.getPixelComponentCount(), v.getPixelDepth(), v.getRowBytes());
+    }
+
     /** @brief reset the render window */
     void setRenderWindow(OfxRectI rect)
     {
@@ -234,13 +435,39 @@ public:
     void multiThreadFunction(unsigned int threadId,
                              unsigned int nThreads)
     {
-        OfxRectI win = _renderWindow;
+        // the render window is cut into chunks of rows, which are given to the threads in turn
+        const unsigned int nChunks = std::max(_nChunks, nThreads);
+        const double start = OFX::ProcessorTuning::now();
+        double pixels = 0.;
 
-        MultiThread::getThreadRange(threadId, nThreads, _renderWindow.y1, _renderWindow.y2, &win.y1, &win.y2);
-        if ( (win.y2 - win.y1) > 0 ) {
-            // and render that thread on each
-            multiThreadProcessImages(win);
+#ifdef OFXS_INSTRUMENTATION
+        _instrumentation.beginThread(threadId);
+#endif
+        for (unsigned int chunk = threadId; chunk < nChunks; chunk += nThreads) {
+            OfxRectI win = _renderWindow;
+            MultiThread::getThreadRange(chunk, nChunks, _renderWindow.y1, _renderWindow.y2, &win.y1, &win.y2);
+            if ( (win.y2 - win.y1) > 0 ) {
+                // and render that chunk
+                multiThreadProcessImages(win);
+                pixels += (double)(win.x2 - win.x1) * (win.y2 - win.y1);
+            }
+            if ( (chunk + nThreads < nChunks) && _effect.abort() ) {
+                break;
+            }
+        }
+        if ( threadId < _threadBusy.size() ) {
+            _threadBusy[threadId] = OFX::ProcessorTuning::now() - start;
         }
+#ifdef OFXS_INSTRUMENTATION
+        _instrumentation.endThread( threadId, pixels, _effect.abort() );
+#endif
+    }
+
+    /** @brief the estimated time to process a pixel on one thread, in nanoseconds, before it is measured.
+        Override in derived classes that are much cheaper or much more expensive than average. */
+    virtual double getPixelCostHint() const
+    {
+        return kOfxsProcessorTuningDefaultPixelCost;
     }
 
     /** @brief called before any MP is done */
@@ -271,23 +498,99 @@ public:
             return;
         }
 
+#ifdef OFXS_INSTRUMENTATION
+        _instrumentation.beginProcess( typeid(*this).name(), OFX::MultiThread::getNumCPUs() );
+#endif
+
         // call the pre MP pass
         preProcess();
 
-        // make sure there are at least 4096 pixels per CPU and at least 1 line par CPU
-        unsigned int nCPUs = ( std::min(_renderWindow.x2 - _renderWindow.x1, 4096) *
-                               (_renderWindow.y2 - _renderWindow.y1) ) / 4096;
-        // make sure the number of CPUs is valid (and use at least 1 CPU)
-        nCPUs = std::max( 1u, std::min( nCPUs, OFX::MultiThread::getNumCPUs() ) );
+        // choose the number of threads and chunks from the cost of a pixel, which is learned
+        // from the previous renders with the same processor type
+        const char* typeName = typeid(*this).name();
+        const double pixelCost = OFX::ProcessorTuning::getPixelCost( typeName, getPixelCostHint() );
+        const OFX::ProcessorTuning::Plan plan = OFX::ProcessorTuning::plan(pixelCost,
+                                                                           _renderWindow.x2 - _renderWindow.x1,
+                                                                           _renderWindow.y2 - _renderWindow.y1,
+                                                                           OFX::MultiThread::getNumCPUs() );
+        const unsigned int nCPUs = plan.nThreads;
+        _nChunks = plan.nChunks;
+        _threadBusy.assign(nCPUs, 0.);
+
+#ifdef OFXS_INSTRUMENTATION
+        _instrumentation.beginParallel(nCPUs);
+#endif
+
+        // one scratch arena per thread index (the host may give indices up to getNumCPUs())
+        _scratchArenas.resize(std::max( nCPUs, OFX::MultiThread::getNumCPUs() ), &_effect);
+        _scratchThreaded = true;
 
         // call the base multi threading code, should put a pre & post thread calls in too
-        multiThread(nCPUs);
+        try {
+            multiThread(nCPUs);
+        } catch (...) {
+            _scratchThreaded = false;
+            _nChunks = 0;
+            _scratchArenas.reset();
+            throw;
+        }
+        _scratchThreaded = false;
+        _nChunks = 0;
+
+        // an aborted render did not process all pixels
+        if ( !_effect.abort() ) {
+            double busy = 0.;
+            for (std::size_t i = 0; i < _threadBusy.size(); ++i) {
+                busy += _threadBusy[i];
+            }
+            OFX::ProcessorTuning::addMeasurement( typeName, busy, (double)(_renderWindow.x2 - _renderWindow.x1) * (_renderWindow.y2 - _renderWindow.y1) );
+        }
+
+#ifdef OFXS_INSTRUMENTATION
+        _instrumentation.endParallel();
+#endif
 
         // call the post MP pass
         postProcess();
+
+        // the temporaries are not needed anymore, but the memory is kept for the next render
+        _scratchArenas.reset();
+
+#ifdef OFXS_INSTRUMENTATION
+        _instrumentation.endProcess();
+#endif
+    }
+
+    /** @brief reset the scratch memory, when multiThreadProcessImages() is called directly */
+    void resetScratchArenas()
+    {
+        _scratchArenas.reset();
     }
 
 protected:
+    /** @brief scratch memory for the temporaries of the calling thread, to be used from
+        multiThreadProcessImages(). Everything allocated from it is released after process(). */
+    OFX::ScratchArena & getScratchArena()
+    {
+        if (!_scratchThreaded) {
+            // multiThreadProcessImages() was called directly, from a single thread
+            _scratchArenas.resize(1, &_effect);
+
+            return _scratchArenas.get(0);
+        }
+
+        return _scratchArenas.get( OFX::MultiThread::getThreadIndex() );
+    }
+
+#ifdef OFXS_INSTRUMENTATION
+    /** @brief the recorder of process(), to add details to its record from preProcess() or postProcess() */
+    OFX::Instrumentation::ProcessRecorder & getInstrumentation()
+    {
+        return _instrumentation;
+    }
+
+#endif
+
     void* getDstPixelAddress(int x,
                              int y) const
     {
@@ -380,6 +683,13 @@ public:
         _srcBoundary = srcBoundary;
     }
 
+    /** @brief set the src image from a view, which may alias a part of another image */
+    void setSrcImg(const OFX::ImageView & v,
+                   int srcBoundary = 0) //!< The border condition type { 0=zero |  1=dirichlet | 2=periodic }.
+    {
+        setSrcImg(v.getPixelData(), v.getBounds(), v.getPixelComponents(), v.getPixelComponentCount(), v.getPixelDepth(), v.getRowBytes(), srcBoundary);
+    }
+
     void setOrigImg(const OFX::Image *v)
     {
         _origImg = v;
@@ -448,6 +758,24 @@ protected:
         return (void *) pix;
     }
 
+    /** @brief the part [*spanx1, *spanx2) of [x1, x2) on source line y where the source pixels are inside
+        the source bounds, and thus contiguous, with pixelBytes bytes per pixel. Returns false if it is empty. */
+    bool getSrcSpan(int x1,
+                    int x2,
+                    int y,
+                    int pixelBytes,
+                    int* spanx1,
+                    int* spanx2) const
+    {
+        if ( !_srcPixelData || (_srcPixelBytes != pixelBytes) || (y < _srcBounds.y1) || (_srcBounds.y2 <= y) ) {
+            return false;
+        }
+        *spanx1 = std::max(x1, _srcBounds.x1);
+        *spanx2 = std::min(x2, _srcBounds.x2);
+
+        return *spanx1 < *spanx2;
+    }
+
     static int positive_modulo(int i,
                                int n)
     {
@@ -0,0 +1,197 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX thread count and grain size selection for image processors
+ */
+
+#ifndef openfx_supportext_ofxsProcessorTuning_h
+#define openfx_supportext_ofxsProcessorTuning_h
+
+#include <map>
+#include <algorithm>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN 1
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#include "ofxsMultiThread.h"
+
+/** @file This file contains the choice of the number of threads and chunks used by PixelProcessor.
+
+   Each processor type gives a hint of its cost per pixel (in nanoseconds, on one thread).
+   After each render, the time actually spent per pixel is measured, and the estimate kept for
+   that processor type (identified by its typeid name) is updated, for the life of the process.
+
+   From the estimated work, the number of threads is chosen so that each thread gets at least
+   kOfxsProcessorTuningMinThreadMicroseconds of work (starting a thread is not free), and the
+   render window is cut into chunks of about kOfxsProcessorTuningChunkMicroseconds, so that
+   expensive processors are balanced between the threads.
+
+   This file is header-only: the measurements are kept in a function-local static, shared by all the
+   processors of the plugin binary.
+ */
+
+// minimum work given to a thread
+#define kOfxsProcessorTuningMinThreadMicroseconds 100.
+// target duration of a chunk
+#define kOfxsProcessorTuningChunkMicroseconds 500.
+// maximum number of chunks per thread
+#define kOfxsProcessorTuningMaxChunksPerThread 8
+// cost of a pixel when there is no hint, equivalent to the former "4096 pixels per CPU" rule
+#define kOfxsProcessorTuningDefaultPixelCost 25.
+// renders smaller than this are not measured: the timing would be dominated by the overhead
+#define kOfxsProcessorTuningMinMeasuredPixels 16384
+
+namespace OFX {
+namespace ProcessorTuning {
+namespace Detail {
+// the typeid name of a type is a unique pointer within a module, which is all we need
+typedef std::map<const char*, double> CostMap;
+
+struct Costs
+{
+    OFX::MultiThread::Mutex lock; // protects costs
+    CostMap costs;
+};
+
+// the measurements of the plugin binary. They are created by the first render, and never destroyed,
+// so that they outlive every processor
+inline Costs &
+costs()
+{
+    static Costs* c = new Costs;
+
+    return *c;
+}
+} // namespace Detail
+
+/// a monotonic clock, in microseconds
+inline double
+now()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    return (double)counter.QuadPart * 1e6 / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+#endif
+}
+
+/// the estimated cost of a pixel (in nanoseconds) for a processor type, identified by its
+/// typeid name. Returns costHint if that type was never measured.
+inline double
+getPixelCost(const char* typeName,
+             double costHint)
+{
+    Detail::Costs & c = Detail::costs();
+    OFX::MultiThread::AutoMutex guard(c.lock);
+    Detail::CostMap::const_iterator it = c.costs.find(typeName);
+
+    return ( it != c.costs.end() ) ? it->second : costHint;
+}
+
+/// update the estimate of a processor type with the time spent by all threads (in microseconds)
+/// to process a number of pixels
+inline void
+addMeasurement(const char* typeName,
+               double busyMicroseconds,
+               double pixels)
+{
+    if ( (pixels < kOfxsProcessorTuningMinMeasuredPixels) || (busyMicroseconds <= 0.) ) {
+        return;
+    }
+    const double cost = busyMicroseconds * 1000. / pixels;
+    Detail::Costs & c = Detail::costs();
+    OFX::MultiThread::AutoMutex guard(c.lock);
+    Detail::CostMap::iterator it = c.costs.find(typeName);
+    if ( it == c.costs.end() ) {
+        c.costs[typeName] = cost;
+    } else {
+        // moving average, to smooth out the noise of a single render
+        it->second = 0.75 * it->second + 0.25 * cost;
+    }
+}
+
+/// forget all measurements
+inline void
+clear()
+{
+    Detail::Costs & c = Detail::costs();
+    OFX::MultiThread::AutoMutex guard(c.lock);
+
+    c.costs.clear();
+}
+
+struct Plan
+{
+    unsigned int nThreads;
+    unsigned int nChunks; // nChunks >= nThreads
+};
+
+/// the number of threads and chunks to process a width x height window
+inline Plan
+plan(double pixelCost,
+     int width,
+     int height,
+     unsigned int maxThreads)
+{
+    Plan p;
+
+    p.nThreads = p.nChunks = 1;
+    if ( (width <= 0) || (height <= 0) ) {
+        return p;
+    }
+    // estimated work, in microseconds
+    const double work = pixelCost * width * (double)height / 1000.;
+    // at least kOfxsProcessorTuningMinThreadMicroseconds per thread, and at least one line per thread
+    const double nThreads = std::min( std::min( work / kOfxsProcessorTuningMinThreadMicroseconds, (double)maxThreads ), (double)height );
+    p.nThreads = std::max(1u, (unsigned int)nThreads);
+    if (p.nThreads == 1) {
+        return p;
+    }
+    // chunks of kOfxsProcessorTuningChunkMicroseconds, at least one per thread, and at least one line per chunk
+    double nChunks = std::min(work / kOfxsProcessorTuningChunkMicroseconds, (double)p.nThreads * kOfxsProcessorTuningMaxChunksPerThread);
+    nChunks = std::min( nChunks, (double)height );
+    p.nChunks = std::max( p.nThreads, (unsigned int)nChunks );
+
+    return p;
+}
+} // namespace ProcessorTuning
+} // namespace OFX
+
+#endif // ifndef openfx_supportext_ofxsProcessorTuning_h
@@ -0,0 +1,327 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-supportext <https://github.com/devernay/openfx-supportext>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-supportext is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-supportext is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-supportext.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX scratch memory for processor temporaries
+ */
+
+#ifndef openfx_supportext_ofxsScratchArena_h
+#define openfx_supportext_ofxsScratchArena_h
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+
+/** @file This file contains a bump allocator for the temporaries of image processors.
+
+   A ScratchArena is used by a single thread: allocate() returns aligned memory from a chunk,
+   and reset() makes all of it available again, without returning it to the system. After the
+   first render, the chunks are big enough and allocate() only increments a pointer.
+   Requests larger than kOfxsScratchArenaLargeBytes are allocated using OFX::ImageMemory,
+   so that they come from the host, and are released by reset().
+
+   A ScratchArenaPool holds one arena per thread index. PixelProcessor owns one, which can be
+   reached from multiThreadProcessImages() using getScratchArena(), and is reset after process().
+ */
+
+namespace OFX {
+// default alignment of the allocations, suitable for AVX
+#define kOfxsScratchArenaAlignment 32
+// minimum size of a chunk
+#define kOfxsScratchArenaChunkBytes (64 * 1024)
+// allocations at least this large go to OFX::ImageMemory
+#define kOfxsScratchArenaLargeBytes (4 * 1024 * 1024)
+
+class ScratchArena
+{
+public:
+    explicit ScratchArena(OFX::ImageEffect* effect = NULL)
+        : _effect(effect)
+        , _chunks()
+        , _current(0)
+        , _used(0)
+        , _bytesInUse(0)
+        , _highWaterMark(0)
+        , _large()
+    {
+    }
+
+    ~ScratchArena()
+    {
+        releaseLarge();
+        for (std::size_t i = 0; i < _chunks.size(); ++i) {
+            std::free(_chunks[i].data);
+        }
+    }
+
+    /// return size bytes aligned on alignment (a power of two), valid until the next reset()
+    void* allocate(std::size_t size,
+                   std::size_t alignment = kOfxsScratchArenaAlignment)
+    {
+        assert( alignment > 0 && (alignment & (alignment - 1)) == 0 );
+        if (size == 0) {
+            size = 1;
+        }
+        if (size >= kOfxsScratchArenaLargeBytes) {
+            return allocateLarge(size, alignment);
+        }
+        // try the current chunk, then the next ones (they are kept after a reset)
+        while ( _current < _chunks.size() ) {
+            void* p = allocateFrom(_chunks[_current], size, alignment);
+            if (p) {
+                return p;
+            }
+            ++_current;
+            _used = 0;
+        }
+        // new chunk, twice as large as the previous one
+        Chunk c;
+        c.size = std::max( std::max( (std::size_t)kOfxsScratchArenaChunkBytes, size + alignment ),
+                           _chunks.empty() ? 0 : 2 * _chunks.back().size );
+        c.data = (char*)std::malloc(c.size);
+        if (!c.data) {
+            throwSuiteStatusException(kOfxStatErrMemory);
+        }
+        _chunks.push_back(c);
+        _current = _chunks.size() - 1;
+        _used = 0;
+        void* p = allocateFrom(_chunks[_current], size, alignment);
+        assert(p);
+
+        return p;
+    }
+
+    /// allocate an array of n T, which is not constructed
+    template <class T>
+    T* allocateArray(std::size_t n,
+                     std::size_t alignment = kOfxsScratchArenaAlignment)
+    {
+        return (T*)allocate(n * sizeof(T), alignment);
+    }
+
+    /// make all the memory available again. If several chunks were needed, they are replaced
+    /// by a single chunk large enough for the next time.
+    void reset()
+    {
+        releaseLarge();
+        if (_chunks.size() > 1) {
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < _chunks.size(); ++i) {
+                total += _chunks[i].size;
+                std::free(_chunks[i].data);
+            }
+            _chunks.clear();
+            Chunk c;
+            c.size = total;
+            c.data = (char*)std::malloc(c.size);
+            if (c.data) {
+                _chunks.push_back(c);
+            }
+        }
+        _current = 0;
+        _used = 0;
+        _bytesInUse = 0;
+    }
+
+    /// bytes allocated since the last reset(), including alignment padding
+    std::size_t getBytesInUse() const { return _bytesInUse; }
+
+    /// maximum of getBytesInUse() since construction
+    std::size_t getHighWaterMark() const { return _highWaterMark; }
+
+    /// bytes held in chunks
+    std::size_t getCapacity() const
+    {
+        std::size_t total = 0;
+
+        for (std::size_t i = 0; i < _chunks.size(); ++i) {
+            total += _chunks[i].size;
+        }
+
+        return total;
+    }
+
+private:
+    // non-copyable: the allocations point into the chunks
+    ScratchArena(const ScratchArena &);
+    ScratchArena & operator=(const ScratchArena &);
+
+    struct Chunk
+    {
+        char* data;
+        std::size_t size;
+    };
+
+    void* allocateFrom(const Chunk & c,
+                       std::size_t size,
+                       std::size_t alignment)
+    {
+        std::size_t addr = (std::size_t)(c.data + _used);
+        std::size_t padding = (alignment - (addr & (alignment - 1))) & (alignment - 1);
+
+        if (_used + padding + size > c.size) {
+            return NULL;
+        }
+        _used += padding + size;
+        addUsage(padding + size);
+
+        return c.data + (_used - size);
+    }
+
+    void* allocateLarge(std::size_t size,
+                        std::size_t alignment)
+    {
+        OFX::ImageMemory* mem = new OFX::ImageMemory(size + alignment, _effect);
+
+        _large.push_back(mem);
+        char* data = (char*)mem->lock();
+        if (!data) {
+            throwSuiteStatusException(kOfxStatErrMemory);
+        }
+        std::size_t padding = (alignment - ( (std::size_t)data & (alignment - 1) ) ) & (alignment - 1);
+        addUsage(size + padding);
+
+        return data + padding;
+    }
+
+    void releaseLarge()
+    {
+        for (std::size_t i = 0; i < _large.size(); ++i) {
+            _large[i]->unlock();
+            delete _large[i];
+        }
+        _large.clear();
+    }
+
+    void addUsage(std::size_t bytes)
+    {
+        _bytesInUse += bytes;
+        _highWaterMark = std::max(_highWaterMark, _bytesInUse);
+    }
+
+    OFX::ImageEffect* _effect;
+    std::vector<Chunk> _chunks;
+    std::size_t _current; // chunk being filled
+    std::size_t _used; // bytes used in the current chunk
+    std::size_t _bytesInUse;
+    std::size_t _highWaterMark;
+    std::vector<OFX::ImageMemory*> _large;
+};
+
+// one ScratchArena per thread index. The arenas are created when first used.
+class ScratchArenaPool
+{
+public:
+    ScratchArenaPool()
+        : _effect(NULL)
+        , _arenas()
+    {
+    }
+
+    // copying a pool does not copy the arenas: the copy starts empty
+    ScratchArenaPool(const ScratchArenaPool & other)
+        : _effect(other._effect)
+        , _arenas()
+    {
+    }
+
+    ScratchArenaPool & operator=(const ScratchArenaPool & other)
+    {
+        if (this != &other) {
+            clear();
+            _effect = other._effect;
+        }
+
+        return *this;
+    }
+
+    ~ScratchArenaPool()
+    {
+        clear();
+    }
+
+    /// make room for nThreads arenas. Must not be called while the arenas are used.
+    void resize(unsigned int nThreads,
+                OFX::ImageEffect* effect)
+    {
+        _effect = effect;
+        if ( nThreads > _arenas.size() ) {
+            _arenas.resize(nThreads, NULL);
+        }
+    }
+
+    unsigned int size() const { return (unsigned int)_arenas.size(); }
+
+    /// the arena of thread threadIndex. Each thread must use its own index.
+    ScratchArena & get(unsigned int threadIndex)
+    {
+        assert( threadIndex < _arenas.size() );
+        if ( threadIndex >= _arenas.size() ) {
+            throwSuiteStatusException(kOfxStatErrBadIndex);
+        }
+        if (!_arenas[threadIndex]) {
+            _arenas[threadIndex] = new ScratchArena(_effect);
+        }
+
+        return *_arenas[threadIndex];
+    }
+
+    /// reset all the arenas, keeping their memory
+    void reset()
+    {
+        for (std::size_t i = 0; i < _arenas.size(); ++i) {
+            if (_arenas[i]) {
+                _arenas[i]->reset();
+            }
+        }
+    }
+
+    /// release all the arenas and their memory
+    void clear()
+    {
+        for (std::size_t i = 0; i < _arenas.size(); ++i) {
+            delete _arenas[i];
+        }
+        _arenas.clear();
+    }
+
+    /// maximum of the high-water marks of the arenas
+    std::size_t getHighWaterMark() const
+    {
+        std::size_t hwm = 0;
+
+        for (std::size_t i = 0; i < _arenas.size(); ++i) {
+            if (_arenas[i]) {
+                hwm = std::max( hwm, _arenas[i]->getHighWaterMark() );
+            }
+        }
+
+        return hwm;
+    }
+
+private:
+    OFX::ImageEffect* _effect;
+    std::vector<ScratchArena*> _arenas;
+};
+} // namespace OFX
+
+#endif // ifndef openfx_supportext_ofxsScratchArena_h
@@ -31,8 +31,17 @@
 #include "ofxsMultiThread.h"
 
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include <vector>
-#include <map>
+#include <utility>
+#include <algorithm>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
 #ifdef DEBUG_STDOUT
 #include <iostream>
 #define DBG(x) (x)
@@ -51,7 +60,6 @@
 #include "ofxsImageEffect.h"
 
 using namespace tthread;
-using std::map;
 using std::vector;
 #ifdef DEBUG_STDOUT
 using std::cout;
@@ -64,38 +72,344 @@ OfxStatus multiThreadNumCPUs(unsigned int *nCPUs);
 
 const unsigned nprocs = thread::hardware_concurrency();
 
-mutex occupancyLock; // protects occupancy
-unsigned occupancy = 0;
+// number of threads running tasks, updated without locking
+atomic<unsigned int> occupancy(0);
+
+// the index of the task run by the current thread, and whether it runs a task. These are read
+// by multiThreadIndex() and multiThreadIsSpawnedThread(), which may be called for each row.
+thread_local unsigned int currentThreadIndex = 0;
+thread_local int currentIsSpawned = 0;
+
+
+// Affinity: with eThreadAffinityCompact, each thread of a job is pinned to a CPU of its own,
+// reserved together with the occupancy. The free CPUs are taken in the list of allowed CPUs
+// sorted by NUMA node, so that a job spans as few nodes as possible, and concurrent jobs do not
+// share CPUs. The first tasks of a job are bound to its threads in the order of their CPUs (see
+// multiThread), so that adjacent row bands run on the same node. The threads stay on their CPU
+// for the whole job: a thread that runs the tasks of a nested job is not moved, and the threads
+// spawned for the nested job get free CPUs. When there are no free CPUs left, the threads are
+// not pinned.
+atomic<int> affinity(-1); // the policy, -1 until it is read by getAffinity()
+mutex affinityLock; // protects affinityFromEnv, topologyReady, cpuOrder and cpuBusy
+bool affinityFromEnv = true; // read affinity from OFXS_THREAD_AFFINITY, unless it was set
+bool topologyReady = false; // cpuOrder was read. It does not change afterwards
+vector<int> cpuOrder; // allowed CPUs, sorted by NUMA node
+vector<char> cpuBusy; // whether each CPU of cpuOrder is reserved by a thread
+
+#ifdef __linux__
+// the NUMA node of a CPU, or its physical package if NUMA is not available
+int
+cpuNode(int cpu)
+{
+    char path[256];
+
+    for (int node = 0; node < 256; ++node) {
+        std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+    std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    int package = 0;
+    FILE* f = std::fopen(path, "r");
+    if (f) {
+        if (std::fscanf(f, "%d", &package) != 1) {
+            package = 0;
+        }
+        std::fclose(f);
+    }
+
+    return package;
+}
+#endif
+
+// read the allowed CPUs and sort them by NUMA node, once. affinityLock must be held.
+void
+readTopology()
+{
+    if (topologyReady) {
+        return;
+    }
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        vector<std::pair<int, int> > nodeCpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if ( CPU_ISSET(cpu, &allowed) ) {
+                nodeCpus.push_back( std::make_pair(cpuNode(cpu), cpu) );
+            }
+        }
+        std::sort( nodeCpus.begin(), nodeCpus.end() );
+        for (std::size_t i = 0; i < nodeCpus.size(); ++i) {
+            cpuOrder.push_back(nodeCpus[i].second);
+        }
+    }
+#endif
+    cpuBusy.assign(cpuOrder.size(), 0);
+    topologyReady = true;
+}
+
+// set the affinity policy. affinityLock must be held.
+void
+setAffinity(OFX::ThreadAffinityEnum a)
+{
+    if (a == OFX::eThreadAffinityCompact) {
+        readTopology();
+        if ( cpuOrder.empty() ) {
+            a = OFX::eThreadAffinityNone;
+        }
+    }
+    affinity.store(a);
+}
+
+// the affinity policy, read from the environment by the first call
+OFX::ThreadAffinityEnum
+getAffinity()
+{
+    int a = affinity.load();
+
+    if (a < 0) {
+        lock_guard<mutex> guard(affinityLock);
+        if (affinity.load() < 0) {
+            const char* env = affinityFromEnv ? std::getenv("OFXS_THREAD_AFFINITY") : NULL;
+            setAffinity( ( env && (std::strcmp(env, "compact") == 0) ) ? OFX::eThreadAffinityCompact : OFX::eThreadAffinityNone );
+        }
+        a = affinity.load();
+    }
+
+    return (OFX::ThreadAffinityEnum)a;
+}
+
+// reserve up to n free CPUs, and return their positions in cpuOrder (-1 if there was none left)
+void
+reserveCpus(unsigned int n,
+            vector<int>* cpus)
+{
+    lock_guard<mutex> guard(affinityLock);
+    std::size_t pos = 0;
+
+    for (unsigned int i = 0; i < n; ++i) {
+        while ( pos < cpuBusy.size() && cpuBusy[pos] ) {
+            ++pos;
+        }
+        if ( pos < cpuBusy.size() ) {
+            cpuBusy[pos] = 1;
+            cpus->push_back( (int)pos );
+        } else {
+            cpus->push_back(-1);
+        }
+    }
+}
+
+// give back a CPU reserved by reserveCpus()
+void
+releaseCpu(int pos)
+{
+    if (pos >= 0) {
+        lock_guard<mutex> guard(affinityLock);
+        cpuBusy[pos] = 0;
+    }
+}
+
+#ifdef __linux__
+typedef cpu_set_t AffinityMask;
+#else
+typedef int AffinityMask;
+#endif
+
+// save the CPUs the calling thread may run on
+void
+saveAffinity(AffinityMask* mask)
+{
+#ifdef __linux__
+    if (sched_getaffinity(0, sizeof(*mask), mask) != 0) {
+        CPU_ZERO(mask);
+    }
+#else
+    *mask = 0;
+#endif
+}
 
-mutex threadIndexesLock; // protects threadIndexes
-map<thread::id, unsigned int> threadIndexes;
+void
+restoreAffinity(const AffinityMask & mask)
+{
+#ifdef __linux__
+    if (CPU_COUNT(&mask) > 0) {
+        sched_setaffinity(0, sizeof(mask), &mask);
+    }
+#else
+    (void)mask;
+#endif
+}
 
+// pin the calling thread to the CPU at position pos of cpuOrder, reserved by reserveCpus()
+void
+pinCpu(int pos)
+{
+#ifdef __linux__
+    if (pos >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpuOrder[pos], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+#else
+    (void)pos;
+#endif
+}
 
-struct ThreadArgs
+// A call to multiThread is a job, made of nThreads tasks. The calling thread and the threads it
+// spawns take the tasks of the job in turn. When all its tasks are taken, the calling thread helps
+// with the tasks of the jobs nested in its own (started from its tasks, or from their nested jobs)
+// until its job is done: a nested call never blocks a thread that could do some work.
+// It never runs the tasks of unrelated jobs, started by other host threads, which could need the
+// locks held by the caller of multiThread.
+struct Job
 {
+    Job* parent; // the job of the task which started this job, or NULL
     OfxThreadFunctionV1* func;
-    unsigned int threadIndex;
     unsigned int threadMax;
     void *customArg;
-    OfxStatus ret;
+    unsigned long serial; // creation order
+    unsigned int next; // index of the next task to take
+    unsigned int done; // number of tasks done
+    OfxStatus ret; // first error
 };
 
+mutex jobsLock; // protects jobs, jobSerial and the next, done and ret fields of each job
+condition_variable jobsDone; // notified when a task is done or a job is added
+vector<Job*> jobs; // the jobs which have tasks not taken yet, in creation order
+unsigned long jobSerial = 0;
+thread_local Job* currentJob = NULL; // the job of the task run by the current thread, if any
+
+// take the next task of job. jobsLock must be held.
+bool
+takeTask(Job* job,
+         unsigned int* threadIndex)
+{
+    if (job->next >= job->threadMax) {
+        return false;
+    }
+    *threadIndex = job->next++;
+    if (job->next == job->threadMax) {
+        // no more tasks to take
+        vector<Job*>::iterator it = std::find(jobs.begin(), jobs.end(), job);
+        assert( it != jobs.end() );
+        if ( it != jobs.end() ) {
+            jobs.erase(it);
+        }
+    }
+
+    return true;
+}
+
+// is other nested in job? jobsLock must be held.
+bool
+isNested(const Job* other,
+         const Job* job)
+{
+    for (const Job* j = other->parent; j; j = j->parent) {
+        if (j == job) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// take a task of the most recent job nested in job. jobsLock must be held.
+bool
+takeNestedTask(const Job* job,
+               Job** other,
+               unsigned int* threadIndex)
+{
+    // nested jobs are started after job
+    for (vector<Job*>::reverse_iterator it = jobs.rbegin(); it != jobs.rend() && (*it)->serial > job->serial; ++it) {
+        *other = *it;
+        if ( isNested(*other, job) && takeTask(*other, threadIndex) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// run a task, with the index of the calling thread set to threadIndex
 void
-threadFunction(void *_args)
+runTask(Job* job,
+        unsigned int threadIndex)
 {
-    ThreadArgs* args = (ThreadArgs*)_args;
-    assert(args->threadIndex < args->threadMax);
+    assert(threadIndex < job->threadMax);
 
-    args->ret = kOfxStatOK;
+    // the calling thread may already be running a task (of an outer job): save its index
+    const unsigned int previousIndex = currentThreadIndex;
+    const int previousIsSpawned = currentIsSpawned;
+    Job* const previousJob = currentJob;
+    currentThreadIndex = threadIndex;
+    currentIsSpawned = 1;
+    currentJob = job;
+
+    OfxStatus ret = kOfxStatOK;
     try {
-        args->func(args->threadIndex, args->threadMax, args->customArg);
+        job->func(threadIndex, job->threadMax, job->customArg);
     } catch (const std::bad_alloc & ba) {
-        args->ret = kOfxStatErrMemory;
+        ret = kOfxStatErrMemory;
     } catch (...) {
-        args->ret = kOfxStatFailed;
+        ret = kOfxStatFailed;
+    }
+
+    currentThreadIndex = previousIndex;
+    currentIsSpawned = previousIsSpawned;
+    currentJob = previousJob;
+    {
+        lock_guard<mutex> guard(jobsLock);
+        if ( (ret != kOfxStatOK) && (job->ret == kOfxStatOK) ) {
+            job->ret = ret;
+        }
+        ++job->done;
+    }
+    jobsDone.notify_all();
+}
+
+// run the tasks of job until they are all taken
+void
+runTasks(Job* job)
+{
+    for (;;) {
+        unsigned int threadIndex;
+        {
+            lock_guard<mutex> guard(jobsLock);
+            if ( !takeTask(job, &threadIndex) ) {
+                return;
+            }
+        }
+        runTask(job, threadIndex);
     }
 }
 
+// a thread spawned by multiThread, and the CPU reserved for it (-1 if it is not pinned)
+struct Helper
+{
+    Job* job;
+    int cpu;
+    unsigned int threadIndex; // the first task run by this thread
+};
+
+// the function of a thread spawned by multiThread
+void
+threadFunction(void *_helper)
+{
+    Helper* helper = (Helper*)_helper;
+
+    pinCpu(helper->cpu);
+    runTask(helper->job, helper->threadIndex);
+    runTasks(helper->job);
+
+    // this thread does not use its CPU anymore
+    releaseCpu(helper->cpu);
+    --occupancy;
+}
+
 /**@brief Function to spawn SMP threads
 
  \arg func The function to call in each thread.
@@ -112,12 +426,13 @@ threadFunction(void *_args)
  \e nThreads can be more than the value returned by multiThreadNumCPUs, however the threads will
  be limitted to the number of CPUs returned by multiThreadNumCPUs.
 
- This function cannot be called recursively.
+ This function may be called recursively, from a spawned thread: the calling thread runs the
+ inner tasks, together with the threads it can spawn on the free CPUs.
 
  @returns
  - ::kOfxStatOK, the function func has executed and returned sucessfully
  - ::kOfxStatFailed, the threading function failed to launch
- - ::kOfxStatErrExists, failed in an attempt to call multiThread recursively,
+ - ::kOfxStatErrMemory, func threw std::bad_alloc
 
  */
 // Note that the thread indexes are from 0 to nThreads-1.
@@ -130,117 +445,126 @@ OfxStatus multiThread(OfxThreadFunctionV1 func,
         return kOfxStatFailed;
     }
 
-    // check if this is a spawned thread, if yes return kOfxStatErrExists
-    {
-        lock_guard<mutex> guard(threadIndexesLock);
-        if ( threadIndexes.find( this_thread::get_id() ) != threadIndexes.end() ) {
-            return kOfxStatErrExists;
-        }
-    }
-
-    unsigned int maxConcurrentThread;
-    OfxStatus st = multiThreadNumCPUs(&maxConcurrentThread);
-    if (st != kOfxStatOK) {
-        return st;
-    }
+    Job job;
+    job.parent = currentJob;
+    job.func = func;
+    job.threadMax = nThreads;
+    job.customArg = customArg;
+    job.serial = 0;
+    job.next = 0;
+    job.done = 0;
+    job.ret = kOfxStatOK;
 
     // from the documentation:
     // "nThreads can be more than the value returned by multiThreadNumCPUs, however
     // the threads will be limitted to the number of CPUs returned by multiThreadNumCPUs."
+    // The calling thread runs tasks too, so that at most nHelpers threads are spawned,
+    // and the free CPUs are reserved at once, so that concurrent (or nested) calls
+    // do not oversubscribe the CPUs.
+    // A nested call comes from a thread which is already counted in the occupancy.
+    // The CPUs are reserved optimistically, and those that were not free are given back:
+    // concurrent calls may get fewer threads than available, but never more.
+    const unsigned int caller = currentIsSpawned ? 0 : 1;
+    const unsigned int wanted = ( std::max( 1u, std::min(nThreads, nprocs) ) - 1 ) + caller;
+    const unsigned int previous = occupancy.fetch_add(wanted);
+    const unsigned int maxConcurrentThread = (previous >= nprocs ? 0 : (nprocs - previous)) + (1 - caller);
+    unsigned int nHelpers = std::min( nThreads, std::max(1u, maxConcurrentThread) );
+    nHelpers = nHelpers > 0 ? nHelpers - 1 : 0;
+    if (wanted > nHelpers + caller) {
+        occupancy.fetch_sub(wanted - nHelpers - caller);
+    }
 
-    if ( (nThreads == 1) || (maxConcurrentThread <= 1) ) {
-        int retval;
-        {
-            lock_guard<mutex> guard(occupancyLock);
-            ++occupancy;
+    if (nHelpers == 0) {
+        for (unsigned int i = 0; i < nThreads; ++i) {
+            runTask(&job, i);
         }
-        try {
-            for (unsigned int i = 0; i < nThreads; ++i) {
-                func(i, nThreads, customArg);
-            }
+        occupancy.fetch_sub(caller);
 
-            retval = kOfxStatOK;
-        } catch (...) {
-            retval = kOfxStatFailed;
-        }
-        {
-            lock_guard<mutex> guard(occupancyLock);
-            --occupancy;
-        }
-        return retval;
-    }
-
-    // at most maxConcurrentThread should be running at the same time
-    vector<thread*> threads(nThreads, NULL);
-    vector<thread::id> threadIDs(nThreads);
-    vector<ThreadArgs> threadArgs(nThreads);
-    for (unsigned int i = 0; i < nThreads; ++i) {
-        threadArgs[i].func = func;
-        threadArgs[i].threadIndex = i;
-        threadArgs[i].threadMax = nThreads;
-        threadArgs[i].customArg = customArg;
-        threadArgs[i].ret = kOfxStatFailed;
-    }
-    unsigned int i = 0; // index of next thread to launch
-    unsigned int running = 0; // number of running threads
-    unsigned int j = 0; // index of first running thread. all threads before this one are finished running
-    while (j < nThreads) {
-        // have no more than maxConcurrentThread threads launched at the same time
-        int threadsStarted = 0;
-        {
-            lock_guard<mutex> guard(threadIndexesLock);
-
-            while (i < nThreads && running < maxConcurrentThread) {
-                threads[i] = new thread(threadFunction, &threadArgs[i]);
-                threadIDs[i] = threads[i]->get_id();
-                assert( threadIndexes.find(threadIDs[i]) == threadIndexes.end() );
-                threadIndexes[threadIDs[i]] = threadArgs[i].threadIndex;
-                ++i;
-                ++running;
-                ++threadsStarted;
-            }
-        }
+        return job.ret;
+    }
 
-        ///We just started threadsStarted threads
-        {
-            lock_guard<mutex> guard(occupancyLock);
-            occupancy += threadsStarted;
-        }
+    // with the compact policy, a CPU is reserved for each spawned thread, and for the calling
+    // thread unless it already runs a task, in which case it stays on its own CPU.
+    // The calling thread is pinned while it runs tasks, and then goes back to its CPUs.
+    vector<int> cpus;
+    if (getAffinity() == OFX::eThreadAffinityCompact) {
+        reserveCpus(nHelpers + caller, &cpus);
+    } else {
+        cpus.assign(nHelpers + caller, -1);
+    }
+    const int callerCpu = caller ? cpus[0] : -1;
+    AffinityMask callerAffinity;
+    if (callerCpu >= 0) {
+        saveAffinity(&callerAffinity);
+        pinCpu(callerCpu);
+    }
 
-        // now we've got at most maxConcurrentThread running. wait for each thread and launch a new one
-        threads[j]->join();
-        assert( !threads[j]->joinable() );
-        {
-            lock_guard<mutex> guard(threadIndexesLock);
-            map<thread::id, unsigned int>::iterator it = threadIndexes.find(threadIDs[j]);
-            assert( it != threadIndexes.end() );
-            if ( it != threadIndexes.end() ) {
-                threadIndexes.erase(it);
+    // the first tasks are bound to the threads in the order of their CPUs: the calling thread
+    // takes task 0, and spawned thread i task i + 1, so that adjacent row bands (see
+    // getThreadRange) run on the same NUMA node, and the scratch arena of each task index is
+    // first touched on the node of its CPU. The remaining tasks are taken in turn.
+    job.next = nHelpers + 1;
+    {
+        lock_guard<mutex> guard(jobsLock);
+        job.serial = ++jobSerial;
+        if (job.next < job.threadMax) {
+            jobs.push_back(&job);
+        }
+    }
+    // threads waiting for their job may help
+    jobsDone.notify_all();
+
+    vector<Helper> helpers(nHelpers);
+    vector<thread*> threads;
+    threads.reserve(nHelpers);
+    for (unsigned int i = 0; i < nHelpers; ++i) {
+        helpers[i].job = &job;
+        helpers[i].cpu = cpus[caller + i];
+        helpers[i].threadIndex = i + 1;
+        try {
+            threads.push_back( new thread(threadFunction, &helpers[i]) );
+        } catch (...) {
+            // the calling thread will run the tasks of the threads which were not spawned
+            for (unsigned int j = i; j < nHelpers; ++j) {
+                releaseCpu(cpus[caller + j]);
             }
+            occupancy.fetch_sub(nHelpers - i);
+            break;
         }
-        delete threads[j];
-        threads[j] = NULL;
-        threadIDs[j] = thread::id();
-        ++j;
-        --running;
+    }
 
-        // We just stopped 1 thread
-        {
-            lock_guard<mutex> guard(occupancyLock);
-            --occupancy;
+    runTask(&job, 0);
+    for (unsigned int i = threads.size(); i < nHelpers; ++i) {
+        runTask(&job, i + 1);
+    }
+    runTasks(&job);
+
+    // help with the nested jobs until all the tasks of this job are done
+    jobsLock.lock();
+    while (job.done < job.threadMax) {
+        Job* other;
+        unsigned int threadIndex;
+        if ( takeNestedTask(&job, &other, &threadIndex) ) {
+            jobsLock.unlock();
+            runTask(other, threadIndex);
+            jobsLock.lock();
+        } else {
+            jobsDone.wait(jobsLock);
         }
     }
-    assert(running == 0);
+    jobsLock.unlock();
 
-    // check the return status of each thread, return the first error found
-    for (unsigned int i = 0; i < nThreads; ++i) {
-        OfxStatus stat = threadArgs[i].ret;
-        if (stat != kOfxStatOK) {
-            return stat;
-        }
+    if (callerCpu >= 0) {
+        restoreAffinity(callerAffinity);
+        releaseCpu(callerCpu);
+    }
+    occupancy.fetch_sub(caller);
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
     }
 
-    return kOfxStatOK;
+    return job.ret;
 }
 
 /**@brief Function which indicates the number of CPUs available for SMP processing
@@ -256,8 +580,8 @@ OfxStatus multiThread(OfxThreadFunctionV1 func,
 // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#OfxMultiThreadSuiteV1_multiThreadNumCPUs
 OfxStatus multiThreadNumCPUs(unsigned int *nCPUs)
 {
-    lock_guard<mutex> guard(occupancyLock);
-    *nCPUs = occupancy >= nprocs ? 1 : (nprocs - occupancy);
+    const unsigned int busy = occupancy.load();
+    *nCPUs = busy >= nprocs ? 1 : (nprocs - busy);
     DBG(std::cout << "numCPUs=" << *nCPUs << endl);
     return kOfxStatOK;
 }
@@ -283,13 +607,8 @@ OfxStatus multiThreadIndex(unsigned int *threadIndex)
         return kOfxStatFailed;
     }
 
-    lock_guard<mutex> guard(threadIndexesLock);
-    map<thread::id, unsigned int>::const_iterator it = threadIndexes.find( this_thread::get_id() );
-    if ( it != threadIndexes.end() ) {
-        *threadIndex = it->second;
-    } else {
-        *threadIndex = 0;
-    }
+    // 0 if the calling thread does not run a task
+    *threadIndex = currentThreadIndex;
 
     return kOfxStatOK;
 }
@@ -303,8 +622,7 @@ OfxStatus multiThreadIndex(unsigned int *threadIndex)
 // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#OfxMultiThreadSuiteV1_multiThreadIsSpawnedThread
 int multiThreadIsSpawnedThread(void)
 {
-    lock_guard<mutex> guard(threadIndexesLock);
-    return threadIndexes.find( this_thread::get_id() ) != threadIndexes.end();
+    return currentIsSpawned;
 }
 
 /** @brief Create a mutex
@@ -577,6 +895,13 @@ void ofxsThreadSuiteCheck()
     }
 }
 
+void ofxsThreadSuiteSetAffinity(ThreadAffinityEnum a)
+{
+    lock_guard<mutex> guard(affinityLock);
+    affinityFromEnv = false;
+    setAffinity(a);
+}
+
 } // namespace OFX
 
 
@@ -37,6 +37,17 @@ namespace OFX {
     // call from PluginFactory::load() to fix the multithread suite on some hosts that do not implement it.
     // (load() is the second argument of mDeclarePluginFactory() )
     void ofxsThreadSuiteCheck();
+
+    enum ThreadAffinityEnum
+    {
+        eThreadAffinityNone = 0, // threads may run on any allowed CPU
+        eThreadAffinityCompact // each thread is pinned to a free CPU, a job spans as few NUMA nodes as possible
+    };
+
+    // set the placement of the tasks run by the plugin-side suite (Linux only, no effect on other systems).
+    // By default, it is read from the OFXS_THREAD_AFFINITY environment variable ("none" or "compact").
+    // Call from PluginFactory::load(), like ofxsThreadSuiteCheck().
+    void ofxsThreadSuiteSetAffinity(ThreadAffinityEnum affinity);
 }
 
 #endif // openfx_supportext_ofxsThreadSuite_h
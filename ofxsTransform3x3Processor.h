@@ -23,19 +23,33 @@
 #ifndef MISC_TRANSFORMPROCESSOR_H
 #define MISC_TRANSFORMPROCESSOR_H
 
+#include <cmath>
+#include <vector>
+#include <map>
+#include <utility>
 #include <algorithm>
 
 #include "ofxsProcessing.H"
 #include "ofxsMatrix2D.h"
 #include "ofxsFilter.h"
 #include "ofxsMaskMix.h"
+#include "ofxsMaskOccupancy.h"
 #include "ofxsMacros.h"
+#include "ofxsInstrumentation.h"
+#ifdef OFXS_INSTRUMENTATION
+#include <typeinfo>
+#endif
 
 // constants for the motion blur algorithm (may depend on _motionblur)
 #define kTransform3x3ProcessorMotionBlurMaxError (_motionblur * maxValue / 1000.)
 #define kTransform3x3ProcessorMotionBlurMinIterations ( std::max( 13, (int)(kTransform3x3ProcessorMotionBlurMaxIterations / 3) ) )
 #define kTransform3x3ProcessorMotionBlurMaxIterations ( (int)(_motionblur * 40) )
 
+// tolerance used to detect that a transform is a pure translation
+#define kTransform3x3ProcessorTranslationEpsilon 1e-6
+// maximum number of translations in the motion blur kernel along a translation
+#define kTransform3x3ProcessorTranslationMaxSamples 128
+
 namespace OFX {
 class Transform3x3ProcessorBase
     : public OFX::ImageProcessor
@@ -43,6 +57,12 @@ class Transform3x3ProcessorBase
 protected:
     const OFX::Image *_srcImg;
     const OFX::Image *_maskImg;
+    // the destination, if it was set from a pixel buffer rather than an OFX::Image (e.g. a tile of a PixelProcessorPipeline)
+    void *_dstPixelData;
+    OfxRectI _dstBounds;
+    int _dstPixelComponentCount;
+    OFX::BitDepthEnum _dstBitDepth;
+    int _dstRowBytes;
     // NON-GENERIC PARAMETERS:
     const OFX::Matrix3x3* _invtransform; // the set of transforms to sample from (in PIXEL coords)
     const double* _invtransformalpha; // blending factor for each tranform, or NULL for uniform blending
@@ -54,12 +74,33 @@ protected:
     double _mix;
     bool _maskInvert;
 
+    // When all the transforms are pure translations (e.g. a directional blur on a translation),
+    // the weighted average of the interpolated samples is a convolution of the source image
+    // by a kernel with integer offsets. The kernel is stored as a list of rows, and each output
+    // row is the sum of a few shifted and weighted source rows.
+    struct TranslationKernelRow
+    {
+        int dy; // source row offset
+        int dx1; // source column offset of w[0]
+        std::vector<float> w; // weights for columns dx1 .. dx1 + w.size() - 1
+    };
+    std::vector<TranslationKernelRow> _translationKernel; // empty if the fast path cannot be used
+    OFX::MaskOccupancy _maskOccupancy; // built by preProcess(), to skip the regions where the mask is 0 or 1
+#ifdef OFXS_INSTRUMENTATION
+    OFX::Instrumentation::ProcessRecorder _instrumentation;
+#endif
+
 public:
 
     Transform3x3ProcessorBase(OFX::ImageEffect &instance)
         : OFX::ImageProcessor(instance)
         , _srcImg(NULL)
         , _maskImg(NULL)
+        , _dstPixelData(NULL)
+        , _dstBounds()
+        , _dstPixelComponentCount(0)
+        , _dstBitDepth(OFX::eBitDepthNone)
+        , _dstRowBytes(0)
         , _invtransform()
         , _invtransformalpha(NULL)
         , _invtransformsize(0)
@@ -74,6 +115,25 @@ public:
     virtual FilterEnum getFilter() const = 0;
     virtual bool getClamp() const = 0;
 
+    using OFX::ImageProcessor::setDstImg;
+
+    /** @brief set the destination from a pixel buffer, instead of an OFX::Image (e.g. for a
+        PixelProcessorPipeline). ImageProcessor::process() does nothing without an OFX::Image. */
+    void setDstImg(void *dstPixelData,
+                   const OfxRectI & dstBounds,
+                   OFX::PixelComponentEnum /*dstPixelComponents*/,
+                   int dstPixelComponentCount,
+                   OFX::BitDepthEnum dstPixelDepth,
+                   int dstRowBytes)
+    {
+        _dstImg = NULL;
+        _dstPixelData = dstPixelData;
+        _dstBounds = dstBounds;
+        _dstPixelComponentCount = dstPixelComponentCount;
+        _dstBitDepth = dstPixelDepth;
+        _dstRowBytes = dstRowBytes;
+    }
+
     /** @brief set the src image */
     void setSrcImg(const OFX::Image *v)
     {
@@ -110,7 +170,241 @@ public:
         _blackOutside = blackOutside;
         _motionblur = motionblur;
         _mix = mix;
+
+        _translationKernel.clear();
+        if ( (_motionblur != 0.) && (_invtransformsize > 1) ) {
+            computeTranslationKernel(getFilter(), getClamp());
+        }
     }
+
+#ifdef OFXS_INSTRUMENTATION
+    // ImageProcessor::process() does not tell when the parallel section starts and ends:
+    // it is deduced from the thread records
+    virtual void process(void) OVERRIDE
+    {
+        _instrumentation.beginProcess( typeid(*this).name(), OFX::MultiThread::getNumCPUs() );
+        OFX::ImageProcessor::process();
+        if (_maskOccupancy.getTileCount() > 0) {
+            _instrumentation.setMaskTilesSkipped( _maskOccupancy.getSkippedFraction() );
+        }
+        _instrumentation.endProcess();
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE
+    {
+        int y1, y2;
+
+        _instrumentation.beginThread(threadId);
+        OFX::ImageProcessor::multiThreadFunction(threadId, nThreads);
+        OFX::MultiThread::getThreadRange(threadId, nThreads, _renderWindow.y1, _renderWindow.y2, &y1, &y2);
+        _instrumentation.endThread( threadId, (double)(_renderWindow.x2 - _renderWindow.x1) * std::max(0, y2 - y1), _effect.abort() );
+    }
+#endif
+
+protected:
+    void* getDstPixelAddress(int x,
+                             int y) const
+    {
+        if (_dstImg) {
+            return _dstImg->getPixelAddress(x, y);
+        }
+
+        return _dstPixelData ? OFX::getPixelAddress(_dstPixelData, _dstBounds, _dstPixelComponentCount, _dstBitDepth, _dstRowBytes, x, y) : NULL;
+    }
+
+private:
+    // Compute the weights of the 1D interpolation filter at offset f (in pixels, relative to
+    // the center of the destination pixel) along one axis.
+    // Returns the number of weights, and the offset of the first one in *first.
+    // Returns 0 if the filter is not linear in the pixel values.
+    static int translationFilterWeights(FilterEnum filter,
+                                        bool clamp,
+                                        double f,
+                                        int* first,
+                                        double w[4])
+    {
+        // the center of pixel (0,0) has coordinates (0.5,0.5): see ofxsFilterInterpolate2D()
+        const int c = (int)std::floor(f);
+        const double d = f - c;
+
+        switch (filter) {
+        case eFilterImpulse:
+            *first = (int)std::floor(f + 0.5);
+            w[0] = 1.;
+
+            return 1;
+        case eFilterBox: // with no scaling, box is the integral over the pixel area, which is bilinear
+        case eFilterBilinear:
+            *first = c;
+            w[0] = 1. - d;
+            w[1] = d;
+
+            return 2;
+        case eFilterCubic: {
+            // the cubic filter is a convex combination of the two neighbors: clamping has no effect
+            const double s = d * d * (3. - 2. * d);
+            *first = c;
+            w[0] = 1. - s;
+            w[1] = s;
+
+            return 2;
+        }
+        case eFilterKeys:
+        case eFilterSimon:
+        case eFilterRifman:
+        case eFilterMitchell:
+        case eFilterParzen:
+        case eFilterNotch: {
+            if ( clamp && (filter != eFilterParzen) && (filter != eFilterNotch) ) {
+                // clamping is not linear
+                return 0;
+            }
+            *first = c - 1;
+            for (int i = 0; i < 4; ++i) {
+                const double Ip = (i == 0), Ic = (i == 1), In = (i == 2), Ia = (i == 3);
+                switch (filter) {
+                case eFilterKeys:
+                    w[i] = ofxsFilterKeys(Ip, Ic, In, Ia, d, false);
+                    break;
+                case eFilterSimon:
+                    w[i] = ofxsFilterSimon(Ip, Ic, In, Ia, d, false);
+                    break;
+                case eFilterRifman:
+                    w[i] = ofxsFilterRifman(Ip, Ic, In, Ia, d, false);
+                    break;
+                case eFilterMitchell:
+                    w[i] = ofxsFilterMitchell(Ip, Ic, In, Ia, d, false);
+                    break;
+                case eFilterParzen:
+                    w[i] = ofxsFilterParzen(Ip, Ic, In, Ia, d, false);
+                    break;
+                case eFilterNotch:
+                default:
+                    w[i] = ofxsFilterNotch(Ip, Ic, In, Ia, d, false);
+                    break;
+                }
+            }
+
+            return 4;
+        }
+        } // switch
+
+        return 0;
+    } // translationFilterWeights
+
+    // Add the interpolation kernel of a translation by (fx,fy), with weight alpha, to taps.
+    // Returns false if the filter is not linear in the pixel values.
+    static bool addTranslationTaps(FilterEnum filter,
+                                   bool clamp,
+                                   double fx,
+                                   double fy,
+                                   double alpha,
+                                   std::map<std::pair<int, int>, double> & taps)
+    {
+        int firstx, firsty;
+        double wx[4], wy[4];
+        const int nx = translationFilterWeights(filter, clamp, fx, &firstx, wx);
+        const int ny = translationFilterWeights(filter, clamp, fy, &firsty, wy);
+
+        if ( (nx == 0) || (ny == 0) ) {
+            return false;
+        }
+        for (int j = 0; j < ny; ++j) {
+            for (int k = 0; k < nx; ++k) {
+                taps[std::make_pair(firsty + j, firstx + k)] += alpha * wy[j] * wx[k];
+            }
+        }
+
+        return true;
+    }
+
+    // If all transforms are pure translations, fill _translationKernel with the sum of the
+    // interpolation kernels of all the transforms, weighted by _invtransformalpha.
+    // The result is exactly the weighted average over all the transforms, computed
+    // without Monte Carlo sampling, at a cost which does not depend on _invtransformsize.
+    // The number of taps grows with the length of the blur: if there are more than
+    // kTransform3x3ProcessorTranslationMaxSamples interpolation kernels worth of taps, the path
+    // of the translations is resampled to kTransform3x3ProcessorTranslationMaxSamples translations
+    // evenly spaced along its length, so that the cost does not depend on the length of the blur either.
+    void computeTranslationKernel(FilterEnum filter,
+                                  bool clamp)
+    {
+        const double eps = kTransform3x3ProcessorTranslationEpsilon;
+        std::vector<double> tx, ty, ta; // the translations with a nonzero weight, in shutter order
+        std::map<std::pair<int, int>, double> taps; // (dy, dx) -> weight
+        double sum = 0.;
+
+        for (size_t i = 0; i < _invtransformsize; ++i) {
+            const OFX::Matrix3x3 & H = _invtransform[i];
+            if ( (H(2,2) <= 0.) || (std::abs(H(2,0)) > eps) || (std::abs(H(2,1)) > eps) ||
+                 (std::abs(H(0,0) / H(2,2) - 1.) > eps) || (std::abs(H(0,1) / H(2,2)) > eps) ||
+                 (std::abs(H(1,0) / H(2,2)) > eps) || (std::abs(H(1,1) / H(2,2) - 1.) > eps) ) {
+                // not a translation
+
+                return;
+            }
+            const double alpha = _invtransformalpha ? _invtransformalpha[i] : 1.;
+            if (alpha == 0.) {
+                continue;
+            }
+            tx.push_back( H(0,2) / H(2,2) );
+            ty.push_back( H(1,2) / H(2,2) );
+            ta.push_back(alpha);
+            if ( !addTranslationTaps(filter, clamp, tx.back(), ty.back(), alpha, taps) ) {
+                return;
+            }
+            sum += alpha;
+        }
+        if (sum <= 0.) {
+            return;
+        }
+
+        // the number of taps of a single interpolation kernel
+        int first;
+        double w[4];
+        const int filterSize = translationFilterWeights(filter, clamp, 0., &first, w);
+        if ( taps.size() > (size_t)kTransform3x3ProcessorTranslationMaxSamples * filterSize * filterSize ) {
+            // merge the translations into bins of equal length along the path, each replaced
+            // by the weighted average of its translations
+            std::vector<double> s( tx.size() ); // curvilinear abscissa
+            s[0] = 0.;
+            for (size_t i = 1; i < tx.size(); ++i) {
+                s[i] = s[i - 1] + std::sqrt( (tx[i] - tx[i - 1]) * (tx[i] - tx[i - 1]) + (ty[i] - ty[i - 1]) * (ty[i] - ty[i - 1]) );
+            }
+            const int nBins = kTransform3x3ProcessorTranslationMaxSamples;
+            std::vector<double> bx(nBins, 0.), by(nBins, 0.), ba(nBins, 0.);
+            for (size_t i = 0; i < tx.size(); ++i) {
+                const int b = ( s.back() > 0. ) ? std::min( nBins - 1, (int)(s[i] / s.back() * nBins) ) : 0;
+                bx[b] += ta[i] * tx[i];
+                by[b] += ta[i] * ty[i];
+                ba[b] += ta[i];
+            }
+            taps.clear();
+            for (int b = 0; b < nBins; ++b) {
+                if (ba[b] != 0.) {
+                    addTranslationTaps(filter, clamp, bx[b] / ba[b], by[b] / ba[b], ba[b], taps);
+                }
+            }
+        }
+
+        // convert to rows of contiguous weights, normalized so that they sum to 1
+        std::vector<TranslationKernelRow> kernel;
+        for (std::map<std::pair<int, int>, double>::const_iterator it = taps.begin(); it != taps.end(); ++it) {
+            const int dy = it->first.first;
+            const int dx = it->first.second;
+            if ( kernel.empty() || (kernel.back().dy != dy) ) {
+                kernel.push_back( TranslationKernelRow() );
+                kernel.back().dy = dy;
+                kernel.back().dx1 = dx;
+            }
+            TranslationKernelRow & row = kernel.back();
+            // the map is sorted by dx within a row: fill the gaps with zeroes
+            row.w.resize(dx - row.dx1 + 1, 0.f);
+            row.w.back() = (float)(it->second / sum);
+        }
+        _translationKernel.swap(kernel);
+    } // computeTranslationKernel
 };
 
 
@@ -137,11 +431,20 @@ private:
         return clamp;
     }
 
+public:
+    // public, as in ImageProcessor, so that the processor can be a source stage of a PixelProcessorPipeline
+    virtual void preProcess() OVERRIDE
+    {
+        _maskOccupancy.build<PIX, maxValue>(_renderWindow, masked && _domask, _maskImg, (float)_mix, _maskInvert);
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE
     {
         assert(_invtransform);
         if (_motionblur == 0.) { // no motion blur
             return multiThreadProcessImagesNoBlur(procWindow);
+        } else if ( _srcImg && !_translationKernel.empty() ) { // motion blur along a translation
+            return multiThreadProcessImagesTranslationBlur(procWindow);
         } else { // motion blur
             return multiThreadProcessImagesMotionBlur(procWindow);
         }
@@ -150,7 +453,7 @@ private:
 private:
     void multiThreadProcessImagesNoBlur(const OfxRectI &procWindow)
     {
-        float tmpPix[nComponents];
+        std::vector<float> tmpRow( (procWindow.x2 - procWindow.x1) * nComponents );
         const OFX::Matrix3x3 & H = _invtransform[0];
         const int x1 = _srcImg ? _srcImg->getBounds().x1 : 0;
         const int x2 = _srcImg ? _srcImg->getBounds().x2 : 0;
@@ -162,7 +465,7 @@ private:
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            PIX *dstPix = (PIX *) getDstPixelAddress(procWindow.x1, y);
 
             // the coordinates of the center of the pixel in canonical coordinates
             // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
@@ -170,39 +473,48 @@ private:
             canonicalCoords.z = 1;
             canonicalCoords.y = (double)y + 0.5;
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                // NON-GENERIC TRANSFORM
-
-                // the coordinates of the center of the pixel in canonical coordinates
-                // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
-                canonicalCoords.x = (double)x + 0.5;
-                OFX::Point3D transformed = H * canonicalCoords;
-                if ( !_srcImg || (transformed.z <= 0.) ) {
-                    // the back-transformed point is at infinity (==0) or behind the camera (<0)
-                    for (int c = 0; c < nComponents; ++c) {
-                        tmpPix[c] = 0;
-                    }
-                } else {
-                    double fx = transformed.z != 0 ? transformed.x / transformed.z : transformed.x;
-                    double fy = transformed.z != 0 ? transformed.y / transformed.z : transformed.y;
-                    if (filter == eFilterImpulse) {
-                        ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
-                    } else {
-                        bool xinside = (x1 <= fx + 0.5 && fx - 0.5 < x2);
-                        bool yinside = (y1 <= fy + 0.5 && fy - 0.5 < y2);
-                        if ( _blackOutside && !(xinside && yinside) ) {
-                            xinside = yinside = false;
+            for (int rx1 = procWindow.x1, rx2; rx1 < procWindow.x2; rx1 = rx2) {
+                // the pixels [rx1, rx2) have the same mask state
+                const MaskOccupancy::TileStateEnum state = _maskOccupancy.getRun(rx1, procWindow.x2, y, &rx2);
+                if (state == MaskOccupancy::eTileStateZero) {
+                    // the output is the source image, there is nothing to transform
+                    ofxsBackgroundRow<PIX, nComponents, maxValue>(rx1, rx2, y, _srcImg, dstPix + (rx1 - procWindow.x1) * nComponents);
+                    continue;
+                }
+                for (int x = rx1; x < rx2; ++x) {
+                    float *tmpPix = &tmpRow[(x - procWindow.x1) * nComponents];
+                    // NON-GENERIC TRANSFORM
+
+                    // the coordinates of the center of the pixel in canonical coordinates
+                    // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
+                    canonicalCoords.x = (double)x + 0.5;
+                    OFX::Point3D transformed = H * canonicalCoords;
+                    if ( !_srcImg || (transformed.z <= 0.) ) {
+                        // the back-transformed point is at infinity (==0) or behind the camera (<0)
+                        for (int c = 0; c < nComponents; ++c) {
+                            tmpPix[c] = 0;
                         }
+                    } else {
+                        double fx = transformed.z != 0 ? transformed.x / transformed.z : transformed.x;
+                        double fy = transformed.z != 0 ? transformed.y / transformed.z : transformed.y;
+                        if (filter == eFilterImpulse) {
+                            ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+                        } else {
+                            bool xinside = (x1 <= fx + 0.5 && fx - 0.5 < x2);
+                            bool yinside = (y1 <= fy + 0.5 && fy - 0.5 < y2);
+                            if ( _blackOutside && !(xinside && yinside) ) {
+                                xinside = yinside = false;
+                            }
 
-                        double Jxx = xinside ? (H(0,0) * transformed.z - transformed.x * H(2,0)) / (transformed.z * transformed.z) : 0.;
-                        double Jxy = xinside ? (H(0,1) * transformed.z - transformed.x * H(2,1)) / (transformed.z * transformed.z) : 0.;
-                        double Jyx = yinside ? (H(1,0) * transformed.z - transformed.y * H(2,0)) / (transformed.z * transformed.z) : 0;
-                        double Jyy = yinside ? (H(1,1) * transformed.z - transformed.y * H(2,1)) / (transformed.z * transformed.z) : 0.;
-                        ofxsFilterInterpolate2DSuper<PIX, nComponents, filter, clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+                            double Jxx = xinside ? (H(0,0) * transformed.z - transformed.x * H(2,0)) / (transformed.z * transformed.z) : 0.;
+                            double Jxy = xinside ? (H(0,1) * transformed.z - transformed.x * H(2,1)) / (transformed.z * transformed.z) : 0.;
+                            double Jyx = yinside ? (H(1,0) * transformed.z - transformed.y * H(2,0)) / (transformed.z * transformed.z) : 0;
+                            double Jyy = yinside ? (H(1,1) * transformed.z - transformed.y * H(2,1)) / (transformed.z * transformed.z) : 0.;
+                            ofxsFilterInterpolate2DSuper<PIX, nComponents, filter, clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+                        }
                     }
                 }
-
-                ofxsMaskMix<PIX, nComponents, maxValue, masked>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+                ofxsMaskMixRun<PIX, nComponents, maxValue, masked>(state, &tmpRow[(rx1 - procWindow.x1) * nComponents], rx1, rx2, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix + (rx1 - procWindow.x1) * nComponents);
             }
         }
     } // multiThreadProcessImagesNoBlur
@@ -210,6 +522,7 @@ private:
     void multiThreadProcessImagesMotionBlur(const OfxRectI &procWindow)
     {
         float tmpPix[nComponents];
+        std::vector<float> tmpRow( (procWindow.x2 - procWindow.x1) * nComponents );
         const double maxErr2 = kTransform3x3ProcessorMotionBlurMaxError * kTransform3x3ProcessorMotionBlurMaxError; // maximum expected squared error
         const int maxIt = kTransform3x3ProcessorMotionBlurMaxIterations; // maximum number of iterations
         const int x1 = _srcImg ? _srcImg->getBounds().x1 : 0;
@@ -224,7 +537,7 @@ private:
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            PIX *dstPix = (PIX *) getDstPixelAddress(procWindow.x1, y);
 
             // the coordinates of the center of the pixel in canonical coordinates
             // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
@@ -232,126 +545,214 @@ private:
             canonicalCoords.z = 1;
             canonicalCoords.y = (double)y + 0.5;
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
-                double acc;
-                double accPix[nComponents];
-                double accPix2[nComponents];
-                double mean[nComponents];
-                double var[nComponents];
-                for (int c = 0; c < nComponents; ++c) {
-                    acc = 0.;
-                    accPix[c] = 0;
-                    accPix2[c] = 0;
-                    mean[c] = 0.;
-                    var[c] = (double)maxValue * maxValue;
+            for (int rx1 = procWindow.x1, rx2; rx1 < procWindow.x2; rx1 = rx2) {
+                // the pixels [rx1, rx2) have the same mask state
+                const MaskOccupancy::TileStateEnum state = _maskOccupancy.getRun(rx1, procWindow.x2, y, &rx2);
+                if (state == MaskOccupancy::eTileStateZero) {
+                    // the output is the source image, there is nothing to transform
+                    ofxsBackgroundRow<PIX, nComponents, maxValue>(rx1, rx2, y, _srcImg, dstPix + (rx1 - procWindow.x1) * nComponents);
+                    continue;
                 }
-                unsigned int seed = (unsigned int)( hash(hash( x + (unsigned int)(0x10000 * _motionblur) ) + y) );
-                int sample = 0;
-                const int minsamples = kTransform3x3ProcessorMotionBlurMinIterations; // minimum number of samples (at most maxIt/3
-                int maxsamples = minsamples;
-                while (sample < maxsamples) {
-                    for (; sample < maxsamples; ++sample, ++seed) {
-                        //int t = 0.5*(van_der_corput<2>(seed1) + van_der_corput<3>(seed2)) * _invtransform.size();
-                        int t;
-                        if (sample < minsamples) {
-                            // distribute the first samples evenly over the interval
-                            t = (int)( ( sample  + van_der_corput<2>(seed) ) * _invtransformsize / (double)minsamples );
-                        } else {
-                            t = (int)(van_der_corput<2>(seed) * _invtransformsize);
-                        }
-                        // NON-GENERIC TRANSFORM
-
-                        // the coordinates of the center of the pixel in canonical coordinates
-                        // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
-                        canonicalCoords.x = (double)x + 0.5;
-                        const OFX::Matrix3x3& H = _invtransform[t];
-                        OFX::Point3D transformed = H * canonicalCoords;
-                        if ( !_srcImg || (transformed.z <= 0.) ) {
-                            // the back-transformed point is at infinity (==0) or behind the camera (<0)
-                            for (int c = 0; c < nComponents; ++c) {
-                                tmpPix[c] = 0;
+                for (int x = rx1; x < rx2; ++x) {
+                    double acc;
+                    double accPix[nComponents];
+                    double accPix2[nComponents];
+                    double mean[nComponents];
+                    double var[nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        acc = 0.;
+                        accPix[c] = 0;
+                        accPix2[c] = 0;
+                        mean[c] = 0.;
+                        var[c] = (double)maxValue * maxValue;
+                    }
+                    unsigned int seed = (unsigned int)( hash(hash( x + (unsigned int)(0x10000 * _motionblur) ) + y) );
+                    int sample = 0;
+                    const int minsamples = kTransform3x3ProcessorMotionBlurMinIterations; // minimum number of samples (at most maxIt/3
+                    int maxsamples = minsamples;
+                    while (sample < maxsamples) {
+                        for (; sample < maxsamples; ++sample, ++seed) {
+                            //int t = 0.5*(van_der_corput<2>(seed1) + van_der_corput<3>(seed2)) * _invtransform.size();
+                            int t;
+                            if (sample < minsamples) {
+                                // distribute the first samples evenly over the interval
+                                t = (int)( ( sample  + van_der_corput<2>(seed) ) * _invtransformsize / (double)minsamples );
+                            } else {
+                                t = (int)(van_der_corput<2>(seed) * _invtransformsize);
                             }
-                        } else {
-                            double fx = transformed.z != 0 ? transformed.x / transformed.z : transformed.x;
-                            double fy = transformed.z != 0 ? transformed.y / transformed.z : transformed.y;
-                            if (filter == eFilterImpulse) {
-                                ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+                            // NON-GENERIC TRANSFORM
+
+                            // the coordinates of the center of the pixel in canonical coordinates
+                            // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
+                            canonicalCoords.x = (double)x + 0.5;
+                            const OFX::Matrix3x3& H = _invtransform[t];
+                            OFX::Point3D transformed = H * canonicalCoords;
+                            if ( !_srcImg || (transformed.z <= 0.) ) {
+                                // the back-transformed point is at infinity (==0) or behind the camera (<0)
+                                for (int c = 0; c < nComponents; ++c) {
+                                    tmpPix[c] = 0;
+                                }
                             } else {
-                                bool xinside = (x1 <= fx + 0.5 && fx - 0.5 < x2);
-                                bool yinside = (y1 <= fy + 0.5 && fy - 0.5 < y2);
-                                if ( _blackOutside && !(xinside && yinside) ) {
-                                    xinside = yinside = false;
+                                double fx = transformed.z != 0 ? transformed.x / transformed.z : transformed.x;
+                                double fy = transformed.z != 0 ? transformed.y / transformed.z : transformed.y;
+                                if (filter == eFilterImpulse) {
+                                    ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+                                } else {
+                                    bool xinside = (x1 <= fx + 0.5 && fx - 0.5 < x2);
+                                    bool yinside = (y1 <= fy + 0.5 && fy - 0.5 < y2);
+                                    if ( _blackOutside && !(xinside && yinside) ) {
+                                        xinside = yinside = false;
+                                    }
+
+                                    double Jxx = xinside ? (H(0,0) * transformed.z - transformed.x * H(2,0)) / (transformed.z * transformed.z) : 0.;
+                                    double Jxy = xinside ? (H(0,1) * transformed.z - transformed.x * H(2,1)) / (transformed.z * transformed.z) : 0.;
+                                    double Jyx = yinside ? (H(1,0) * transformed.z - transformed.y * H(2,0)) / (transformed.z * transformed.z) : 0;
+                                    double Jyy = yinside ? (H(1,1) * transformed.z - transformed.y * H(2,1)) / (transformed.z * transformed.z) : 0.;
+                                    ofxsFilterInterpolate2DSuper<PIX, nComponents, filter, clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+                                }
+                            }
+                            if (!_invtransformalpha) {
+                                for (int c = 0; c < nComponents; ++c) {
+                                    accPix[c] += tmpPix[c];
+                                    accPix2[c] += tmpPix[c] * tmpPix[c];
+                                }
+                            } else {
+                                acc += _invtransformalpha[t];
+                                for (int c = 0; c < nComponents; ++c) {
+                                    accPix[c] += tmpPix[c] * _invtransformalpha[t];
+                                    accPix2[c] += tmpPix[c] * tmpPix[c] * _invtransformalpha[t];
                                 }
-
-                                double Jxx = xinside ? (H(0,0) * transformed.z - transformed.x * H(2,0)) / (transformed.z * transformed.z) : 0.;
-                                double Jxy = xinside ? (H(0,1) * transformed.z - transformed.x * H(2,1)) / (transformed.z * transformed.z) : 0.;
-                                double Jyx = yinside ? (H(1,0) * transformed.z - transformed.y * H(2,0)) / (transformed.z * transformed.z) : 0;
-                                double Jyy = yinside ? (H(1,1) * transformed.z - transformed.y * H(2,1)) / (transformed.z * transformed.z) : 0.;
-                                ofxsFilterInterpolate2DSuper<PIX, nComponents, filter, clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
                             }
                         }
                         if (!_invtransformalpha) {
+                            // compute mean and variance (unbiased)
                             for (int c = 0; c < nComponents; ++c) {
-                                accPix[c] += tmpPix[c];
-                                accPix2[c] += tmpPix[c] * tmpPix[c];
+                                mean[c] = accPix[c] / sample;
+                                if (sample <= 1) {
+                                    var[c] = (double)maxValue * maxValue;
+                                } else {
+                                    var[c] = (accPix2[c] - mean[c] * mean[c] * sample) / (sample - 1);
+                                    // the variance of the mean is var[c]/n, so compute n so that it falls below some threashold (maxErr2).
+                                    // Note that this could be improved/optimized further by variance reduction and importance sampling
+                                    // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-17-monte-carlo-methods-in-practice/variance-reduction-methods-a-quick-introduction-to-importance-sampling/
+                                    // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-xx-introduction-to-importance-sampling/
+                                    // The threshold is computed by a simple rule of thumb:
+                                    // - the error should be less than motionblur*maxValue/100
+                                    // - the total number of iterations should be less than motionblur*100
+                                    if (maxsamples < maxIt) {
+                                        maxsamples = std::max( maxsamples, std::min( (int)(var[c] / maxErr2), maxIt ) );
+                                    }
+                                }
                             }
-                        } else {
-                            acc += _invtransformalpha[t];
+                        } else if (acc > 0.) {
+                            // compute mean and variance (biased)
                             for (int c = 0; c < nComponents; ++c) {
-                                accPix[c] += tmpPix[c] * _invtransformalpha[t];
-                                accPix2[c] += tmpPix[c] * tmpPix[c] * _invtransformalpha[t];
+                                mean[c] = accPix[c] / acc;
+                                if (sample <= 1) {
+                                    var[c] = (double)maxValue * maxValue;
+                                } else {
+                                    var[c] = accPix2[c] / acc - mean[c] * mean[c];
+                                    // the variance of the mean is var[c]/n, so compute n so that it falls below some threashold (maxErr2).
+                                    // Note that this could be improved/optimized further by variance reduction and importance sampling
+                                    // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-17-monte-carlo-methods-in-practice/variance-reduction-methods-a-quick-introduction-to-importance-sampling/
+                                    // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-xx-introduction-to-importance-sampling/
+                                    // The threshold is computed by a simple rule of thumb:
+                                    // - the error should be less than motionblur*maxValue/100
+                                    // - the total number of iterations should be less than motionblur*100
+                                    if (maxsamples < maxIt) {
+                                        maxsamples = std::max( maxsamples, std::min( (int)(var[c] / maxErr2), maxIt ) );
+                                    }
+                                }
                             }
                         }
                     }
-                    if (!_invtransformalpha) {
-                        // compute mean and variance (unbiased)
-                        for (int c = 0; c < nComponents; ++c) {
-                            mean[c] = accPix[c] / sample;
-                            if (sample <= 1) {
-                                var[c] = (double)maxValue * maxValue;
-                            } else {
-                                var[c] = (accPix2[c] - mean[c] * mean[c] * sample) / (sample - 1);
-                                // the variance of the mean is var[c]/n, so compute n so that it falls below some threashold (maxErr2).
-                                // Note that this could be improved/optimized further by variance reduction and importance sampling
-                                // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-17-monte-carlo-methods-in-practice/variance-reduction-methods-a-quick-introduction-to-importance-sampling/
-                                // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-xx-introduction-to-importance-sampling/
-                                // The threshold is computed by a simple rule of thumb:
-                                // - the error should be less than motionblur*maxValue/100
-                                // - the total number of iterations should be less than motionblur*100
-                                if (maxsamples < maxIt) {
-                                    maxsamples = std::max( maxsamples, std::min( (int)(var[c] / maxErr2), maxIt ) );
+                    float *meanPix = &tmpRow[(x - procWindow.x1) * nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        meanPix[c] = (float)mean[c];
+                    }
+                }
+                ofxsMaskMixRun<PIX, nComponents, maxValue, masked>(state, &tmpRow[(rx1 - procWindow.x1) * nComponents], rx1, rx2, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix + (rx1 - procWindow.x1) * nComponents);
+            }
+        }
+    } // multiThreadProcessImagesMotionBlur
+
+    // Motion blur when all transforms are translations: convolve each row of the source
+    // by the rows of _translationKernel (see computeTranslationKernel()).
+    // Boundary conditions are the same as ofxsFilterInterpolate2D(): black or nearest.
+    void multiThreadProcessImagesTranslationBlur(const OfxRectI &procWindow)
+    {
+        assert(_srcImg && !_translationKernel.empty());
+        const OfxRectI & srcBounds = _srcImg->getBounds();
+        const bool srcEmpty = (srcBounds.x2 <= srcBounds.x1) || (srcBounds.y2 <= srcBounds.y1) || !_srcImg->getPixelData();
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> accRow(width * nComponents);
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) getDstPixelAddress(procWindow.x1, y);
+            for (int rx1 = procWindow.x1, rx2; rx1 < procWindow.x2; rx1 = rx2) {
+                // the pixels [rx1, rx2) have the same mask state
+                const MaskOccupancy::TileStateEnum state = _maskOccupancy.getRun(rx1, procWindow.x2, y, &rx2);
+                if (state == MaskOccupancy::eTileStateZero) {
+                    // the output is the source image, there is nothing to blur
+                    ofxsBackgroundRow<PIX, nComponents, maxValue>(rx1, rx2, y, _srcImg, dstPix + (rx1 - procWindow.x1) * nComponents);
+                    continue;
+                }
+                float *acc = &accRow[(rx1 - procWindow.x1) * nComponents];
+                std::fill( acc, acc + (rx2 - rx1) * nComponents, 0.f );
+                for (size_t r = 0; r < _translationKernel.size() && !srcEmpty; ++r) {
+                    const TranslationKernelRow & kr = _translationKernel[r];
+                    int sy = y + kr.dy;
+                    if ( (sy < srcBounds.y1) || (srcBounds.y2 <= sy) ) {
+                        if (_blackOutside) {
+                            continue;
+                        }
+                        sy = std::max( srcBounds.y1, std::min(sy, srcBounds.y2 - 1) );
+                    }
+                    const PIX *srcRow = (const PIX *) _srcImg->getPixelAddress(srcBounds.x1, sy);
+                    assert(srcRow);
+                    const PIX *srcLast = srcRow + (srcBounds.x2 - 1 - srcBounds.x1) * nComponents;
+                    for (int j = 0; j < (int)kr.w.size(); ++j) {
+                        const float w = kr.w[j];
+                        if (w == 0.f) {
+                            continue;
+                        }
+                        // destination pixel x reads source pixel x + s
+                        const int s = kr.dx1 + j;
+                        const int xin1 = std::min( rx2, std::max(rx1, srcBounds.x1 - s) );
+                        const int xin2 = std::max( xin1, std::min(rx2, srcBounds.x2 - s) );
+                        if (!_blackOutside) {
+                            // nearest boundary conditions: repeat the first and last pixels
+                            for (int x = rx1; x < xin1; ++x) {
+                                float *a = acc + (x - rx1) * nComponents;
+                                for (int c = 0; c < nComponents; ++c) {
+                                    a[c] += w * srcRow[c];
                                 }
                             }
-                        }
-                    } else if (acc > 0.) {
-                        // compute mean and variance (biased)
-                        for (int c = 0; c < nComponents; ++c) {
-                            mean[c] = accPix[c] / acc;
-                            if (sample <= 1) {
-                                var[c] = (double)maxValue * maxValue;
-                            } else {
-                                var[c] = accPix2[c] / acc - mean[c] * mean[c];
-                                // the variance of the mean is var[c]/n, so compute n so that it falls below some threashold (maxErr2).
-                                // Note that this could be improved/optimized further by variance reduction and importance sampling
-                                // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-17-monte-carlo-methods-in-practice/variance-reduction-methods-a-quick-introduction-to-importance-sampling/
-                                // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-xx-introduction-to-importance-sampling/
-                                // The threshold is computed by a simple rule of thumb:
-                                // - the error should be less than motionblur*maxValue/100
-                                // - the total number of iterations should be less than motionblur*100
-                                if (maxsamples < maxIt) {
-                                    maxsamples = std::max( maxsamples, std::min( (int)(var[c] / maxErr2), maxIt ) );
+                            for (int x = xin2; x < rx2; ++x) {
+                                float *a = acc + (x - rx1) * nComponents;
+                                for (int c = 0; c < nComponents; ++c) {
+                                    a[c] += w * srcLast[c];
                                 }
                             }
                         }
+                        if (xin1 < xin2) {
+                            float *a = acc + (xin1 - rx1) * nComponents;
+                            const PIX *p = srcRow + (xin1 + s - srcBounds.x1) * nComponents;
+                            const int n = (xin2 - xin1) * nComponents;
+                            for (int i = 0; i < n; ++i) {
+                                a[i] += w * p[i];
+                            }
+                        }
                     }
                 }
-                for (int c = 0; c < nComponents; ++c) {
-                    tmpPix[c] = (float)mean[c];
-                }
-                ofxsMaskMix<PIX, nComponents, maxValue, masked>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+                ofxsMaskMixRun<PIX, nComponents, maxValue, masked>(state, acc, rx1, rx2, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix + (rx1 - procWindow.x1) * nComponents);
             }
         }
-    } // multiThreadProcessImagesMotionBlur
+    } // multiThreadProcessImagesTranslationBlur
 
     // Compute the /seed/th element of the van der Corput sequence
     // see http://en.wikipedia.org/wiki/Van_der_Corput_sequence